@@ -17,11 +17,15 @@ usage() {
 	  --packet-trace               Enable raw packet trace for diagnostics
 	  --data-trace                 Enable command/reply data buffer tracing
 	  --skip-mark                  Don't send the leading mark byte (0xFF)
-	  --crypto LIB                 Use methods from LIB (openssl/mbedtls/*tinyaes)
+	  --crypto LIB                 Use methods from LIB (openssl/mbedtls/native/*tinyaes)
 	  --crypto-include-dir DIR     Include directory for crypto LIB if not in system path
 	  --crypto-ld-flags            Args to pass to linker for the crypto LIB
 	  --no-colours                 Don't colourize log ouputs
 	  --static-pd                  Setup PD single statically
+	  --sc-worker                  Run CP secure channel handshake crypto on worker threads
+	  --file-write-behind          Stage received file chunks on the PD and write them out in pages
+	  --file-read-ahead            Read file chunks ahead on the CP while the bus is busy
+	  --file-compression           Compress file transfers between LibOSDP CPs and PDs
 	  --lib-only                   Only build the library
 	  --cross-compile PREFIX       Use to pass a compiler prefix
 	  --prefix PATH                Install path prefix (default: /usr)
@@ -47,6 +51,10 @@ while [ $# -gt 0 ]; do
 	--crypto-ld-flags)     CRYPTO_LD_FLAGS=$2; shift;;
 	--no-colours)          NO_COLOURS=1;;
 	--static-pd)           STATIC_PD=1;;
+	--sc-worker)           SC_WORKER=1;;
+	--file-write-behind)   FILE_WRITE_BEHIND=1;;
+	--file-read-ahead)     FILE_READ_AHEAD=1;;
+	--file-compression)    FILE_COMPRESSION=1;;
 	--lib-only)            LIB_ONLY=1;;
 	--build-dir)           BUILD_DIR=$2; shift;;
 	-d|--debug)            DEBUG=1;;
@@ -100,6 +108,18 @@ if [[ ! -z "${STATIC_PD}" ]]; then
 	CCFLAGS+=" -DCONFIG_OSDP_STATIC_PD"
 fi
 
+if [[ ! -z "${FILE_WRITE_BEHIND}" ]]; then
+	CCFLAGS+=" -DCONFIG_OSDP_FILE_WRITE_BEHIND"
+fi
+
+if [[ ! -z "${FILE_READ_AHEAD}" ]]; then
+	CCFLAGS+=" -DCONFIG_OSDP_FILE_READ_AHEAD"
+fi
+
+if [[ ! -z "${FILE_COMPRESSION}" ]]; then
+	CCFLAGS+=" -DCONFIG_OSDP_FILE_COMPRESSION"
+fi
+
 if [[ ! -z "${DEBUG}" ]]; then
 	CCFLAGS+=" -g"
 fi
@@ -125,9 +145,11 @@ if [[ "${CRYPTO}" == "openssl" ]]; then
 elif [[ "${CRYPTO}" == "mbedtls" ]]; then
 	LIBOSDP_SOURCES+=" src/crypto/mbedtls.c"
 	LDFLAGS+=" -lmbedcrypto -lmbedtls"
+elif [[ "${CRYPTO}" == "native" ]]; then
+	LIBOSDP_SOURCES+=" src/crypto/tinyaes_src.c src/crypto/native.c src/crypto/random.c"
 else
 	echo "Using in-tree AES methods. Consider using openssl/mbedtls (see --crypto)"
-	LIBOSDP_SOURCES+=" src/crypto/tinyaes_src.c src/crypto/tinyaes.c"
+	LIBOSDP_SOURCES+=" src/crypto/tinyaes_src.c src/crypto/tinyaes.c src/crypto/random.c"
 fi
 
 if [[ ! -z "${CRYPTO_INCLUDE_DIR}" ]]; then
@@ -144,12 +166,21 @@ LIBOSDP_SOURCES+=" src/osdp_common.c src/osdp_phy.c src/osdp_sc.c src/osdp_file.
 LIBOSDP_SOURCES+=" utils/src/list.c utils/src/queue.c utils/src/slab.c utils/src/utils.c"
 LIBOSDP_SOURCES+=" utils/src/disjoint_set.c utils/src/logger.c"
 
+if [[ ! -z "${FILE_COMPRESSION}" ]]; then
+	LIBOSDP_SOURCES+=" src/osdp_lz.c"
+fi
+
 if [[ ! -z "${PACKET_TRACE}" ]] || [[ ! -z "${DATA_TRACE}" ]]; then
 	LIBOSDP_SOURCES+=" src/osdp_diag.c utils/src/pcap_gen.c"
 fi
 
 if [[ -z "${STATIC_PD}" ]]; then
 	LIBOSDP_SOURCES+=" src/osdp_cp.c"
+	if [[ ! -z "${SC_WORKER}" ]]; then
+		LIBOSDP_SOURCES+=" src/osdp_sc_worker.c"
+		CCFLAGS+=" -DCONFIG_OSDP_SC_WORKER"
+		LDFLAGS+=" -lpthread"
+	fi
 	TARGETS="cp_app pd_app"
 else
 	TARGETS="pd_app"
@@ -158,6 +189,7 @@ fi
 TEST_SOURCES="tests/unit-tests/test.c tests/unit-tests/test-cp-phy.c"
 TEST_SOURCES+=" tests/unit-tests/test-commands.c"
 TEST_SOURCES+=" tests/unit-tests/test-cp-fsm.c tests/unit-tests/test-file.c"
+TEST_SOURCES+=" tests/unit-tests/test-lz.c tests/unit-tests/test-pd.c"
 TEST_SOURCES+=" ${LIBOSDP_SOURCES} utils/src/workqueue.c utils/src/circbuf.c"
 TEST_SOURCES+=" utils/src/event.c utils/src/fdutils.c"
 
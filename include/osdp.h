@@ -72,6 +72,14 @@ extern "C" {
  */
 #define OSDP_FLAG_CAPTURE_PACKETS 0x00100000
 
+/**
+ * @brief Flush the channel (see osdp_channel::flush) before each packet is
+ * sent. By default, LibOSDP flushes the channel only when recovering from
+ * errors; this flag restores the old behaviour for channels that tend to
+ * accumulate stale data between transactions.
+ */
+#define OSDP_FLAG_FLUSH_RX_ON_SEND 0x00200000
+
 /**
  * @brief Various PD capability function codes.
  */
@@ -147,6 +155,12 @@ enum osdp_pd_cap_function_code_e {
 	/**
 	 * This capability indicates the maximum size single message the PD can
 	 * receive.
+	 *
+	 * LibOSDP sizes its packet buffer from this capability when present in
+	 * osdp_pd_info_t::cap (in both CP and PD mode); it must be between
+	 * OSDP_PACKET_BUF_SIZE_MIN and OSDP_PACKET_BUF_SIZE_MAX. When absent,
+	 * OSDP_PACKET_BUF_SIZE is used. The value is encoded as compliance_level
+	 * (LSB) and num_items (MSB).
 	 */
 	OSDP_PD_CAP_RECEIVE_BUFFERSIZE,
 
@@ -330,7 +344,9 @@ typedef struct {
 	/**
 	 * This is a pointer to an array of structures containing the PD'
 	 * capabilities. Use { -1, 0, 0 } to terminate the array. This is used
-	 * only PD mode of operation
+	 * only PD mode of operation; in CP mode, only
+	 * OSDP_PD_CAP_RECEIVE_BUFFERSIZE is looked up from this array to size
+	 * the CP's receive buffer for this PD.
 	 */
 	const struct osdp_pd_cap *cap;
 	/**
@@ -414,6 +430,7 @@ struct osdp_status_report {
 #define OSDP_CMD_MFG_MAX_DATALEN       64
 
 #define OSDP_CMD_FILE_TX_FLAG_CANCEL (1UL << 31)
+#define OSDP_CMD_FILE_TX_FLAG_RESUME (1UL << 30)
 
 /**
  * @brief Command sent from CP to Control digital output of PD.
@@ -608,6 +625,9 @@ struct osdp_cmd_comset {
 struct osdp_cmd_keyset {
 	/**
 	 * Type of keys:
+	 * - 0x00 – Master Key; CP only. The CP derives the PD's Secure Channel
+	 *   Base Key from it (see osdp_cp_preload_scbk()) and sends that to
+	 *   the PD as a type 0x01 key.
 	 * - 0x01 – Secure Channel Base Key
 	 */
 	uint8_t type;
@@ -656,8 +676,19 @@ struct osdp_cmd_file_tx {
 	 *
 	 * @note: The upper bits are used by libosdp as:
 	 *    bit-31 - OSDP_CMD_FILE_TX_FLAG_CANCEL: cancel an ongoing transfer
+	 *    bit-30 - OSDP_CMD_FILE_TX_FLAG_RESUME: resume the transfer at
+	 *             `offset` instead of starting from the beginning
 	 */
 	uint32_t flags;
+	/**
+	 * CP: Offset to resume the transfer from; used only when the flag
+	 * OSDP_CMD_FILE_TX_FLAG_RESUME is set (see osdp_file_checkpoint).
+	 *
+	 * PD: Offset at which the CP wants to resume a transfer. The app must
+	 * return -1 from the command callback if it does not hold the first
+	 * `offset` bytes of this file; the CP then starts over from 0.
+	 */
+	uint32_t offset;
 };
 
 /**
@@ -882,13 +913,25 @@ struct osdp_event {
  * @param cmd pointer to the received command.
  *
  * @retval 0 if LibOSDP must send a `osdp_ACK` response
- * @retval -ve if LibOSDP must send a `osdp_NAK` response
+ * @retval -ve (other than OSDP_PD_CMD_DEFERRED) if LibOSDP must send a
+ * `osdp_NAK` response
  * @retval +ve and modify the passed `struct osdp_cmd *cmd` if LibOSDP must
  * send a specific response. This is useful for sending manufacturer specific
  * reply `osdp_MFGREP`.
+ * @retval OSDP_PD_CMD_DEFERRED if the app will complete this command later
+ * with `osdp_pd_complete_command`.
  */
 typedef int (*pd_command_callback_t)(void *arg, struct osdp_cmd *cmd);
 
+/**
+ * @brief Return value of `pd_command_callback_t` to defer a command that the
+ * app cannot act on right away (for instance, when it has to talk to slow
+ * hardware). LibOSDP replies with `osdp_BUSY` to such commands until the app
+ * calls `osdp_pd_complete_command`; the final reply is sent on the CP's next
+ * retry. It is negative so that it can't be mistaken for a reply code.
+ */
+#define OSDP_PD_CMD_DEFERRED (-0x7FFF)
+
 /**
  * @brief Callback for CP event notifications. After it has been registered
  * with `osdp_cp_set_event_callback`, this method is invoked when the CP
@@ -931,6 +974,28 @@ osdp_t *osdp_pd_setup(const osdp_pd_info_t *info);
 OSDP_EXPORT
 void osdp_pd_refresh(osdp_t *ctx);
 
+/**
+ * @brief Push mode alternative to the channel.recv method. Bytes received from
+ * the CP are parsed right away and when they complete a command, the reply is
+ * built and sent (with channel.send) before this method returns.
+ *
+ * @param ctx OSDP context
+ * @param buf bytes received from the CP
+ * @param len number of bytes in buf
+ *
+ * @retval +ve/0 number of bytes consumed; can be less than `len` only when
+ *         the internal buffers are full (CP sent more than a frame's worth of
+ *         garbage).
+ * @retval -1 on errors
+ *
+ * @note For PDs that use this method, channel.recv must be set to NULL. The
+ * application must still call osdp_pd_refresh() periodically (but it no
+ * longer needs to be every 50ms) so partially received commands and secure
+ * channel sessions can time out.
+ */
+OSDP_EXPORT
+int osdp_pd_feed(osdp_t *ctx, const uint8_t *buf, int len);
+
 /**
  * @brief Cleanup all osdp resources. The context pointer is no longer valid
  * after this call.
@@ -962,10 +1027,35 @@ OSDP_EXPORT
 void osdp_pd_set_command_callback(osdp_t *ctx, pd_command_callback_t cb,
 				  void *arg);
 
+/**
+ * @brief Complete a command that was deferred by returning
+ * `OSDP_PD_CMD_DEFERRED` from the command callback.
+ *
+ * @param ctx OSDP context
+ * @param cmd the deferred command, filled in the same way the command callback
+ * would have (for instance, the status report of an OSDP_CMD_STATUS). Can be
+ * NULL if the command has nothing to report back.
+ * @param result what the command callback would have returned (see
+ * `pd_command_callback_t`).
+ *
+ * @retval 0 on success
+ * @retval -1 when there is no deferred command or `cmd` doesn't match it
+ *
+ * @note This method must be called from the thread that calls
+ * osdp_pd_refresh() (or osdp_pd_feed()).
+ */
+OSDP_EXPORT
+int osdp_pd_complete_command(osdp_t *ctx, const struct osdp_cmd *cmd,
+			     int result);
+
 /**
  * @brief API to notify PD events to CP. These events are sent to the CP as an
  * alternate response to a POLL command.
  *
+ * A status event replaces a queued status event of the same report type so
+ * only the latest snapshot is sent. All other events are sent in the order
+ * they were notified, ahead of any queued status events.
+ *
  * @param ctx OSDP context
  * @param event pointer to event struct. Must be filled by application.
  *
@@ -975,6 +1065,44 @@ void osdp_pd_set_command_callback(osdp_t *ctx, pd_command_callback_t cb,
 OSDP_EXPORT
 int osdp_pd_notify_event(osdp_t *ctx, const struct osdp_event *event);
 
+/**
+ * @brief What the PD should do when osdp_pd_notify_event() is called with the
+ * event queue full. Status events are never affected by this as a new status
+ * report replaces the queued report of the same type (if any).
+ */
+enum osdp_pd_event_overflow_policy {
+	/**
+	 * Reject the new event; osdp_pd_notify_event() returns -1.
+	 */
+	OSDP_PD_EVENT_OVERFLOW_REJECT,
+	/**
+	 * Drop the oldest queued status report to make room for the new
+	 * event. If there are none, reject the new event (default).
+	 */
+	OSDP_PD_EVENT_OVERFLOW_DROP_STATUS,
+	/**
+	 * Drop the oldest queued event, whatever its type.
+	 */
+	OSDP_PD_EVENT_OVERFLOW_DROP_OLDEST,
+};
+
+/**
+ * @brief Set the policy applied when the PD event queue overflows.
+ *
+ * @param ctx OSDP context
+ * @param policy one of `enum osdp_pd_event_overflow_policy`
+ *
+ * @retval 0 on success
+ * @retval -1 on failure
+ *
+ * @note The default is OSDP_PD_EVENT_OVERFLOW_DROP_STATUS. Earlier releases
+ * always rejected the new event; set OSDP_PD_EVENT_OVERFLOW_REJECT to keep
+ * that behaviour.
+ */
+OSDP_EXPORT
+int osdp_pd_set_event_overflow_policy(osdp_t *ctx,
+				      enum osdp_pd_event_overflow_policy policy);
+
 /**
  * @brief Deletes all events from the PD's event queue.
  *
@@ -1113,6 +1241,27 @@ void osdp_cp_set_event_callback(osdp_t *ctx, cp_event_callback_t cb, void *arg);
 OSDP_EXPORT
 int osdp_cp_modify_flag(osdp_t *ctx, int pd, uint32_t flags, bool do_set);
 
+/**
+ * @brief Preload the SCBK cache with keys derived from a master key
+ *
+ * When a KEYSET command carries a master key (osdp_cmd_keyset::type == 0),
+ * the CP derives the PD's SCBK from its client UID and caches it. This method
+ * derives the SCBKs for a whole fleet up front so that a mass re-keying does
+ * not pay for the derivation on the bus. The cache holds one entry per PD and
+ * is flushed when a different master key is used.
+ *
+ * @param ctx OSDP context
+ * @param master_key 16 byte master key
+ * @param client_uids `count` 8 byte client UIDs, back to back
+ * @param count Number of client UIDs in `client_uids`
+ *
+ * @retval Number of keys cached on success
+ * @retval -1 on failure
+ */
+OSDP_EXPORT
+int osdp_cp_preload_scbk(osdp_t *ctx, const uint8_t *master_key,
+			 const uint8_t *client_uids, int count);
+
 /* ------------------------------- */
 /*          Common Methods         */
 /* ------------------------------- */
@@ -1226,6 +1375,24 @@ void osdp_get_status_mask(const osdp_t *ctx, uint8_t *bitmask);
 OSDP_EXPORT
 void osdp_get_sc_status_mask(const osdp_t *ctx, uint8_t *bitmask);
 
+/**
+ * @brief Get RX error recovery counters of the channel a PD is attached to.
+ * PDs sharing a multi-drop channel report the same numbers.
+ *
+ * @param ctx OSDP context
+ * @param pd PD offset (0-indexed) of this PD in `osdp_pd_info_t *` passed to
+ * osdp_cp_setup(); always 0 in PD mode.
+ * @param discard_bytes Number of received bytes dropped by RX flushes and
+ * stray/late frames so far.
+ * @param flush_count Number of times the RX path was flushed so far.
+ *
+ * @retval 0 on success
+ * @retval -1 on failure
+ */
+OSDP_EXPORT
+int osdp_get_rx_stats(const osdp_t *ctx, int pd, uint32_t *discard_bytes,
+		      uint32_t *flush_count);
+
 /**
  * @brief Open a pre-agreed file
  *
@@ -1319,11 +1486,80 @@ struct osdp_file_ops {
  * @param ops Populated file operations struct
  *
  * @retval 0 on success. -1 on errors.
+ *
+ * @note When built with CONFIG_OSDP_FILE_COMPRESSION, a LibOSDP CP compresses
+ * the file data it sends to a LibOSDP PD built the same way; the ops see only
+ * the uncompressed data. File ID 255 is used for this on the wire, so such a
+ * CP refuses to send a file with that ID.
  */
 OSDP_EXPORT
 int osdp_file_register_ops(osdp_t *ctx, int pd,
 			   const struct osdp_file_ops *ops);
 
+/**
+ * @brief A file image held in memory (or mapped into it) for the built-in
+ * file operations set up by osdp_file_mem_ops(). One image can be shared by
+ * any number of PDs and transfers.
+ */
+struct osdp_file_mem {
+	const uint8_t *data; /**< File contents; must outlive all transfers */
+	int size;            /**< Size of the file in bytes */
+	int file_id;         /**< File ID this image is served as; -1 for any */
+	void *priv;          /**< Private to LibOSDP; set to NULL */
+};
+
+/**
+ * @brief Fill `ops` with LibOSDP's built-in read-only file operations that
+ * serve chunks of `mem` straight to the CP's packet buffer, without calling
+ * back into the application for each chunk. The resulting ops can be passed
+ * to osdp_file_register_ops() or osdp_file_rollout_start() on a CP.
+ *
+ * @param ops File operations struct to fill
+ * @param mem File image; must stay valid as long as `ops` is registered
+ */
+OSDP_EXPORT
+void osdp_file_mem_ops(struct osdp_file_ops *ops, struct osdp_file_mem *mem);
+
+/**
+ * @brief Map the file at `path` into memory for use with osdp_file_mem_ops().
+ * Only available on POSIX systems.
+ *
+ * @param mem File image to fill
+ * @param path Path to the file to map
+ * @param file_id File ID to serve the image as; -1 for any
+ *
+ * @retval 0 on success. -1 on errors.
+ */
+OSDP_EXPORT
+int osdp_file_mem_map(struct osdp_file_mem *mem, const char *path,
+		      int file_id);
+
+/**
+ * @brief Release a file image mapped by osdp_file_mem_map(). No transfers may
+ * be using it any more.
+ *
+ * @param mem File image to release
+ */
+OSDP_EXPORT
+void osdp_file_mem_unmap(struct osdp_file_mem *mem);
+
+/**
+ * @brief Set the alternate maximum message size that a PD advertises to the CP
+ * (in the rx_size field of osdp_FTSTAT) for the remainder of a file transfer.
+ * The CP sizes each osdp_FILETRANSFER packet to fill this many bytes. Must be
+ * called after osdp_file_register_ops(). It is cleared when the transfer
+ * completes or is aborted.
+ *
+ * @param ctx OSDP context
+ * @param pd This param is ignored in PD mode
+ * @param rx_size Message size in bytes; between 64 and the PD's packet buffer
+ * size. 0 to advertise no change.
+ *
+ * @retval 0 on success. -1 on errors.
+ */
+OSDP_EXPORT
+int osdp_file_set_rx_size(osdp_t *ctx, int pd, int rx_size);
+
 /**
  * @brief Query file transfer status if one is in progress. Calling this method
  * when there is no file transfer progressing will return error.
@@ -1337,6 +1573,111 @@ int osdp_file_register_ops(osdp_t *ctx, int pd,
 OSDP_EXPORT
 int osdp_get_file_tx_status(const osdp_t *ctx, int pd, int *size, int *offset);
 
+/**
+ * @brief Aggregate progress of a file rollout. See osdp_file_rollout_status().
+ */
+struct osdp_file_rollout_status {
+	int num_pd;         /**< Number of PDs in this rollout */
+	int pending;        /**< PDs waiting to start (or restart) a transfer */
+	int active;         /**< PDs with a transfer in progress */
+	int done;           /**< PDs that have received the whole file */
+	int failed;         /**< PDs that were given up on (or cancelled) */
+	int retries;        /**< Number of transfers restarted so far */
+	int64_t bytes;      /**< File bytes delivered to all PDs so far */
+	int64_t elapsed_ms; /**< Time since start; stops when the rollout ends */
+	int64_t throughput; /**< Aggregate throughput in bytes per second */
+};
+
+/**
+ * @brief Send a file to a set of PDs. Transfers run concurrently on PDs that
+ * are on different channels; PDs on a shared channel take turns with (at
+ * most OSDP_FILE_ROLLOUT_CHANNEL_MAX) other transfers and with the regular
+ * commands to the PDs on that channel. Each transfer honours the delay and
+ * control flags that its PD sends in osdp_FTSTAT. PDs that are offline are
+ * started when they come online; failed transfers are restarted from the
+ * beginning up to OSDP_FILE_ROLLOUT_RETRY_MAX times.
+ *
+ * @param ctx OSDP context
+ * @param pd_mask Bit mask of PD numbers (as in osdp_get_status_mask())
+ * @param file_id Pre-agreed file ID between this CP and the PDs
+ * @param ops File operations to read the file with. These are registered on
+ * each PD in the set (in place of any ops registered there already) and are
+ * called for all of them with the same arg: open() and close() once per
+ * transfer and read() at the offsets of all ongoing transfers.
+ *
+ * @retval 0 on success. -1 on errors (including a rollout already running).
+ */
+OSDP_EXPORT
+int osdp_file_rollout_start(osdp_t *ctx, const uint8_t *pd_mask, int file_id,
+			    const struct osdp_file_ops *ops);
+
+/**
+ * @brief Query the progress of the current (or the last) file rollout.
+ *
+ * @param ctx OSDP context
+ * @param status Filled with the aggregate progress
+ * @param failed_mask Optional; filled with a bit mask of the PDs that failed
+ * to receive the file. Must be able to hold a bit for each PD.
+ *
+ * @retval 1 while the rollout is in progress, 0 when it has ended and -1 if
+ * there is no rollout to report.
+ */
+OSDP_EXPORT
+int osdp_file_rollout_status(const osdp_t *ctx,
+			     struct osdp_file_rollout_status *status,
+			     uint8_t *failed_mask);
+
+/**
+ * @brief Cancel the file rollout in progress. Ongoing transfers are aborted
+ * and all PDs that had not received the file yet are counted as failed.
+ *
+ * @param ctx OSDP context
+ *
+ * @retval 0 on success. -1 if there is no rollout in progress.
+ */
+OSDP_EXPORT
+int osdp_file_rollout_cancel(osdp_t *ctx);
+
+/**
+ * @brief Progress of a CP to PD file transfer that the app can persist and
+ * later pass back in a OSDP_CMD_FILE_TX (with OSDP_CMD_FILE_TX_FLAG_RESUME)
+ * to continue an interrupted transfer.
+ */
+struct osdp_file_checkpoint {
+	int file_id;     /**< File ID of the transfer */
+	uint32_t size;   /**< Total size of the file */
+	uint32_t offset; /**< Bytes acknowledged by the PD so far */
+};
+
+/**
+ * @brief Callback for CP to persist file transfer checkpoints.
+ *
+ * @param arg Opaque pointer provided by the application during callback
+ * registration.
+ * @param pd PD offset (0-indexed) of this PD in `osdp_pd_info_t *` passed to
+ * osdp_cp_setup()
+ * @param ckpt Current progress of the transfer to this PD
+ *
+ * @retval 0 on success. The return value is currently ignored.
+ */
+typedef int (*osdp_file_checkpoint_callback_t)(void *arg, int pd,
+				const struct osdp_file_checkpoint *ckpt);
+
+/**
+ * @brief Set callback method for CP to be notified of file transfer progress.
+ * LibOSDP calls it every OSDP_FILE_CHECKPOINT_INTERVAL bytes acknowledged
+ * by the PD and when the transfer completes (offset == size). Chunks that
+ * the PD rejects are never reported.
+ *
+ * @param ctx OSDP context
+ * @param cb The callback function's pointer
+ * @param arg A pointer that will be passed as the first argument of `cb`
+ */
+OSDP_EXPORT
+void osdp_file_set_checkpoint_callback(osdp_t *ctx,
+				       osdp_file_checkpoint_callback_t cb,
+				       void *arg);
+
 #ifdef __cplusplus
 }
 #endif
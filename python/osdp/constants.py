@@ -12,6 +12,7 @@ class LibFlag:
     IgnoreUnsolicited = osdp_sys.FLAG_IGN_UNSOLICITED
     EnableNotification = osdp_sys.FLAG_ENABLE_NOTIFICATION
     CapturePackets = osdp_sys.FLAG_CAPTURE_PACKETS
+    FlushRxOnSend = osdp_sys.FLAG_FLUSH_RX_ON_SEND
 
 class LogLevel:
     Emergency = osdp_sys.LOG_EMERG
@@ -52,6 +53,7 @@ class CommandLEDColor:
 
 class CommandFileTxFlags:
     Cancel = osdp_sys.CMD_FILE_TX_FLAG_CANCEL
+    Resume = osdp_sys.CMD_FILE_TX_FLAG_RESUME
 
 class EventNotification:
     Command = osdp_sys.EVENT_NOTIFICATION_COMMAND
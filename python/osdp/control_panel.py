@@ -147,6 +147,13 @@ class ControlPanel():
         self.lock.release()
         return ret
 
+    def register_file_image(self, address, file_id, image):
+        pd = self.pd_addr.index(address)
+        self.lock.acquire()
+        ret = self.ctx.register_file_image(pd, file_id, image)
+        self.lock.release()
+        return ret
+
     def get_file_tx_status(self, address):
         pd = self.pd_addr.index(address)
         self.lock.acquire()
@@ -196,6 +196,64 @@ static PyObject *pyosdp_file_register_ops(pyosdp_base_t *self, PyObject *args)
 	Py_RETURN_TRUE;
 }
 
+#define pyosdp_file_register_image_doc                                         \
+	"Serve files to a PD from a bytes-like object (bytes, bytearray,\n"      \
+	"mmap.mmap, ...) without calling back into python for each chunk.\n"    \
+	"All PDs registered this way share one image; registering another\n"   \
+	"image replaces it for all of them, so don't do that while a\n"       \
+	"transfer is in progress.\n"                                           \
+	"\n"                                                                   \
+	"@param pd PD offset\n"                                                \
+	"@param file_id File ID to serve the image as; -1 for any\n"           \
+	"@param image bytes-like object holding the file contents\n"           \
+	"\n"                                                                   \
+	"@return boolean status of registration\n"
+static PyObject *pyosdp_file_register_image(pyosdp_base_t *self, PyObject *args)
+{
+	int pd_idx, file_id;
+	Py_buffer image;
+	struct osdp_file_ops ops;
+	pyosdp_cp_t *cp = (pyosdp_cp_t *)self;
+
+	if (!PyArg_ParseTuple(args, "Iiy*", &pd_idx, &file_id, &image))
+		Py_RETURN_FALSE;
+
+	if (!self->is_cp) {
+		PyErr_SetString(PyExc_ValueError, "Only a CP can serve images");
+		goto error;
+	}
+
+	if (pd_idx < 0 || pd_idx >= cp->num_pd) {
+		PyErr_SetString(PyExc_ValueError, "Invalid PD offset");
+		goto error;
+	}
+
+	if (image.len <= 0 || image.len > INT32_MAX) {
+		PyErr_SetString(PyExc_ValueError, "Invalid image size");
+		goto error;
+	}
+
+	/* keep a reference to the image for as long as LibOSDP may read it */
+	if (self->image.obj)
+		PyBuffer_Release(&self->image);
+	self->image = image;
+	self->image_mem.data = image.buf;
+	self->image_mem.size = (int)image.len;
+	self->image_mem.file_id = file_id;
+	self->image_mem.priv = NULL;
+
+	osdp_file_mem_ops(&ops, &self->image_mem);
+	if (osdp_file_register_ops(cp->ctx, pd_idx, &ops)) {
+		PyErr_SetString(PyExc_ValueError, "fops registration failed");
+		Py_RETURN_FALSE;
+	}
+
+	Py_RETURN_TRUE;
+error:
+	PyBuffer_Release(&image);
+	Py_RETURN_FALSE;
+}
+
 PyObject *pyosdp_get_version(pyosdp_base_t *self, PyObject *args)
 {
 	const char *version;
@@ -228,6 +286,8 @@ static void pyosdp_base_tp_dealloc(pyosdp_base_t *self)
 	Py_XDECREF(self->fops.read_cb);
 	Py_XDECREF(self->fops.write_cb);
 	Py_XDECREF(self->fops.close_cb);
+	if (self->image.obj)
+		PyBuffer_Release(&self->image);
 }
 
 static int pyosdp_base_tp_init(pyosdp_base_t *self, PyObject *args, PyObject *kwds)
@@ -236,6 +296,8 @@ static int pyosdp_base_tp_init(pyosdp_base_t *self, PyObject *args, PyObject *kw
 	self->fops.read_cb = NULL;
 	self->fops.write_cb = NULL;
 	self->fops.close_cb = NULL;
+	memset(&self->image, 0, sizeof(self->image));
+	memset(&self->image_mem, 0, sizeof(self->image_mem));
 	return 0;
 }
 
@@ -246,6 +308,8 @@ static PyMethodDef pyosdp_base_methods[] = {
 	  "Get LibOSDP source info string" },
 	{ "register_file_ops", (PyCFunction)pyosdp_file_register_ops, METH_VARARGS,
 	  pyosdp_file_register_ops_doc },
+	{ "register_file_image", (PyCFunction)pyosdp_file_register_image,
+	  METH_VARARGS, pyosdp_file_register_image_doc },
 	{ "get_file_tx_status", (PyCFunction)pyosdp_get_file_tx_status, METH_VARARGS,
 	  pyosdp_file_tx_status_doc },
 	{ NULL } /* Sentinel */
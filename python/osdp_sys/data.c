@@ -327,12 +327,15 @@ static int pyosdp_make_dict_cmd_file_tx(PyObject *obj, struct osdp_cmd *cmd)
 		return -1;
 	if (pyosdp_dict_add_int(obj, "id", cmd->file_tx.id))
 		return -1;
+	if ((cmd->file_tx.flags & OSDP_CMD_FILE_TX_FLAG_RESUME) &&
+	    pyosdp_dict_add_int(obj, "offset", cmd->file_tx.offset))
+		return -1;
 	return 0;
 }
 
 static int pyosdp_make_struct_cmd_file_tx(struct osdp_cmd *p, PyObject *dict)
 {
-	int id, flags;
+	int id, flags, offset = 0;
 	struct osdp_cmd_file_tx *cmd = &p->file_tx;
 
 	if (pyosdp_dict_get_int(dict, "id", &id))
@@ -341,8 +344,14 @@ static int pyosdp_make_struct_cmd_file_tx(struct osdp_cmd *p, PyObject *dict)
 	if (pyosdp_dict_get_int(dict, "flags", &flags))
 		return -1;
 
+	/* offset is only needed to resume a transfer */
+	if ((flags & OSDP_CMD_FILE_TX_FLAG_RESUME) &&
+	    pyosdp_dict_get_int(dict, "offset", &offset))
+		return -1;
+
 	cmd->id = id;
 	cmd->flags = flags;
+	cmd->offset = (uint32_t)offset;
 	return 0;
 }
 
@@ -24,6 +24,7 @@ void pyosdp_add_module_constants(PyObject *module)
 	ADD_CONST("FLAG_IGN_UNSOLICITED", OSDP_FLAG_IGN_UNSOLICITED);
 	ADD_CONST("FLAG_ENABLE_NOTIFICATION", OSDP_FLAG_ENABLE_NOTIFICATION);
 	ADD_CONST("FLAG_CAPTURE_PACKETS", OSDP_FLAG_CAPTURE_PACKETS);
+	ADD_CONST("FLAG_FLUSH_RX_ON_SEND", OSDP_FLAG_FLUSH_RX_ON_SEND);
 
 	ADD_CONST("LOG_EMERG", OSDP_LOG_EMERG);
 	ADD_CONST("LOG_ALERT", OSDP_LOG_ALERT);
@@ -53,6 +54,7 @@ void pyosdp_add_module_constants(PyObject *module)
 
 	/* For `struct osdp_cmd_file_tx::flags` */
 	ADD_CONST("CMD_FILE_TX_FLAG_CANCEL", OSDP_CMD_FILE_TX_FLAG_CANCEL);
+	ADD_CONST("CMD_FILE_TX_FLAG_RESUME", OSDP_CMD_FILE_TX_FLAG_RESUME);
 
 	/* For `struct osdp_event_notification::type` */
 	ADD_CONST("EVENT_NOTIFICATION_COMMAND", OSDP_EVENT_NOTIFICATION_COMMAND);
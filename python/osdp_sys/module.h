@@ -29,6 +29,10 @@ typedef struct {
 		PyObject *write_cb;
 		PyObject *close_cb;
 	} fops;
+
+	/* file image served by LibOSDP; see register_file_image() */
+	Py_buffer image;
+	struct osdp_file_mem image_mem;
 } pyosdp_base_t;
 
 typedef struct {
@@ -106,12 +106,14 @@ lib_sources = [
     "src/osdp_cp.c",
     "src/crypto/tinyaes_src.c",
     "src/crypto/tinyaes.c",
+    "src/crypto/random.c",
 ]
 
 lib_includes = [
     "include/osdp.h",
     "src/osdp_common.h",
     "src/osdp_file.h",
+    "src/osdp_lz.h",
     "src/crypto/tinyaes_src.h",
 ]
 
@@ -5,6 +5,7 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -14,17 +15,22 @@
 
 #include <osdp.h>
 
-mbedtls_aes_context aes_ctx;
 mbedtls_entropy_context entropy_ctx;
 mbedtls_ctr_drbg_context ctr_drbg_ctx;
 
+/* The DRBG is shared; the first context seeds it and the last frees it */
+static int crypt_users;
+
 void osdp_crypt_setup()
 {
 	int rc;
 	const char *version;
 
+	if (crypt_users++ > 0) {
+		return;
+	}
+
 	version = osdp_get_version();
-	mbedtls_aes_init(&aes_ctx);
 	mbedtls_entropy_init(&entropy_ctx);
 	mbedtls_ctr_drbg_init(&ctr_drbg_ctx);
 
@@ -36,48 +42,155 @@ void osdp_crypt_setup()
 	assert(rc == 0);
 }
 
+/**
+ * One-shot operations with a raw key (used for SCBK and session key
+ * derivation). These use a stack context so they are reentrant.
+ */
 void osdp_encrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len)
 {
 	int rc;
+	mbedtls_aes_context aes_ctx;
 
+	mbedtls_aes_init(&aes_ctx);
+	rc = mbedtls_aes_setkey_enc(&aes_ctx, key, 128);
+	assert(rc == 0);
 	if (iv != NULL) {
 		/* encrypt multiple block with AES in CBC mode */
-		rc = mbedtls_aes_setkey_enc(&aes_ctx, key, 128);
-		assert(rc == 0);
 		rc = mbedtls_aes_crypt_cbc(&aes_ctx, MBEDTLS_AES_ENCRYPT,
 					   len, iv, data, data);
-		assert(rc == 0);
 	} else {
 		/* encrypt one block with AES in ECB mode */
 		assert(len <= 16);
-		rc = mbedtls_aes_setkey_enc(&aes_ctx, key, 128);
-		assert(rc == 0);
 		rc = mbedtls_aes_crypt_ecb(&aes_ctx, MBEDTLS_AES_ENCRYPT,
 					   data, data);
-		assert(rc == 0);
 	}
+	assert(rc == 0);
+	mbedtls_aes_free(&aes_ctx);
 }
 
 void osdp_decrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len)
 {
 	int rc;
+	mbedtls_aes_context aes_ctx;
 
+	mbedtls_aes_init(&aes_ctx);
+	rc = mbedtls_aes_setkey_dec(&aes_ctx, key, 128);
+	assert(rc == 0);
 	if (iv != NULL) {
 		/* decrypt multiple block with AES in CBC mode */
-		rc = mbedtls_aes_setkey_dec(&aes_ctx, key, 128);
-		assert(rc == 0);
 		rc = mbedtls_aes_crypt_cbc(&aes_ctx, MBEDTLS_AES_DECRYPT,
 					   len, iv, data, data);
-		assert(rc == 0);
 	} else {
 		/* decrypt one block with AES in ECB mode */
 		assert(len <= 16);
-		rc = mbedtls_aes_setkey_dec(&aes_ctx, key, 128);
-		assert(rc == 0);
 		rc = mbedtls_aes_crypt_ecb(&aes_ctx, MBEDTLS_AES_DECRYPT,
 					   data, data);
-		assert(rc == 0);
 	}
+	assert(rc == 0);
+	mbedtls_aes_free(&aes_ctx);
+}
+
+/**
+ * Per-key cipher context. mbedtls needs separate (inverse) round keys for
+ * decryption so both schedules are expanded once in osdp_crypt_ctx_set_key().
+ */
+struct osdp_crypt_ctx {
+	mbedtls_aes_context enc;
+	mbedtls_aes_context dec;
+};
+
+struct osdp_crypt_ctx *osdp_crypt_ctx_new(void)
+{
+	struct osdp_crypt_ctx *ctx;
+
+	ctx = calloc(1, sizeof(struct osdp_crypt_ctx));
+	if (ctx == NULL) {
+		return NULL;
+	}
+	mbedtls_aes_init(&ctx->enc);
+	mbedtls_aes_init(&ctx->dec);
+	return ctx;
+}
+
+void osdp_crypt_ctx_free(struct osdp_crypt_ctx *ctx)
+{
+	if (ctx == NULL) {
+		return;
+	}
+	mbedtls_aes_free(&ctx->enc);
+	mbedtls_aes_free(&ctx->dec);
+	free(ctx);
+}
+
+int osdp_crypt_ctx_set_key(struct osdp_crypt_ctx *ctx, const uint8_t *key)
+{
+	if (ctx == NULL) {
+		return -1;
+	}
+	if (mbedtls_aes_setkey_enc(&ctx->enc, key, 128) != 0 ||
+	    mbedtls_aes_setkey_dec(&ctx->dec, key, 128) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int osdp_crypt_ctx_encrypt(struct osdp_crypt_ctx *ctx, uint8_t *iv,
+			   uint8_t *data, int len)
+{
+	int rc;
+
+	if (ctx == NULL) {
+		return -1;
+	}
+	if (iv != NULL) {
+		/* encrypt multiple block with AES in CBC mode */
+		rc = mbedtls_aes_crypt_cbc(&ctx->enc, MBEDTLS_AES_ENCRYPT,
+					   len, iv, data, data);
+	} else {
+		/* encrypt one block with AES in ECB mode */
+		if (len > 16) {
+			return -1;
+		}
+		rc = mbedtls_aes_crypt_ecb(&ctx->enc, MBEDTLS_AES_ENCRYPT,
+					   data, data);
+	}
+	return rc == 0 ? 0 : -1;
+}
+
+int osdp_crypt_ctx_decrypt(struct osdp_crypt_ctx *ctx, uint8_t *iv,
+			   uint8_t *data, int len)
+{
+	int rc;
+
+	if (ctx == NULL) {
+		return -1;
+	}
+	if (iv != NULL) {
+		/* decrypt multiple block with AES in CBC mode */
+		rc = mbedtls_aes_crypt_cbc(&ctx->dec, MBEDTLS_AES_DECRYPT,
+					   len, iv, data, data);
+	} else {
+		/* decrypt one block with AES in ECB mode */
+		if (len > 16) {
+			return -1;
+		}
+		rc = mbedtls_aes_crypt_ecb(&ctx->dec, MBEDTLS_AES_DECRYPT,
+					   data, data);
+	}
+	return rc == 0 ? 0 : -1;
+}
+
+int osdp_crypt_ctx_encrypt_batch(struct osdp_crypt_ctx **ctx,
+				 uint8_t **blocks, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (osdp_crypt_ctx_encrypt(ctx[i], NULL, blocks[i], 16)) {
+			return -1;
+		}
+	}
+	return 0;
 }
 
 void osdp_fill_random(uint8_t *buf, int len)
@@ -90,7 +203,9 @@ void osdp_fill_random(uint8_t *buf, int len)
 
 void osdp_crypt_teardown()
 {
+	if (crypt_users == 0 || --crypt_users > 0) {
+		return;
+	}
 	mbedtls_ctr_drbg_free(&ctr_drbg_ctx);
 	mbedtls_entropy_free(&entropy_ctx);
-	mbedtls_aes_free(&aes_ctx);
 }
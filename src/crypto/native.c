@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2024 Siddharth Chandrasekaran <sidcha.dev@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * In-tree AES backend that uses the CPU's AES instructions (AES-NI on x86,
+ * crypto extensions on ARMv8) when they are present and falls back to
+ * tiny-AES otherwise. The key expansion is always done by tiny-AES; only the
+ * block cipher rounds are accelerated.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinyaes_src.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NATIVE_AES_X86
+#include <cpuid.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#define NATIVE_AES_ARM
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#define AES_BLOCK_SIZE 16
+#define AES_ROUNDS     10
+#define NATIVE_LANES   4  /* independent blocks kept in flight */
+
+struct osdp_crypt_ctx {
+	struct AES_ctx aes_ctx;   /* enc round keys; tiny-AES state */
+	uint8_t dec_rk[AES_keyExpSize]; /* equivalent inverse cipher keys */
+};
+
+#if defined(NATIVE_AES_X86)
+
+static int native_aes_detect(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	return !!(ecx & bit_AES);
+}
+
+__attribute__((target("aes,sse2")))
+static void native_encrypt_block(const uint8_t *rk, uint8_t *blk)
+{
+	int i;
+	__m128i b = _mm_loadu_si128((const __m128i *)blk);
+
+	b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)rk));
+	for (i = 1; i < AES_ROUNDS; i++) {
+		rk += AES_BLOCK_SIZE;
+		b = _mm_aesenc_si128(b, _mm_loadu_si128((const __m128i *)rk));
+	}
+	rk += AES_BLOCK_SIZE;
+	b = _mm_aesenclast_si128(b, _mm_loadu_si128((const __m128i *)rk));
+	_mm_storeu_si128((__m128i *)blk, b);
+}
+
+__attribute__((target("aes,sse2")))
+static void native_decrypt_block(const uint8_t *rk, uint8_t *blk)
+{
+	int i;
+	__m128i b = _mm_loadu_si128((const __m128i *)blk);
+
+	b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)rk));
+	for (i = 1; i < AES_ROUNDS; i++) {
+		rk += AES_BLOCK_SIZE;
+		b = _mm_aesdec_si128(b, _mm_loadu_si128((const __m128i *)rk));
+	}
+	rk += AES_BLOCK_SIZE;
+	b = _mm_aesdeclast_si128(b, _mm_loadu_si128((const __m128i *)rk));
+	_mm_storeu_si128((__m128i *)blk, b);
+}
+
+__attribute__((target("aes,sse2")))
+static void native_inv_mix_columns(const uint8_t *in, uint8_t *out)
+{
+	__m128i k = _mm_loadu_si128((const __m128i *)in);
+
+	_mm_storeu_si128((__m128i *)out, _mm_aesimc_si128(k));
+}
+
+/**
+ * Encrypt up to NATIVE_LANES blocks, each with its own key schedule. The
+ * rounds are interleaved so that the AES unit has independent work queued
+ * instead of waiting out the latency of each AESENC.
+ */
+__attribute__((target("aes,sse2")))
+static void native_encrypt_lanes(const uint8_t **rk, uint8_t **blk, int n)
+{
+	int i, r;
+	__m128i b[NATIVE_LANES];
+
+	for (i = 0; i < n; i++) {
+		b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)blk[i]),
+				     _mm_loadu_si128((const __m128i *)rk[i]));
+	}
+	for (r = 1; r < AES_ROUNDS; r++) {
+		for (i = 0; i < n; i++) {
+			b[i] = _mm_aesenc_si128(b[i], _mm_loadu_si128(
+				(const __m128i *)(rk[i] + r * AES_BLOCK_SIZE)));
+		}
+	}
+	for (i = 0; i < n; i++) {
+		b[i] = _mm_aesenclast_si128(b[i], _mm_loadu_si128(
+			(const __m128i *)(rk[i] + AES_ROUNDS * AES_BLOCK_SIZE)));
+		_mm_storeu_si128((__m128i *)blk[i], b[i]);
+	}
+}
+
+#elif defined(NATIVE_AES_ARM)
+
+static int native_aes_detect(void)
+{
+	/**
+	 * Being built with __ARM_FEATURE_CRYPTO doesn't mean the CPU we run
+	 * on has it. Only trust what the kernel says.
+	 */
+#if defined(__linux__) && defined(HWCAP_AES)
+	return !!(getauxval(AT_HWCAP) & HWCAP_AES);
+#else
+	return 0;
+#endif
+}
+
+static void native_encrypt_block(const uint8_t *rk, uint8_t *blk)
+{
+	int i;
+	uint8x16_t b = vld1q_u8(blk);
+
+	for (i = 0; i < AES_ROUNDS - 1; i++) {
+		b = vaesmcq_u8(vaeseq_u8(b, vld1q_u8(rk)));
+		rk += AES_BLOCK_SIZE;
+	}
+	b = vaeseq_u8(b, vld1q_u8(rk));
+	rk += AES_BLOCK_SIZE;
+	b = veorq_u8(b, vld1q_u8(rk));
+	vst1q_u8(blk, b);
+}
+
+static void native_decrypt_block(const uint8_t *rk, uint8_t *blk)
+{
+	int i;
+	uint8x16_t b = vld1q_u8(blk);
+
+	for (i = 0; i < AES_ROUNDS - 1; i++) {
+		b = vaesimcq_u8(vaesdq_u8(b, vld1q_u8(rk)));
+		rk += AES_BLOCK_SIZE;
+	}
+	b = vaesdq_u8(b, vld1q_u8(rk));
+	rk += AES_BLOCK_SIZE;
+	b = veorq_u8(b, vld1q_u8(rk));
+	vst1q_u8(blk, b);
+}
+
+static void native_inv_mix_columns(const uint8_t *in, uint8_t *out)
+{
+	vst1q_u8(out, vaesimcq_u8(vld1q_u8(in)));
+}
+
+#else
+
+static int native_aes_detect(void)
+{
+	return 0;
+}
+
+static void native_encrypt_block(const uint8_t *rk, uint8_t *blk)
+{
+	(void)rk; (void)blk;
+}
+
+static void native_decrypt_block(const uint8_t *rk, uint8_t *blk)
+{
+	(void)rk; (void)blk;
+}
+
+static void native_inv_mix_columns(const uint8_t *in, uint8_t *out)
+{
+	(void)in; (void)out;
+}
+
+#endif
+
+#if !defined(NATIVE_AES_X86)
+static void native_encrypt_lanes(const uint8_t **rk, uint8_t **blk, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		native_encrypt_block(rk[i], blk[i]);
+	}
+}
+#endif
+
+static int native_aes_available(void)
+{
+	static int available = -1;
+
+	if (available < 0) {
+		available = native_aes_detect();
+	}
+	return available;
+}
+
+static inline void xor_block(uint8_t *dst, const uint8_t *src)
+{
+	int i;
+
+	for (i = 0; i < AES_BLOCK_SIZE; i++) {
+		dst[i] ^= src[i];
+	}
+}
+
+void osdp_crypt_setup()
+{
+	native_aes_available();
+}
+
+struct osdp_crypt_ctx *osdp_crypt_ctx_new(void)
+{
+	return calloc(1, sizeof(struct osdp_crypt_ctx));
+}
+
+void osdp_crypt_ctx_free(struct osdp_crypt_ctx *ctx)
+{
+	if (ctx) {
+		memset(ctx, 0, sizeof(struct osdp_crypt_ctx));
+	}
+	free(ctx);
+}
+
+int osdp_crypt_ctx_set_key(struct osdp_crypt_ctx *ctx, const uint8_t *key)
+{
+	int i;
+	const uint8_t *ek;
+
+	if (ctx == NULL) {
+		return -1;
+	}
+	ek = ctx->aes_ctx.RoundKey;
+	AES_init_ctx(&ctx->aes_ctx, key);
+	if (!native_aes_available()) {
+		return 0;
+	}
+
+	/* Round keys for the equivalent inverse cipher (FIPS-197 5.3.5) */
+	memcpy(ctx->dec_rk, ek + AES_ROUNDS * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+	for (i = 1; i < AES_ROUNDS; i++) {
+		native_inv_mix_columns(ek + (AES_ROUNDS - i) * AES_BLOCK_SIZE,
+				       ctx->dec_rk + i * AES_BLOCK_SIZE);
+	}
+	memcpy(ctx->dec_rk + AES_ROUNDS * AES_BLOCK_SIZE, ek, AES_BLOCK_SIZE);
+	return 0;
+}
+
+int osdp_crypt_ctx_encrypt(struct osdp_crypt_ctx *ctx, uint8_t *iv,
+			   uint8_t *data, int len)
+{
+	const uint8_t *prev = iv;
+
+	if (ctx == NULL || (iv == NULL && len > AES_BLOCK_SIZE)) {
+		return -1;
+	}
+	if (!native_aes_available()) {
+		if (iv != NULL) {
+			AES_ctx_set_iv(&ctx->aes_ctx, iv);
+			AES_CBC_encrypt_buffer(&ctx->aes_ctx, data, len);
+		} else {
+			AES_ECB_encrypt(&ctx->aes_ctx, data);
+		}
+		return 0;
+	}
+
+	if (iv == NULL) {
+		/* encrypt one block with AES in ECB mode */
+		native_encrypt_block(ctx->aes_ctx.RoundKey, data);
+		return 0;
+	}
+
+	/* encrypt multiple block with AES in CBC mode */
+	while (len >= AES_BLOCK_SIZE) {
+		xor_block(data, prev);
+		native_encrypt_block(ctx->aes_ctx.RoundKey, data);
+		prev = data;
+		data += AES_BLOCK_SIZE;
+		len -= AES_BLOCK_SIZE;
+	}
+	return 0;
+}
+
+int osdp_crypt_ctx_decrypt(struct osdp_crypt_ctx *ctx, uint8_t *iv,
+			   uint8_t *data, int len)
+{
+	uint8_t prev[AES_BLOCK_SIZE], cur[AES_BLOCK_SIZE];
+
+	if (ctx == NULL || (iv == NULL && len > AES_BLOCK_SIZE)) {
+		return -1;
+	}
+	if (!native_aes_available()) {
+		if (iv != NULL) {
+			AES_ctx_set_iv(&ctx->aes_ctx, iv);
+			AES_CBC_decrypt_buffer(&ctx->aes_ctx, data, len);
+		} else {
+			AES_ECB_decrypt(&ctx->aes_ctx, data);
+		}
+		return 0;
+	}
+
+	if (iv == NULL) {
+		/* decrypt one block with AES in ECB mode */
+		native_decrypt_block(ctx->dec_rk, data);
+		return 0;
+	}
+
+	/* decrypt multiple block with AES in CBC mode */
+	memcpy(prev, iv, AES_BLOCK_SIZE);
+	while (len >= AES_BLOCK_SIZE) {
+		memcpy(cur, data, AES_BLOCK_SIZE);
+		native_decrypt_block(ctx->dec_rk, data);
+		xor_block(data, prev);
+		memcpy(prev, cur, AES_BLOCK_SIZE);
+		data += AES_BLOCK_SIZE;
+		len -= AES_BLOCK_SIZE;
+	}
+	return 0;
+}
+
+int osdp_crypt_ctx_encrypt_batch(struct osdp_crypt_ctx **ctx,
+				 uint8_t **blocks, int n)
+{
+	int i, lanes;
+	const uint8_t *rk[NATIVE_LANES];
+
+	for (i = 0; i < n; i++) {
+		if (ctx[i] == NULL) {
+			return -1;
+		}
+	}
+
+	if (!native_aes_available()) {
+		for (i = 0; i < n; i++) {
+			AES_ECB_encrypt(&ctx[i]->aes_ctx, blocks[i]);
+		}
+		return 0;
+	}
+
+	while (n > 0) {
+		lanes = (n < NATIVE_LANES) ? n : NATIVE_LANES;
+		for (i = 0; i < lanes; i++) {
+			rk[i] = ctx[i]->aes_ctx.RoundKey;
+		}
+		native_encrypt_lanes(rk, blocks, lanes);
+		ctx += lanes;
+		blocks += lanes;
+		n -= lanes;
+	}
+	return 0;
+}
+
+void osdp_encrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len)
+{
+	struct osdp_crypt_ctx ctx;
+
+	osdp_crypt_ctx_set_key(&ctx, key);
+	osdp_crypt_ctx_encrypt(&ctx, iv, data, len);
+	memset(&ctx, 0, sizeof(ctx));
+}
+
+void osdp_decrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len)
+{
+	struct osdp_crypt_ctx ctx;
+
+	osdp_crypt_ctx_set_key(&ctx, key);
+	osdp_crypt_ctx_decrypt(&ctx, iv, data, len);
+	memset(&ctx, 0, sizeof(ctx));
+}
+
+void osdp_crypt_teardown()
+{
+}
@@ -6,6 +6,8 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <openssl/evp.h>
 #include <openssl/rand.h>
@@ -100,6 +102,174 @@ void osdp_decrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int data_len)
 	EVP_CIPHER_CTX_free(ctx);
 }
 
+/**
+ * Per-key cipher context. The key is only recorded by
+ * osdp_crypt_ctx_set_key(); each EVP context (CBC/ECB, encrypt/decrypt) is
+ * created and keyed the first time it is needed, and then reused. CBC
+ * contexts are re-initialized with just the IV for each operation so the key
+ * schedule is not expanded every time; ECB contexts carry no state between
+ * blocks and are used as is.
+ */
+enum osdp_openssl_evp_e {
+	OSDP_EVP_CBC_ENC,
+	OSDP_EVP_CBC_DEC,
+	OSDP_EVP_ECB_ENC,
+	OSDP_EVP_ECB_DEC,
+	OSDP_EVP_SENTINEL
+};
+
+struct osdp_crypt_ctx {
+	EVP_CIPHER_CTX *evp[OSDP_EVP_SENTINEL];
+	uint8_t key[16];
+	uint32_t keyed; /* bitmask of evp[] keyed with key */
+};
+
+static EVP_CIPHER_CTX *osdp_crypt_ctx_get(struct osdp_crypt_ctx *ctx,
+					  enum osdp_openssl_evp_e id)
+{
+	const EVP_CIPHER *cipher;
+	int enc = (id == OSDP_EVP_CBC_ENC || id == OSDP_EVP_ECB_ENC);
+
+	if (ctx->keyed & BIT(id)) {
+		return ctx->evp[id];
+	}
+	if (ctx->evp[id] == NULL) {
+		ctx->evp[id] = EVP_CIPHER_CTX_new();
+		if (ctx->evp[id] == NULL) {
+			osdp_openssl_fatal();
+		}
+	}
+	if (id == OSDP_EVP_CBC_ENC || id == OSDP_EVP_CBC_DEC) {
+		cipher = EVP_aes_128_cbc();
+	} else {
+		cipher = EVP_aes_128_ecb();
+	}
+	if (!EVP_CipherInit_ex(ctx->evp[id], cipher, NULL, ctx->key, NULL, enc) ||
+	    !EVP_CIPHER_CTX_set_padding(ctx->evp[id], 0)) {
+		osdp_openssl_fatal();
+	}
+	ctx->keyed |= BIT(id);
+	return ctx->evp[id];
+}
+
+struct osdp_crypt_ctx *osdp_crypt_ctx_new(void)
+{
+	return calloc(1, sizeof(struct osdp_crypt_ctx));
+}
+
+void osdp_crypt_ctx_free(struct osdp_crypt_ctx *ctx)
+{
+	int i;
+
+	if (ctx == NULL) {
+		return;
+	}
+	for (i = 0; i < OSDP_EVP_SENTINEL; i++) {
+		EVP_CIPHER_CTX_free(ctx->evp[i]);
+	}
+	OPENSSL_cleanse(ctx->key, sizeof(ctx->key));
+	free(ctx);
+}
+
+int osdp_crypt_ctx_set_key(struct osdp_crypt_ctx *ctx, const uint8_t *key)
+{
+	if (ctx == NULL) {
+		return -1;
+	}
+	memcpy(ctx->key, key, sizeof(ctx->key));
+	ctx->keyed = 0;
+	return 0;
+}
+
+int osdp_crypt_ctx_encrypt(struct osdp_crypt_ctx *ctx, uint8_t *iv,
+			   uint8_t *data, int data_len)
+{
+	int len;
+	EVP_CIPHER_CTX *evp;
+
+	if (ctx == NULL) {
+		return -1;
+	}
+
+	if (iv == NULL) {
+		/* encrypt one block with AES in ECB mode */
+		if (data_len != 16) {
+			return -1;
+		}
+		evp = osdp_crypt_ctx_get(ctx, OSDP_EVP_ECB_ENC);
+		if (!EVP_EncryptUpdate(evp, data, &len, data, 16)) {
+			osdp_openssl_fatal();
+		}
+		return 0;
+	}
+
+	/* encrypt multiple block with AES in CBC mode */
+	evp = osdp_crypt_ctx_get(ctx, OSDP_EVP_CBC_ENC);
+	if (!EVP_EncryptInit_ex(evp, NULL, NULL, NULL, iv)) {
+		osdp_openssl_fatal();
+	}
+
+	if (!EVP_EncryptUpdate(evp, data, &len, data, data_len)) {
+		osdp_openssl_fatal();
+	}
+
+	if (!EVP_EncryptFinal_ex(evp, data + len, &len)) {
+		osdp_openssl_fatal();
+	}
+	return 0;
+}
+
+int osdp_crypt_ctx_decrypt(struct osdp_crypt_ctx *ctx, uint8_t *iv,
+			   uint8_t *data, int data_len)
+{
+	int len;
+	EVP_CIPHER_CTX *evp;
+
+	if (ctx == NULL) {
+		return -1;
+	}
+
+	if (iv == NULL) {
+		/* decrypt one block with AES in ECB mode */
+		if (data_len != 16) {
+			return -1;
+		}
+		evp = osdp_crypt_ctx_get(ctx, OSDP_EVP_ECB_DEC);
+		if (!EVP_DecryptUpdate(evp, data, &len, data, 16)) {
+			osdp_openssl_fatal();
+		}
+		return 0;
+	}
+
+	/* decrypt multiple block with AES in CBC mode */
+	evp = osdp_crypt_ctx_get(ctx, OSDP_EVP_CBC_DEC);
+	if (!EVP_DecryptInit_ex(evp, NULL, NULL, NULL, iv)) {
+		osdp_openssl_fatal();
+	}
+
+	if (!EVP_DecryptUpdate(evp, data, &len, data, data_len)) {
+		osdp_openssl_fatal();
+	}
+
+	if (!EVP_DecryptFinal_ex(evp, data + len, &len)) {
+		osdp_openssl_fatal();
+	}
+	return 0;
+}
+
+int osdp_crypt_ctx_encrypt_batch(struct osdp_crypt_ctx **ctx,
+				 uint8_t **blocks, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (osdp_crypt_ctx_encrypt(ctx[i], NULL, blocks[i], 16)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 void osdp_fill_random(uint8_t *buf, int len)
 {
 	if (RAND_bytes(buf, len) != 1) {
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2021-2024 Siddharth Chandrasekaran <sidcha.dev@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * Random bytes for the in-tree AES backends (tinyaes.c and native.c); they
+ * have no RNG of their own.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__linux__)
+#include <sys/random.h>
+#endif
+
+void osdp_fill_random(uint8_t *buf, int len)
+{
+	int i, rnd;
+
+#if defined(__linux__)
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = getrandom(buf, len, 0);
+		if (ret <= 0) {
+			break;
+		}
+		buf += ret;
+		len -= (int)ret;
+	}
+#endif
+	for (i = 0; i < len; i++) {
+		rnd = rand();
+		buf[i] = (uint8_t)(((float)rnd) / RAND_MAX * 256);
+	}
+}
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "tinyaes_src.h"
@@ -46,14 +47,88 @@ void osdp_decrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len)
 	}
 }
 
-void osdp_fill_random(uint8_t *buf, int len)
+/**
+ * Per-key cipher context. The key is expanded once in
+ * osdp_crypt_ctx_set_key(); tiny-AES uses the same round keys for both
+ * directions so one schedule is enough.
+ */
+struct osdp_crypt_ctx {
+	struct AES_ctx aes_ctx;
+};
+
+struct osdp_crypt_ctx *osdp_crypt_ctx_new(void)
+{
+	return calloc(1, sizeof(struct osdp_crypt_ctx));
+}
+
+void osdp_crypt_ctx_free(struct osdp_crypt_ctx *ctx)
+{
+	if (ctx) {
+		memset(ctx, 0, sizeof(struct osdp_crypt_ctx));
+	}
+	free(ctx);
+}
+
+int osdp_crypt_ctx_set_key(struct osdp_crypt_ctx *ctx, const uint8_t *key)
+{
+	if (ctx == NULL) {
+		return -1;
+	}
+	AES_init_ctx(&ctx->aes_ctx, key);
+	return 0;
+}
+
+int osdp_crypt_ctx_encrypt(struct osdp_crypt_ctx *ctx, uint8_t *iv,
+			   uint8_t *data, int len)
+{
+	if (ctx == NULL) {
+		return -1;
+	}
+	if (iv != NULL) {
+		/* encrypt multiple block with AES in CBC mode */
+		AES_ctx_set_iv(&ctx->aes_ctx, iv);
+		AES_CBC_encrypt_buffer(&ctx->aes_ctx, data, len);
+	} else {
+		/* encrypt one block with AES in ECB mode */
+		if (len > 16) {
+			return -1;
+		}
+		AES_ECB_encrypt(&ctx->aes_ctx, data);
+	}
+	return 0;
+}
+
+int osdp_crypt_ctx_decrypt(struct osdp_crypt_ctx *ctx, uint8_t *iv,
+			   uint8_t *data, int len)
+{
+	if (ctx == NULL) {
+		return -1;
+	}
+	if (iv != NULL) {
+		/* decrypt multiple block with AES in CBC mode */
+		AES_ctx_set_iv(&ctx->aes_ctx, iv);
+		AES_CBC_decrypt_buffer(&ctx->aes_ctx, data, len);
+	} else {
+		/* decrypt one block with AES in ECB mode */
+		if (len > 16) {
+			return -1;
+		}
+		AES_ECB_decrypt(&ctx->aes_ctx, data);
+	}
+	return 0;
+}
+
+int osdp_crypt_ctx_encrypt_batch(struct osdp_crypt_ctx **ctx,
+				 uint8_t **blocks, int n)
 {
-	int i, rnd;
+	int i;
 
-	for (i = 0; i < len; i++) {
-		rnd = rand();
-		buf[i] = (uint8_t)(((float)rnd) / RAND_MAX * 256);
+	for (i = 0; i < n; i++) {
+		if (osdp_crypt_ctx_encrypt(ctx[i], NULL, blocks[i], 16)) {
+			return -1;
+		}
 	}
+	return 0;
 }
 
 void osdp_crypt_teardown()
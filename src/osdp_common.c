@@ -184,6 +184,25 @@ int osdp_rb_pop_buf(struct osdp_rb *p, uint8_t *buf, int max_len)
 	return i;
 }
 
+int osdp_rb_len(struct osdp_rb *p)
+{
+	int len;
+
+	len = (int)p->head - (int)p->tail;
+	if (len < 0)
+		len += sizeof(p->buffer);
+
+	return len;
+}
+
+int osdp_rb_clear(struct osdp_rb *p)
+{
+	int len = osdp_rb_len(p);
+
+	p->head = p->tail = 0;
+	return len;
+}
+
 /* --- Exported Methods --- */
 
 OSDP_EXPORT
@@ -281,3 +300,15 @@ void osdp_get_status_mask(const osdp_t *ctx, uint8_t *bitmask)
 		}
 	}
 }
+
+OSDP_EXPORT
+int osdp_get_rx_stats(const osdp_t *ctx, int pd_idx,
+		      uint32_t *discard_bytes, uint32_t *flush_count)
+{
+	input_check(ctx, pd_idx);
+	struct osdp_pd *pd = osdp_to_pd(ctx, pd_idx);
+
+	*discard_bytes = pd->rx->discard_bytes;
+	*flush_count = pd->rx->flush_count;
+	return 0;
+}
@@ -266,17 +266,20 @@ union osdp_ephemeral_data {
 #define PD_FLAG_HAS_SCBK       BIT(12) /* PD has a dedicated SCBK */
 #define PD_FLAG_SC_DISABLED    BIT(13) /* master_key=NULL && scbk=NULL */
 #define PD_FLAG_PKT_BROADCAST  BIT(14) /* this packet was addressed to 0x7F */
+#define PD_FLAG_SC_CHLNG       BIT(15) /* PD: CHLNG answered; SCRYPT due */
 
 /* CP event requests; used with make_request() and check_request() */
 #define CP_REQ_RESTART_SC              0x00000001
 #define CP_REQ_EVENT_SEND              0x00000002
 #define CP_REQ_OFFLINE                 0x00000004
+#define CP_REQ_ACURXSIZE               0x00000008
 
 enum osdp_cp_phy_state_e {
 	OSDP_CP_PHY_STATE_IDLE,
 	OSDP_CP_PHY_STATE_SEND_CMD,
 	OSDP_CP_PHY_STATE_REPLY_WAIT,
 	OSDP_CP_PHY_STATE_WAIT,
+	OSDP_CP_PHY_STATE_CRYPTO_WAIT,
 	OSDP_CP_PHY_STATE_DONE,
 	OSDP_CP_PHY_STATE_ERR,
 };
@@ -342,6 +345,8 @@ struct osdp_slab {
 	uint8_t *blob;
 };
 
+struct osdp_crypt_ctx; /* opaque; defined by the crypto backend */
+
 struct osdp_secure_channel {
 	uint8_t scbk[16];
 	uint8_t s_enc[16];
@@ -354,6 +359,11 @@ struct osdp_secure_channel {
 	uint8_t pd_client_uid[8];
 	uint8_t cp_cryptogram[16];
 	uint8_t pd_cryptogram[16];
+
+	/* Cipher contexts keyed with s_enc, s_mac1, and s_mac2 */
+	struct osdp_crypt_ctx *ctx_enc;
+	struct osdp_crypt_ctx *ctx_mac1;
+	struct osdp_crypt_ctx *ctx_mac2;
 };
 
 struct osdp_rb {
@@ -362,6 +372,105 @@ struct osdp_rb {
     uint8_t buffer[OSDP_RX_RB_SIZE];
 };
 
+/**
+ * Raw bytes received from a channel and the packet being parsed out of them.
+ * In CP mode, PDs on a multi-drop channel share one of these (only the
+ * channel lock owner reads/writes at any time); packet_buf is also used to
+ * build outgoing packets.
+ */
+struct osdp_rx {
+	struct osdp_rb rb;
+	uint8_t *packet_buf;
+	int packet_buf_size;
+	int packet_len;
+	int packet_buf_len;
+	uint32_t packet_scan_skip;
+	uint32_t discard_bytes;    /* bytes dropped by flushes/stray frames */
+	uint32_t flush_count;      /* number of RX flushes so far */
+	int refcount;              /* number of PDs using this context */
+};
+
+/* header(5) + SCB(2) + REPLY_ACK(1) + MAC(4) + CRC(2) */
+#define OSDP_ACK_FRAME_MAX_LEN 14
+
+/**
+ * Pre-built osdp_ACK frames (PD mode) indexed by sequence number. The
+ * plaintext frames are complete (with CRC); the secure channel ones only
+ * have the header, SCB and reply ID filled as the MAC changes every time.
+ */
+struct osdp_ack_cache {
+	uint8_t frame[2][4][OSDP_ACK_FRAME_MAX_LEN]; /* [sc_active][seq] */
+	uint8_t valid[2];                            /* bitmask of seq */
+};
+
+enum osdp_pd_deferred_state_e {
+	OSDP_PD_DEFERRED_IDLE,
+	OSDP_PD_DEFERRED_PENDING,  /* waiting for osdp_pd_complete_command() */
+	OSDP_PD_DEFERRED_DONE,     /* to be replied to on next CP retry */
+};
+
+/**
+ * A command that the PD app deferred by returning OSDP_PD_CMD_DEFERRED from
+ * its command callback. Commands such as osdp_OUT can invoke the callback
+ * more than once; `call` remembers which of those invocations was deferred.
+ */
+struct osdp_pd_deferred_cmd {
+	int state;                 /* enum osdp_pd_deferred_state_e */
+	int cmd_id;                /* CMD_* ID of the deferred command */
+	int seq_number;            /* seq number of the deferred command */
+	int call;                  /* callback invocation that was deferred */
+	int calls;                 /* callback invocations for current command */
+	bool busy;                 /* current command must be replied w/ BUSY */
+	int result;                /* app's verdict (see pd_command_callback_t) */
+	struct osdp_cmd cmd;
+};
+
+enum osdp_sc_job_state_e {
+	OSDP_SC_JOB_IDLE,
+	OSDP_SC_JOB_PENDING,
+	OSDP_SC_JOB_DONE,
+};
+
+/**
+ * A unit of SC handshake work (one per PD); run by the crypto worker when it
+ * is enabled, else batched with other PDs at the end of osdp_cp_refresh().
+ */
+struct osdp_sc_job {
+	queue_node_t node;
+	struct osdp_pd *pd;
+	int (*fn)(struct osdp_pd *pd);
+	int state;
+	int result;
+};
+
+/**
+ * Random bytes fetched from the crypto backend in bulk and handed out to the
+ * SC handshakes of this context. Bytes are wiped as they are handed out.
+ */
+struct osdp_rand_pool {
+	uint8_t buf[OSDP_RAND_POOL_SIZE];
+	int avail;                 /* unused bytes at the end of buf */
+	unsigned int fork_gen;     /* forks seen when buf was filled */
+};
+
+struct osdp_scbk_cache_entry {
+	uint8_t client_uid[8];
+	uint8_t scbk[16];
+};
+
+/**
+ * SCBKs derived from a master key, keyed by PD client UID. Allocated on first
+ * use with room for one entry per PD; all entries are dropped when a different
+ * master key is seen.
+ */
+struct osdp_scbk_cache {
+	uint8_t master_key[16];
+	int count;
+	int size;
+	int next;                  /* slot to replace when full */
+	struct osdp_scbk_cache_entry *entries;
+};
+
 #define OSDP_APP_DATA_QUEUE_SIZE \
 	(OSDP_CP_CMD_POOL_SIZE * \
 	 (sizeof(union osdp_ephemeral_data) + sizeof(queue_node_t)))
@@ -396,12 +505,12 @@ struct osdp_pd {
 
 	uint16_t peer_rx_size; /* Receive buffer size of the peer PD/CP */
 
-	/* Raw bytes received from the serial line for this PD */
-	struct osdp_rb rx_rb;
-	uint8_t packet_buf[OSDP_PACKET_BUF_SIZE];
-	int packet_len;
-	int packet_buf_len;
-	uint32_t packet_scan_skip;
+	/* RX context; shared with other PDs on the same channel (CP mode) */
+	struct osdp_rx *rx;
+	int packet_buf_size;   /* Negotiable; see osdp_phy_packet_buf_init() */
+	struct osdp_ack_cache *ack_cache; /* PD mode; see osdp_phy_send_ack() */
+	struct osdp_pd_deferred_cmd deferred_cmd; /* PD mode only */
+	uint32_t rx_late_replies; /* replies that came after we gave up */
 
 	int cmd_id;            /* Currently processing command ID */
 	int reply_id;          /* Currently processing reply ID */
@@ -414,6 +523,7 @@ struct osdp_pd {
 		queue_t event_queue;
 	};
 	struct osdp_app_data_pool app_data; /* alloc osdp_event / osdp_cmd */
+	int event_policy;      /* enum osdp_pd_event_overflow_policy (PD mode) */
 
 	struct osdp_channel channel;     /* PD's serial channel */
 	struct osdp_secure_channel sc;   /* Secure Channel session context */
@@ -428,6 +538,9 @@ struct osdp_pd {
 
 	/* Opaque packet capture pointer (see osdp_pcap.c) */
 	void *packet_capture_ctx;
+
+	/* CP: CCRYPT crypto in flight on the SC worker or the refresh batch */
+	struct osdp_sc_job sc_job;
 };
 
 struct osdp {
@@ -437,10 +550,18 @@ struct osdp {
 	struct osdp_pd *pd;    /* base of PD list (must be at lest one) */
 	int num_channels;      /* Number of distinct channels */
 	int *channel_lock;     /* array of length NUM_PD() to lock a channel */
+	struct osdp_scbk_cache scbk_cache;
+	struct osdp_rand_pool rand_pool;
+	struct osdp_sc_worker *sc_worker; /* NULL when not offloading SC crypto */
+	struct osdp_file_rollout *rollout; /* see osdp_file_rollout_start() */
 
 	/* CP event callback to app with opaque arg pointer as passed by app */
 	void *event_callback_arg;
 	cp_event_callback_t event_callback;
+
+	/* CP file transfer checkpoint callback; see osdp_file_checkpoint */
+	void *file_checkpoint_callback_arg;
+	osdp_file_checkpoint_callback_t file_checkpoint_callback;
 };
 
 void osdp_keyset_complete(struct osdp_pd *pd);
@@ -454,6 +575,44 @@ int osdp_phy_packet_get_data_offset(struct osdp_pd *p, const uint8_t *buf);
 uint8_t *osdp_phy_packet_get_smb(struct osdp_pd *p, const uint8_t *buf);
 int osdp_phy_send_packet(struct osdp_pd *pd, uint8_t *buf,
 			 int len, int max_len);
+int osdp_phy_send_ack(struct osdp_pd *pd);
+int osdp_phy_packet_buf_init(struct osdp_pd *pd, const struct osdp_pd_cap *cap);
+int osdp_phy_rx_init(struct osdp_pd *pd, int buf_size);
+void osdp_phy_rx_share(struct osdp_pd *pd, struct osdp_pd *owner);
+void osdp_phy_rx_free(struct osdp_pd *pd);
+int osdp_phy_ack_cache_init(struct osdp_pd *pd);
+void osdp_phy_ack_cache_free(struct osdp_pd *pd);
+
+/* from osdp_sc_worker.c */
+#ifdef CONFIG_OSDP_SC_WORKER
+int osdp_sc_worker_start(struct osdp *ctx);
+void osdp_sc_worker_stop(struct osdp *ctx);
+int osdp_sc_worker_submit(struct osdp_pd *pd, int (*fn)(struct osdp_pd *pd));
+int osdp_sc_worker_poll(struct osdp_pd *pd, int *result);
+#else
+static inline int osdp_sc_worker_start(struct osdp *ctx)
+{
+	ARG_UNUSED(ctx);
+	return 0;
+}
+static inline void osdp_sc_worker_stop(struct osdp *ctx)
+{
+	ARG_UNUSED(ctx);
+}
+static inline int osdp_sc_worker_submit(struct osdp_pd *pd,
+					int (*fn)(struct osdp_pd *pd))
+{
+	ARG_UNUSED(pd);
+	ARG_UNUSED(fn);
+	return -1;
+}
+static inline int osdp_sc_worker_poll(struct osdp_pd *pd, int *result)
+{
+	ARG_UNUSED(pd);
+	ARG_UNUSED(result);
+	return -1;
+}
+#endif
 
 /* from osdp_common.c */
 __weak int64_t osdp_millis_now(void);
@@ -467,21 +626,45 @@ int osdp_rb_push(struct osdp_rb *p, uint8_t data);
 int osdp_rb_push_buf(struct osdp_rb *p, uint8_t *buf, int len);
 int osdp_rb_pop(struct osdp_rb *p, uint8_t *data);
 int osdp_rb_pop_buf(struct osdp_rb *p, uint8_t *buf, int max_len);
+int osdp_rb_len(struct osdp_rb *p);
+int osdp_rb_clear(struct osdp_rb *p);
 
+/* once per context; osdp_crypt_teardown() must be called as many times */
 void osdp_crypt_setup();
 void osdp_encrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len);
 void osdp_decrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len);
 void osdp_fill_random(uint8_t *buf, int len);
 void osdp_crypt_teardown();
+struct osdp_crypt_ctx *osdp_crypt_ctx_new(void);
+void osdp_crypt_ctx_free(struct osdp_crypt_ctx *ctx);
+/* the osdp_crypt_ctx_* ops below return -1 if ctx is NULL or on failure */
+int osdp_crypt_ctx_set_key(struct osdp_crypt_ctx *ctx, const uint8_t *key);
+int osdp_crypt_ctx_encrypt(struct osdp_crypt_ctx *ctx, uint8_t *iv,
+			   uint8_t *data, int len);
+int osdp_crypt_ctx_decrypt(struct osdp_crypt_ctx *ctx, uint8_t *iv,
+			   uint8_t *data, int len);
+/**
+ * Encrypt n independent 16-byte blocks in ECB mode; blocks[i] is encrypted in
+ * place with ctx[i]. Backends that can pipeline AES rounds run several lanes
+ * at once; the rest process one block at a time.
+ */
+int osdp_crypt_ctx_encrypt_batch(struct osdp_crypt_ctx **ctx,
+				 uint8_t **blocks, int n);
 
 /* from osdp_sc.c */
+int osdp_ct_compare(const void *s1, const void *s2, size_t len);
+void osdp_sc_rand_init(void);
+void osdp_sc_random(struct osdp_pd *pd, uint8_t *buf, int len);
 void osdp_compute_scbk(struct osdp_pd *pd, uint8_t *master_key, uint8_t *scbk);
-void osdp_compute_session_keys(struct osdp_pd *pd);
-void osdp_compute_cp_cryptogram(struct osdp_pd *pd);
+int osdp_compute_scbk_list(const uint8_t *master_key, const uint8_t *client_uids,
+			   uint8_t *scbks, int count);
+int osdp_compute_session_keys(struct osdp_pd *pd);
+int osdp_compute_cp_cryptogram(struct osdp_pd *pd);
 int osdp_verify_cp_cryptogram(struct osdp_pd *pd);
-void osdp_compute_pd_cryptogram(struct osdp_pd *pd);
+int osdp_compute_pd_cryptogram(struct osdp_pd *pd);
 int osdp_verify_pd_cryptogram(struct osdp_pd *pd);
-void osdp_compute_rmac_i(struct osdp_pd *pd);
+int osdp_compute_rmac_i(struct osdp_pd *pd);
+void osdp_sc_ccrypt_batch(struct osdp_pd **pds, int *results, int count);
 int osdp_decrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int len);
 int osdp_encrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int len);
 int osdp_compute_mac(struct osdp_pd *pd, int is_cmd,
@@ -491,7 +674,7 @@ void osdp_sc_teardown(struct osdp_pd *pd);
 
 static inline int get_tx_buf_size(struct osdp_pd *pd)
 {
-	int packet_buf_size = sizeof(pd->packet_buf);
+	int packet_buf_size = pd->packet_buf_size;
 
 	if (pd->peer_rx_size) {
 		if (packet_buf_size > (int)pd->peer_rx_size)
@@ -150,6 +150,108 @@ static int cp_channel_release(struct osdp_pd *pd)
 	return 0;
 }
 
+static void cp_scbk_cache_reset(struct osdp_scbk_cache *c,
+				const uint8_t *master_key)
+{
+	if (c->entries) {
+		memset(c->entries, 0,
+		       sizeof(struct osdp_scbk_cache_entry) * c->size);
+	}
+	c->count = 0;
+	c->next = 0;
+	memcpy(c->master_key, master_key, 16);
+}
+
+static int cp_scbk_cache_init(struct osdp *ctx, const uint8_t *master_key)
+{
+	struct osdp_scbk_cache *c = &ctx->scbk_cache;
+
+	if (c->entries == NULL) {
+		c->entries = calloc(NUM_PD(ctx),
+				    sizeof(struct osdp_scbk_cache_entry));
+		if (c->entries == NULL) {
+			return -1;
+		}
+		c->size = NUM_PD(ctx);
+		cp_scbk_cache_reset(c, master_key);
+	} else if (osdp_ct_compare(c->master_key, master_key, 16) != 0) {
+		cp_scbk_cache_reset(c, master_key);
+	}
+	return 0;
+}
+
+static struct osdp_scbk_cache_entry *
+cp_scbk_cache_find(struct osdp_scbk_cache *c, const uint8_t *client_uid)
+{
+	int i;
+
+	for (i = 0; i < c->count; i++) {
+		if (memcmp(c->entries[i].client_uid, client_uid, 8) == 0) {
+			return &c->entries[i];
+		}
+	}
+	return NULL;
+}
+
+static void cp_scbk_cache_add(struct osdp_scbk_cache *c,
+			      const uint8_t *client_uid, const uint8_t *scbk)
+{
+	struct osdp_scbk_cache_entry *e;
+
+	e = cp_scbk_cache_find(c, client_uid);
+	if (e == NULL) {
+		if (c->count < c->size) {
+			e = &c->entries[c->count++];
+		} else {
+			e = &c->entries[c->next];
+			c->next = (c->next + 1) % c->size;
+		}
+		memcpy(e->client_uid, client_uid, 8);
+	}
+	memcpy(e->scbk, scbk, 16);
+}
+
+static void cp_scbk_cache_invalidate(struct osdp_scbk_cache *c,
+				     const uint8_t *client_uid)
+{
+	struct osdp_scbk_cache_entry *e, *last;
+
+	e = cp_scbk_cache_find(c, client_uid);
+	if (e == NULL) {
+		return;
+	}
+	last = &c->entries[--c->count];
+	if (e != last) {
+		memcpy(e, last, sizeof(struct osdp_scbk_cache_entry));
+	}
+	memset(last, 0, sizeof(struct osdp_scbk_cache_entry));
+	if (c->next >= c->count) {
+		c->next = 0;
+	}
+}
+
+/**
+ * Get the SCBK of this PD derived from master_key; from the cache when
+ * possible. If the cache cannot be allocated, the key is derived every time.
+ */
+static void cp_get_scbk(struct osdp_pd *pd, uint8_t *master_key, uint8_t *scbk)
+{
+	struct osdp *ctx = pd_to_osdp(pd);
+	struct osdp_scbk_cache_entry *e;
+
+	if (cp_scbk_cache_init(ctx, master_key)) {
+		osdp_compute_scbk(pd, master_key, scbk);
+		return;
+	}
+	e = cp_scbk_cache_find(&ctx->scbk_cache, pd->sc.pd_client_uid);
+	if (e != NULL) {
+		memcpy(scbk, e->scbk, 16);
+		return;
+	}
+	osdp_compute_scbk(pd, master_key, scbk);
+	cp_scbk_cache_add(&ctx->scbk_cache, pd->sc.pd_client_uid, scbk);
+}
+
 static const char *cp_get_cap_name(int cap)
 {
 	if (cap <= OSDP_PD_CAP_UNUSED || cap >= OSDP_PD_CAP_SENTINEL) {
@@ -180,6 +282,91 @@ static inline void assert_buf_len(int need, int have)
 		 need, have);
 }
 
+/**
+ * CP side crypto of a SC handshake, run once REPLY_CCRYPT is received:
+ * derive the session keys, verify the PD cryptogram and prepare the CP
+ * cryptogram for CMD_SCRYPT. Only pd->sc is touched so this can run on the
+ * SC crypto worker while the PD is parked in OSDP_CP_PHY_STATE_CRYPTO_WAIT.
+ */
+static int cp_sc_ccrypt_work(struct osdp_pd *pd)
+{
+	if (osdp_compute_session_keys(pd)) {
+		return -1;
+	}
+	if (osdp_verify_pd_cryptogram(pd) != 0) {
+		return -2;
+	}
+	if (osdp_compute_cp_cryptogram(pd)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int cp_sc_ccrypt_check(struct osdp_pd *pd, int rc)
+{
+	if (rc == -2) {
+		LOG_ERR("Failed to verify PD cryptogram");
+	}
+	return rc;
+}
+
+/**
+ * Without the SC crypto worker, CCRYPT crypto is queued here and run for all
+ * PDs that need it in one batch at the end of the osdp_cp_refresh() round
+ * (see cp_sc_ccrypt_flush()).
+ */
+static void cp_sc_ccrypt_submit(struct osdp_pd *pd)
+{
+	if (osdp_sc_worker_submit(pd, cp_sc_ccrypt_work) == 0) {
+		return;
+	}
+	pd->sc_job.pd = pd;
+	pd->sc_job.fn = cp_sc_ccrypt_work;
+	pd->sc_job.result = 0;
+	pd->sc_job.state = OSDP_SC_JOB_PENDING;
+}
+
+static int cp_sc_ccrypt_poll(struct osdp_pd *pd, int *result)
+{
+	if (pd_to_osdp(pd)->sc_worker) {
+		return osdp_sc_worker_poll(pd, result);
+	}
+	switch (pd->sc_job.state) {
+	case OSDP_SC_JOB_PENDING:
+		return 1;
+	case OSDP_SC_JOB_DONE:
+		*result = pd->sc_job.result;
+		pd->sc_job.state = OSDP_SC_JOB_IDLE;
+		return 0;
+	}
+	return -1;
+}
+
+static void cp_sc_ccrypt_flush(struct osdp *ctx)
+{
+	int i, n = 0;
+	struct osdp_pd *pd, *pds[OSDP_PD_MAX];
+	int results[OSDP_PD_MAX];
+
+	if (ctx->sc_worker) {
+		return;
+	}
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		pd = osdp_to_pd(ctx, i);
+		if (pd->sc_job.state == OSDP_SC_JOB_PENDING) {
+			pds[n++] = pd;
+		}
+	}
+	if (n == 0) {
+		return;
+	}
+	osdp_sc_ccrypt_batch(pds, results, n);
+	for (i = 0; i < n; i++) {
+		pds[i]->sc_job.result = results[i];
+		pds[i]->sc_job.state = OSDP_SC_JOB_DONE;
+	}
+}
+
 static int cp_build_command(struct osdp_pd *pd, uint8_t *buf, int max_len)
 {
 	struct osdp_cmd *cmd = NULL;
@@ -304,13 +491,13 @@ static int cp_build_command(struct osdp_pd *pd, uint8_t *buf, int max_len)
 		break;
 	case CMD_ACURXSIZE:
 		buf[len++] = pd->cmd_id;
-		buf[len++] = BYTE_0(OSDP_PACKET_BUF_SIZE);
-		buf[len++] = BYTE_1(OSDP_PACKET_BUF_SIZE);
+		buf[len++] = BYTE_0(pd->packet_buf_size);
+		buf[len++] = BYTE_1(pd->packet_buf_size);
 		break;
 	case CMD_KEEPACTIVE:
 		buf[len++] = pd->cmd_id;
-		buf[len++] = BYTE_0(0); // keepalive in ms time LSB
-		buf[len++] = BYTE_1(0); // keepalive in ms time MSB
+		buf[len++] = BYTE_0(OSDP_CP_SC_KEEPALIVE_MS); // keepalive in ms time LSB
+		buf[len++] = BYTE_1(OSDP_CP_SC_KEEPALIVE_MS); // keepalive in ms time MSB
 		break;
 	case CMD_ABORT:
 		buf[len++] = pd->cmd_id;
@@ -342,7 +529,7 @@ static int cp_build_command(struct osdp_pd *pd, uint8_t *buf, int max_len)
 		if (cmd->keyset.type == 1) { /* SCBK */
 			memcpy(buf + len, cmd->keyset.data, 16);
 		} else if (cmd->keyset.type == 0) {  /* master_key */
-			osdp_compute_scbk(pd, cmd->keyset.data, buf + len);
+			cp_get_scbk(pd, cmd->keyset.data, buf + len);
 		} else {
 			LOG_ERR("Unknown key type (%d)", cmd->keyset.type);
 			return -1;
@@ -368,7 +555,7 @@ static int cp_build_command(struct osdp_pd *pd, uint8_t *buf, int max_len)
 			LOG_ERR("Invalid secure message block!");
 			return OSDP_CP_ERR_GENERIC;
 		}
-		osdp_compute_cp_cryptogram(pd);
+		/* cp_cryptogram was computed along with the session keys */
 		smb[0] = 3;       /* length */
 		smb[1] = SCS_13;  /* type */
 		smb[2] = ISSET_FLAG(pd, PD_FLAG_SC_USE_SCBKD) ? 0 : 1;
@@ -464,6 +651,13 @@ static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 		if (pd->cap[t1].function_code == t1) {
 			pd->peer_rx_size = pd->cap[t1].compliance_level;
 			pd->peer_rx_size |= pd->cap[t1].num_items << 8;
+			/**
+			 * PD replies are bound by its own receive buffer;
+			 * tell it about ours when it's the smaller one.
+			 */
+			if (pd->peer_rx_size > pd->packet_buf_size) {
+				make_request(pd, CP_REQ_ACURXSIZE);
+			}
 		}
 
 		/* post-capabilities hooks */
@@ -646,11 +840,8 @@ static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 		memcpy(pd->sc.pd_random, buf + pos + 8, 8);
 		memcpy(pd->sc.pd_cryptogram, buf + pos + 16, 16);
 		pos += 32;
-		osdp_compute_session_keys(pd);
-		if (osdp_verify_pd_cryptogram(pd) != 0) {
-			LOG_ERR("Failed to verify PD cryptogram");
-			return OSDP_CP_ERR_GENERIC;
-		}
+		/* result is collected in OSDP_CP_PHY_STATE_CRYPTO_WAIT */
+		cp_sc_ccrypt_submit(pd);
 		ret = OSDP_CP_ERR_NONE;
 		break;
 	case REPLY_RMAC_I:
@@ -699,21 +890,25 @@ static int cp_build_and_send_packet(struct osdp_pd *pd)
 {
 	int ret, packet_buf_size = get_tx_buf_size(pd);
 
+	if (pd->cmd_id == CMD_FILETRANSFER) {
+		packet_buf_size = osdp_file_tx_buf_size(pd, packet_buf_size);
+	}
+
 	/* init packet buf with header */
-	ret = osdp_phy_packet_init(pd, pd->packet_buf, packet_buf_size);
+	ret = osdp_phy_packet_init(pd, pd->rx->packet_buf, packet_buf_size);
 	if (ret < 0) {
 		return OSDP_CP_ERR_GENERIC;
 	}
-	pd->packet_buf_len = ret;
+	pd->rx->packet_buf_len = ret;
 
 	/* fill command data */
-	ret = cp_build_command(pd, pd->packet_buf, packet_buf_size);
+	ret = cp_build_command(pd, pd->rx->packet_buf, packet_buf_size);
 	if (ret < 0) {
 		return OSDP_CP_ERR_GENERIC;
 	}
-	pd->packet_buf_len += ret;
+	pd->rx->packet_buf_len += ret;
 
-	ret = osdp_phy_send_packet(pd, pd->packet_buf, pd->packet_buf_len,
+	ret = osdp_phy_send_packet(pd, pd->rx->packet_buf, pd->rx->packet_buf_len,
 				   packet_buf_size);
 	if (ret < 0) {
 		return OSDP_CP_ERR_GENERIC;
@@ -786,7 +981,7 @@ static int cp_translate_cmd(struct osdp_pd *pd, struct osdp_cmd *cmd)
 		default: return -1;
 		}
 	case OSDP_CMD_KEYSET:
-		if (cmd->keyset.type != 1 || !sc_is_active(pd)) {
+		if (cmd->keyset.type > 1 || !sc_is_active(pd)) {
 			return -1;
 		} else {
 			return CMD_KEYSET;
@@ -818,7 +1013,8 @@ static inline bool cp_phy_running(struct osdp_pd *pd)
 {
 	return (pd->phy_state == OSDP_CP_PHY_STATE_SEND_CMD ||
 		pd->phy_state == OSDP_CP_PHY_STATE_REPLY_WAIT ||
-		pd->phy_state == OSDP_CP_PHY_STATE_WAIT);
+		pd->phy_state == OSDP_CP_PHY_STATE_WAIT ||
+		pd->phy_state == OSDP_CP_PHY_STATE_CRYPTO_WAIT);
 }
 
 static inline bool cp_phy_kick(struct osdp_pd *pd)
@@ -832,7 +1028,7 @@ static inline bool cp_phy_kick(struct osdp_pd *pd)
 
 static int cp_phy_state_update(struct osdp_pd *pd)
 {
-	int rc, ret = OSDP_CP_ERR_CAN_YIELD;
+	int rc, result, ret = OSDP_CP_ERR_CAN_YIELD;
 
 	switch (pd->phy_state) {
 	case OSDP_CP_PHY_STATE_DONE:
@@ -844,6 +1040,7 @@ static int cp_phy_state_update(struct osdp_pd *pd)
 		break;
 	case OSDP_CP_PHY_STATE_WAIT:
 		if (osdp_millis_since(pd->phy_tstamp) < pd->wait_ms) {
+			osdp_file_tx_prefetch(pd);
 			return OSDP_CP_ERR_CAN_YIELD;
 		}
 		pd->phy_state = OSDP_CP_PHY_STATE_SEND_CMD;
@@ -868,6 +1065,15 @@ static int cp_phy_state_update(struct osdp_pd *pd)
 			if (sc_is_active(pd)) {
 				pd->sc_tstamp = osdp_millis_now();
 			}
+			rc = cp_sc_ccrypt_poll(pd, &result);
+			if (rc > 0) {
+				/* bus is free; let other PDs run meanwhile */
+				pd->phy_state = OSDP_CP_PHY_STATE_CRYPTO_WAIT;
+				return OSDP_CP_ERR_CAN_YIELD;
+			}
+			if (rc == 0 && cp_sc_ccrypt_check(pd, result)) {
+				goto error;
+			}
 			pd->phy_state = OSDP_CP_PHY_STATE_DONE;
 			return OSDP_CP_ERR_NONE;
 		}
@@ -902,8 +1108,20 @@ static int cp_phy_state_update(struct osdp_pd *pd)
 				osdp_cmd_name(pd->cmd_id), pd->cmd_id);
 			goto error;
 		}
+		/* PD is yet to reply; get the next file chunk ready */
+		osdp_file_tx_prefetch(pd);
 		ret = OSDP_CP_ERR_INPROG;
 		break;
+	case OSDP_CP_PHY_STATE_CRYPTO_WAIT:
+		rc = cp_sc_ccrypt_poll(pd, &result);
+		if (rc > 0) {
+			return OSDP_CP_ERR_CAN_YIELD;
+		}
+		if (rc < 0 || cp_sc_ccrypt_check(pd, result)) {
+			goto error;
+		}
+		pd->phy_state = OSDP_CP_PHY_STATE_DONE;
+		return OSDP_CP_ERR_NONE;
 	}
 
 	return ret;
@@ -932,6 +1150,23 @@ static int cp_get_online_command(struct osdp_pd *pd)
 	struct osdp_cmd *cmd;
 	int ret;
 
+	if (check_request(pd, CP_REQ_ACURXSIZE)) {
+		return CMD_ACURXSIZE;
+	}
+
+	/**
+	 * The PD drops the SC after OSDP_PD_SC_TIMEOUT_MS without a secure
+	 * exchange. If the PD has gone that long without one, renew the SC
+	 * right away instead of sending a command that would only fail on a
+	 * MAC error.
+	 */
+	if (sc_is_active(pd) &&
+	    osdp_millis_since(pd->sc_tstamp) > OSDP_PD_SC_TIMEOUT_MS) {
+		LOG_WRN("SC session expired on PD; renewing it");
+		make_request(pd, CP_REQ_RESTART_SC);
+		return -1;
+	}
+
 	if (cp_cmd_dequeue(pd, &cmd) == 0) {
 		ret = cp_translate_cmd(pd, cmd);
 		cp_cmd_free(pd, cmd);
@@ -939,7 +1174,23 @@ static int cp_get_online_command(struct osdp_pd *pd)
 	}
 
 	ret = osdp_file_tx_get_command(pd);
-	if (ret != 0) {
+	if (ret > 0) {
+		return ret;
+	}
+
+	/**
+	 * Nothing else is due (the file transfer may be holding the bus for
+	 * a PD requested delay) and the SC is close to timing out on the PD;
+	 * keep it alive instead of letting it lapse into a new handshake.
+	 */
+	if (sc_is_active(pd) &&
+	    osdp_millis_since(pd->sc_tstamp) >
+		    OSDP_PD_SC_TIMEOUT_MS - OSDP_CP_SC_KEEPALIVE_MS) {
+		pd->tstamp = osdp_millis_now();
+		return CMD_KEEPACTIVE;
+	}
+
+	if (ret < 0) {
 		return ret;
 	}
 
@@ -990,7 +1241,14 @@ static void cp_keyset_complete(struct osdp_pd *pd)
 
 	if (!ISSET_FLAG(pd, PD_FLAG_SC_USE_SCBKD)) {
 		cmd = (struct osdp_cmd *)pd->ephemeral_data;
-		memcpy(pd->sc.scbk, cmd->keyset.data, 16);
+		if (cmd->keyset.type == 0) {
+			/* commit the derived SCBK; not the master key */
+			cp_get_scbk(pd, cmd->keyset.data, pd->sc.scbk);
+			cp_scbk_cache_invalidate(&pd_to_osdp(pd)->scbk_cache,
+						 pd->sc.pd_client_uid);
+		} else {
+			memcpy(pd->sc.scbk, cmd->keyset.data, 16);
+		}
 	} else {
 		CLEAR_FLAG(pd, PD_FLAG_SC_USE_SCBKD);
 	}
@@ -1018,6 +1276,11 @@ static bool cp_check_online_response(struct osdp_pd *pd)
 		return true;
 	}
 
+	/* ACURXSIZE is optional; PD will just reply in smaller packets */
+	if (pd->cmd_id == CMD_ACURXSIZE && pd->reply_id == REPLY_NAK) {
+		return true;
+	}
+
 	/* A NAK or no response is always an error */
 	if (pd->reply_id == REPLY_NAK || pd->reply_id == REPLY_INVALID) {
 		return false;
@@ -1107,6 +1370,7 @@ static enum osdp_cp_state_e get_next_ok_state(struct osdp_pd *pd)
 		return OSDP_CP_STATE_SC_SCRYPT;
 	case OSDP_CP_STATE_SC_SCRYPT:
 		sc_activate(pd);
+		pd->sc_tstamp = osdp_millis_now();
 		notify_sc_status(pd);
 		if (ISSET_FLAG(pd, PD_FLAG_SC_USE_SCBKD)) {
 			LOG_WRN("SC active with SCBK-D. Set SCBK");
@@ -1387,6 +1651,44 @@ static int cp_detect_connection_topology(struct osdp *ctx)
 	return 0;
 }
 
+/**
+ * Allocate one RX context per channel. PDs on a multi-drop channel share the
+ * RX context of the first PD on that channel; so the packet buffer has to be
+ * large enough for the biggest of them.
+ */
+static int cp_rx_setup(struct osdp *ctx)
+{
+	int i, j, buf_size;
+	struct osdp_pd *pd, *peer = NULL;
+
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		pd = osdp_to_pd(ctx, i);
+		for (j = 0; j < i; j++) {
+			peer = osdp_to_pd(ctx, j);
+			if (peer->channel.id == pd->channel.id) {
+				break;
+			}
+		}
+		if (j < i) {
+			osdp_phy_rx_share(pd, peer);
+			continue;
+		}
+		buf_size = pd->packet_buf_size;
+		for (j = i + 1; j < NUM_PD(ctx); j++) {
+			peer = osdp_to_pd(ctx, j);
+			if (peer->channel.id == pd->channel.id &&
+			    peer->packet_buf_size > buf_size) {
+				buf_size = peer->packet_buf_size;
+			}
+		}
+		if (osdp_phy_rx_init(pd, buf_size)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static struct osdp *__cp_setup(int num_pd, const osdp_pd_info_t *info_list)
 {
 	int i;
@@ -1402,6 +1704,8 @@ static struct osdp *__cp_setup(int num_pd, const osdp_pd_info_t *info_list)
 	}
 
 	input_check_init(ctx);
+	osdp_crypt_setup();
+	osdp_sc_rand_init();
 
 	ctx->pd = calloc(1, sizeof(struct osdp_pd) * num_pd);
 	if (ctx->pd == NULL) {
@@ -1438,6 +1742,9 @@ static struct osdp *__cp_setup(int num_pd, const osdp_pd_info_t *info_list)
 		if (cp_cmd_queue_init(pd)) {
 			goto error;
 		}
+		if (osdp_phy_packet_buf_init(pd, info->cap)) {
+			goto error;
+		}
 		if (IS_ENABLED(CONFIG_OSDP_SKIP_MARK_BYTE)) {
 			SET_FLAG(pd, PD_FLAG_PKT_SKIP_MARK);
 		}
@@ -1456,6 +1763,16 @@ static struct osdp *__cp_setup(int num_pd, const osdp_pd_info_t *info_list)
 		goto error;
 	}
 
+	if (cp_rx_setup(ctx)) {
+		LOG_PRINT("Failed to setup channel RX contexts");
+		goto error;
+	}
+
+	if (osdp_sc_worker_start(ctx)) {
+		LOG_PRINT("Failed to start SC crypto worker");
+		goto error;
+	}
+
 	SET_CURRENT_PD(ctx, 0);
 
 	LOG_PRINT("CP Setup complete; LibOSDP-%s %s NumPDs:%d Channels:%d",
@@ -1485,14 +1802,25 @@ void osdp_cp_teardown(osdp_t *ctx)
 	int i;
 	struct osdp_pd *pd;
 
+	osdp_sc_worker_stop(TO_OSDP(ctx));
 	for (i = 0; i < NUM_PD(ctx); i++) {
 		pd = osdp_to_pd(ctx, i);
 		if (is_capture_enabled(pd)) {
 			osdp_packet_capture_finish(pd);
 		}
+		osdp_sc_teardown(pd);
+		osdp_phy_rx_free(pd);
 		safe_free(pd->file);
 	}
-
+	osdp_crypt_teardown();
+	safe_free(TO_OSDP(ctx)->rollout);
+
+	if (TO_OSDP(ctx)->scbk_cache.entries) {
+		memset(TO_OSDP(ctx)->scbk_cache.entries, 0,
+		       sizeof(struct osdp_scbk_cache_entry) *
+		       TO_OSDP(ctx)->scbk_cache.size);
+		safe_free(TO_OSDP(ctx)->scbk_cache.entries);
+	}
 	safe_free(osdp_to_pd(ctx, 0));
 	safe_free(TO_OSDP(ctx)->channel_lock);
 	safe_free(ctx);
@@ -1504,6 +1832,8 @@ void osdp_cp_refresh(osdp_t *ctx)
 	int next_pd_idx, refresh_count = 0;
 	struct osdp_pd *pd;
 
+	osdp_file_rollout_refresh(TO_OSDP(ctx));
+
 	do {
 		pd = GET_CURRENT_PD(ctx);
 
@@ -1516,6 +1846,8 @@ void osdp_cp_refresh(osdp_t *ctx)
 		}
 		SET_CURRENT_PD(ctx, next_pd_idx);
 	} while (++refresh_count < NUM_PD(ctx));
+
+	cp_sc_ccrypt_flush(TO_OSDP(ctx));
 }
 
 void osdp_cp_set_event_callback(osdp_t *ctx, cp_event_callback_t cb, void *arg)
@@ -1538,9 +1870,11 @@ int osdp_cp_send_command(osdp_t *ctx, int pd_idx, const struct osdp_cmd *cmd)
 
 	if (cmd->id == OSDP_CMD_FILE_TX) {
 		return osdp_file_tx_command(pd, cmd->file_tx.id,
-					    cmd->file_tx.flags);
+					    cmd->file_tx.flags,
+					    cmd->file_tx.offset);
 	} else if (cmd->id == OSDP_CMD_KEYSET) {
-		if (cmd->keyset.type != 1 || !sc_is_active(pd)) {
+		/* type 0 (master key) is sent to the PD as its derived SCBK */
+		if (cmd->keyset.type > 1 || !sc_is_active(pd)) {
 			return -1;
 		}
 	}
@@ -1611,6 +1945,41 @@ int osdp_cp_modify_flag(osdp_t *ctx, int pd_idx, uint32_t flags, bool do_set)
 	return 0;
 }
 
+int osdp_cp_preload_scbk(osdp_t *ctx, const uint8_t *master_key,
+			 const uint8_t *client_uids, int count)
+{
+	input_check(ctx);
+	int i, n;
+	uint8_t *scbks;
+	struct osdp_scbk_cache *c = &TO_OSDP(ctx)->scbk_cache;
+
+	if (master_key == NULL || client_uids == NULL || count <= 0) {
+		return -1;
+	}
+	if (cp_scbk_cache_init(TO_OSDP(ctx), master_key)) {
+		return -1;
+	}
+
+	/* Only the last c->size keys would survive; don't derive the rest */
+	n = (count < c->size) ? count : c->size;
+	client_uids += (count - n) * 8;
+
+	scbks = malloc(n * 16);
+	if (scbks == NULL) {
+		return -1;
+	}
+	if (osdp_compute_scbk_list(master_key, client_uids, scbks, n)) {
+		free(scbks);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		cp_scbk_cache_add(c, client_uids + i * 8, scbks + i * 16);
+	}
+	memset(scbks, 0, n * 16);
+	free(scbks);
+	return n;
+}
+
 #ifdef UNIT_TESTING
 
 /**
@@ -29,7 +29,7 @@ void osdp_packet_capture_init(struct osdp_pd *pd)
 	char path[128];
 
 	pcap_file_name(pd, path, sizeof(path));
-	cap = pcap_start(path, OSDP_PACKET_BUF_SIZE, OSDP_PCAP_LINK_TYPE);
+	cap = pcap_start(path, OSDP_PACKET_BUF_SIZE_MAX, OSDP_PCAP_LINK_TYPE);
 	if (cap) {
 		LOG_WRN("Capturing packets to '%s'", path);
 		LOG_WRN("A graceful teardown of libosdp ctx is required"
@@ -60,6 +60,6 @@ void osdp_capture_packet(struct osdp_pd *pd, uint8_t *buf, int len)
 	pcap_t *cap = pd->packet_capture_ctx;
 
 	assert(cap);
-	assert(len <= OSDP_PACKET_BUF_SIZE);
+	assert(len <= OSDP_PACKET_BUF_SIZE_MAX);
 	pcap_add(cap, buf, len);
 }
@@ -5,8 +5,16 @@
  */
 
 #include <stdlib.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FILE_MEM_HAS_MMAP
+#endif
 
 #include "osdp_file.h"
+#include "osdp_lz.h"
 
 #define FILE_TRANSFER_HEADER_SIZE     11
 #define FILE_TRANSFER_STAT_SIZE       7
@@ -22,6 +30,12 @@
 #define OSDP_FILE_TX_FLAG_EXCLUSIVE            0x01000000
 #define OSDP_FILE_TX_FLAG_PLAIN_TEXT           0x02000000
 #define OSDP_FILE_TX_FLAG_POLL_RESP            0x04000000
+#define OSDP_FILE_TX_FLAG_ROLLOUT              0x08000000
+#define OSDP_FILE_TX_FLAG_RESUMED              0x10000000
+#define OSDP_FILE_TX_FLAG_LZ                   0x20000000
+#define OSDP_FILE_TX_FLAG_LZ_CHUNK             0x40000000
+
+#define OSDP_FILE_STAT_CTRL_LZ                 0x08
 
 static inline void file_state_reset(struct osdp_file *f)
 {
@@ -35,6 +49,21 @@ static inline void file_state_reset(struct osdp_file *f)
 	f->tstamp = 0;
 	f->wait_time_ms = 0;
 	f->cancel_req = false;
+#ifdef CONFIG_OSDP_FILE_WRITE_BEHIND
+	f->wb.offset = 0;
+	f->wb.len = 0;
+	f->wb.error = false;
+#endif
+#ifdef CONFIG_OSDP_FILE_READ_AHEAD
+	f->ra.offset = 0;
+	f->ra.len = 0;
+	f->ra.error = false;
+#endif
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	f->lz.offset = 0;
+	f->lz.len = 0;
+	f->lz.hist = 0;
+#endif
 }
 
 static inline bool file_tx_in_progress(struct osdp_file *f)
@@ -44,20 +73,267 @@ static inline bool file_tx_in_progress(struct osdp_file *f)
 
 /* --- Sender CMD/RESP Handers --- */
 
-static void write_file_tx_header(struct osdp_file *f, uint8_t *buf)
+static void file_checkpoint(struct osdp_pd *pd, struct osdp_file *f)
+{
+	struct osdp *ctx = pd_to_osdp(pd);
+	struct osdp_file_checkpoint ckpt = {
+		.file_id = f->file_id,
+		.size = f->size,
+		.offset = f->offset,
+	};
+
+	f->checkpoint = f->offset;
+	if (ctx->file_checkpoint_callback) {
+		ctx->file_checkpoint_callback(ctx->file_checkpoint_callback_arg,
+					      pd->idx, &ckpt);
+	}
+}
+
+static void write_file_tx_header(struct osdp_file *f, uint8_t *buf,
+				 int type, int length)
 {
 	int len = 0;
 
-	U8_TO_BYTES_LE(f->file_id, buf, len);
+	U8_TO_BYTES_LE(type, buf, len);
 	U32_TO_BYTES_LE(f->size, buf, len);
 	U32_TO_BYTES_LE(f->offset, buf, len);
-	U16_TO_BYTES_LE(f->length, buf, len);
+	U16_TO_BYTES_LE(length, buf, len);
 	assert(len == FILE_TRANSFER_HEADER_SIZE);
 }
 
+/**
+ * Largest chunk of file data that fits in a CMD_FILETRANSFER whose data block
+ * (command ID onwards) can take up to max_len bytes of the packet buffer.
+ */
+static int file_tx_chunk_size(struct osdp_pd *pd, int max_len)
+{
+	/* command ID and CRC */
+	max_len -= 1 + 2;
+
+	if (sc_is_active(pd)) {
+		/**
+		 * MAC; then everything after the command ID is encrypted after
+		 * appending an EOM marker and padding it to the AES block size.
+		 */
+		max_len -= 4;
+		max_len = (max_len & ~(16 - 1)) - 1;
+	}
+
+	return max_len - FILE_TRANSFER_HEADER_SIZE;
+}
+
+#ifdef CONFIG_OSDP_FILE_READ_AHEAD
+
+static int file_mem_read(void *arg, void *buf, int size, int offset);
+
+static inline bool file_ra_enabled(struct osdp_file *f)
+{
+	/* built-in memory backed files are never slow to read */
+	return f->ops.read != file_mem_read;
+}
+
+/**
+ * Slide the read-ahead window to start at the chunk that is due next. The CP
+ * only moves backwards in the file when it starts over or resumes from a
+ * checkpoint; whatever was read ahead is of no use then.
+ */
+static void file_ra_seek(struct osdp_file *f)
+{
+	uint32_t end = f->ra.offset + f->ra.len;
+
+	if (f->offset < f->ra.offset || f->offset > end) {
+		f->ra.len = 0;
+	} else {
+		f->ra.len = end - f->offset;
+	}
+	f->ra.offset = f->offset;
+}
+
+static int file_ra_fill_once(struct osdp_pd *pd, struct osdp_file *f)
+{
+	int rc;
+	uint32_t idx, len, end;
+
+	file_ra_seek(f);
+	end = f->ra.offset + f->ra.len;
+	if (end >= f->size || f->ra.len == OSDP_FILE_RA_SIZE) {
+		return 0;
+	}
+
+	/* one read into the free space up to the end of buf */
+	idx = end % OSDP_FILE_RA_SIZE;
+	len = OSDP_FILE_RA_SIZE - idx;
+	if (len > OSDP_FILE_RA_SIZE - f->ra.len) {
+		len = OSDP_FILE_RA_SIZE - f->ra.len;
+	}
+	if (len > f->size - end) {
+		len = f->size - end;
+	}
+
+	rc = f->ops.read(f->ops.arg, f->ra.buf + idx, (int)len, (int)end);
+	if (rc < 0 || rc > (int)len) {
+		LOG_ERR("RA: user read failed! rc:%d len:%d off:%d",
+			rc, len, end);
+		f->ra.error = true;
+		return -1;
+	}
+	f->ra.error = false;
+	f->ra.len += rc;
+	return rc;
+}
+
+/**
+ * Called by the CP while the bus is busy with this PD (or the PD has asked
+ * for a delay) to get the next chunks off the source before they are due.
+ * At most one ops.read() is made per call.
+ */
+void osdp_file_tx_prefetch(struct osdp_pd *pd)
+{
+	struct osdp_file *f = TO_FILE(pd);
+
+	/* after a failed read, leave it to file_tx_read() to try again */
+	if (!file_tx_in_progress(f) || !file_ra_enabled(f) || f->ra.error) {
+		return;
+	}
+	file_ra_fill_once(pd, f);
+}
+
+#endif /* CONFIG_OSDP_FILE_READ_AHEAD */
+
+static int file_tx_read(struct osdp_pd *pd, struct osdp_file *f,
+			uint8_t *buf, int len)
+{
+#ifdef CONFIG_OSDP_FILE_READ_AHEAD
+	int rc;
+	uint32_t idx, n;
+
+	if (!file_ra_enabled(f)) {
+		return f->ops.read(f->ops.arg, buf, len, f->offset);
+	}
+
+	if ((uint32_t)len > f->size - f->offset) {
+		len = (int)(f->size - f->offset);
+	}
+
+	/* normally already there; read whatever is missing in place */
+	file_ra_seek(f);
+	while (f->ra.len < (uint32_t)len) {
+		rc = file_ra_fill_once(pd, f);
+		if (rc < 0) {
+			/* give the source a go at the whole chunk directly */
+			return f->ops.read(f->ops.arg, buf, len, f->offset);
+		}
+		if (rc == 0) {
+			len = (int)f->ra.len;
+			break;
+		}
+	}
+
+	idx = f->ra.offset % OSDP_FILE_RA_SIZE;
+	n = OSDP_FILE_RA_SIZE - idx;
+	if (n > (uint32_t)len) {
+		n = len;
+	}
+	memcpy(buf, f->ra.buf + idx, n);
+	memcpy(buf + n, f->ra.buf, len - n);
+	return len;
+#else
+	ARG_UNUSED(pd);
+	return f->ops.read(f->ops.arg, buf, len, f->offset);
+#endif
+}
+
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+
+/**
+ * Read the data for the chunk at f->offset into f->lz.buf, right after the
+ * file data before it that the PD is known to have. That part is kept from
+ * the last chunk; the CP only has to go back in the file when it starts over
+ * or resumes, and the PD has nothing to refer back to then. Returns the size
+ * of that dictionary.
+ */
+static int file_tx_lz_fill(struct osdp_pd *pd, struct osdp_file *f, int len)
+{
+	int rc;
+	uint32_t start, dict_len = 0;
+
+	if (f->lz.hist > f->offset) {
+		f->lz.hist = f->offset;
+	}
+	start = f->lz.hist;
+	if (f->offset - start > OSDP_FILE_LZ_HISTORY_SIZE) {
+		start = f->offset - OSDP_FILE_LZ_HISTORY_SIZE;
+	}
+	if (start < f->lz.offset) {
+		start = f->lz.offset;
+	}
+	if (start <= f->offset && f->offset <= f->lz.offset + f->lz.len) {
+		dict_len = f->offset - start;
+		memmove(f->lz.buf, f->lz.buf + (start - f->lz.offset), dict_len);
+	}
+	f->lz.offset = f->offset - dict_len;
+	f->lz.len = dict_len;
+
+	rc = file_tx_read(pd, f, f->lz.buf + dict_len, len);
+	if (rc < 0) {
+		return -1;
+	}
+	f->lz.len += rc;
+	return (int)dict_len;
+}
+
+#endif /* CONFIG_OSDP_FILE_COMPRESSION */
+
+/**
+ * Fill buf (of size len) with the data section of the chunk that is due next
+ * and set f->length to the number of file bytes it carries. When the PD can
+ * take them, that is a compressed block holding as much of the file as fits.
+ * Returns the size of the data section or -1 on errors.
+ */
+static int file_tx_build_chunk(struct osdp_pd *pd, struct osdp_file *f,
+			       uint8_t *buf, int len)
+{
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	int rc, raw_len, dict_len, lz_len;
+
+	CLEAR_FLAG(f, OSDP_FILE_TX_FLAG_LZ_CHUNK);
+	if (ISSET_FLAG(f, OSDP_FILE_TX_FLAG_LZ) &&
+	    f->file_id != OSDP_FILE_TYPE_LZ) {
+		/* a compressed block takes in more of the file than fits */
+		raw_len = 4 * len;
+		if (raw_len > OSDP_FILE_LZ_BLOCK_SIZE) {
+			raw_len = OSDP_FILE_LZ_BLOCK_SIZE;
+		}
+		dict_len = file_tx_lz_fill(pd, f, raw_len);
+		if (dict_len < 0) {
+			return -1;
+		}
+		raw_len = (int)f->lz.len - dict_len;
+		if (raw_len == 0) {
+			return 0;
+		}
+
+		rc = raw_len;
+		lz_len = osdp_lz_compress(f->lz.buf, dict_len, &rc, buf, len);
+		if (lz_len > 0 && rc > lz_len) {
+			SET_FLAG(f, OSDP_FILE_TX_FLAG_LZ_CHUNK);
+			f->length = rc;
+			return lz_len;
+		}
+
+		/* does not compress; send it as it is */
+		f->length = raw_len < len ? raw_len : len;
+		memcpy(buf, f->lz.buf + dict_len, f->length);
+		return f->length;
+	}
+#endif
+	f->length = file_tx_read(pd, f, buf, len);
+	return f->length;
+}
+
 int osdp_file_cmd_tx_build(struct osdp_pd *pd, uint8_t *buf, int max_len)
 {
-	int buf_available;
+	int buf_available, len, type;
 	struct osdp_file *f = TO_FILE(pd);
 	uint8_t *data = buf + FILE_TRANSFER_HEADER_SIZE;
 
@@ -68,9 +344,16 @@ int osdp_file_cmd_tx_build(struct osdp_pd *pd, uint8_t *buf, int max_len)
 	BUG_ON(f == NULL);
 	BUG_ON(f->state != OSDP_FILE_INPROG && f->state != OSDP_FILE_KEEP_ALIVE);
 
-	if ((size_t)max_len <= FILE_TRANSFER_HEADER_SIZE) {
-		LOG_ERR("TX_Build: insufficient space need:%zu have:%d",
-			FILE_TRANSFER_HEADER_SIZE, max_len);
+	/**
+	 * OSDP File module is a bit different than the rest of LibOSDP: it
+	 * tries to greedily consume all available packet space. Work out how
+	 * much of it is left for file data once the phy layer and the secure
+	 * channel (if active) have taken their share.
+	 */
+	buf_available = file_tx_chunk_size(pd, max_len);
+	if (buf_available <= 0) {
+		LOG_ERR("TX_Build: insufficient space for file data; have:%d",
+			max_len);
 		goto reply_abort;
 	}
 
@@ -80,36 +363,29 @@ int osdp_file_cmd_tx_build(struct osdp_pd *pd, uint8_t *buf, int max_len)
 
 	if (f->state == OSDP_FILE_KEEP_ALIVE) {
 		LOG_DBG("TX_Build: keep-alive");
-		write_file_tx_header(f, buf);
+		write_file_tx_header(f, buf, f->file_id, 0);
 		return FILE_TRANSFER_HEADER_SIZE;
 	}
 
-	/**
-	 * OSDP File module is a bit different than the rest of LibOSDP: it
-	 * tries to greedily consume all available packet space. We need to
-	 * account for the bytes that phy layer would add and then account for
-	 * the overhead due to encryption if a secure channel is active. For
-	 * now 16 is choosen based on crude observation.
-	 *
-	 * TODO: Try to add smarts here later.
-	 */
-	buf_available = max_len - FILE_TRANSFER_HEADER_SIZE - 16;
-
-	f->length = f->ops.read(f->ops.arg, data, buf_available, f->offset);
-	if (f->length < 0) {
+	len = file_tx_build_chunk(pd, f, data, buf_available);
+	if (len < 0) {
 		LOG_ERR("TX_Build: user read failed! rc:%d len:%d off:%d",
-			f->length, buf_available, f->offset);
+			len, buf_available, f->offset);
 		goto reply_abort;
 	}
-	if (f->length == 0) {
+	if (len == 0) {
 		LOG_WRN("TX_Build: Read 0 length chunk");
 		goto reply_abort;
 	}
 
 	/* fill the packet buffer (layout: struct osdp_cmd_file_xfer) */
-	write_file_tx_header(f, buf);
+	type = f->file_id;
+	if (ISSET_FLAG(f, OSDP_FILE_TX_FLAG_LZ_CHUNK)) {
+		type = OSDP_FILE_TYPE_LZ;
+	}
+	write_file_tx_header(f, buf, type, len);
 
-	return FILE_TRANSFER_HEADER_SIZE + f->length;
+	return FILE_TRANSFER_HEADER_SIZE + len;
 
 reply_abort:
 	LOG_ERR("TX_Build: Aborting file transfer due to unrecoverable error!");
@@ -117,10 +393,37 @@ reply_abort:
 	return -1;
 }
 
+/**
+ * The PD refused the last chunk. It may not have the file data that we were
+ * compressing against (it could have restarted and lost track of the transfer
+ * altogether) so send plain chunks until it acks one. Returns true if the PD
+ * could not make sense of a compressed chunk; it only needs to be sent again.
+ */
+static bool file_tx_lz_rejected(struct osdp_pd *pd, struct osdp_file *f,
+				int status)
+{
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	bool lz_chunk = ISSET_FLAG(f, OSDP_FILE_TX_FLAG_LZ_CHUNK);
+
+	CLEAR_FLAG(f, OSDP_FILE_TX_FLAG_LZ | OSDP_FILE_TX_FLAG_LZ_CHUNK);
+	f->lz.hist = f->offset;
+	if (lz_chunk && status == OSDP_FILE_TX_STATUS_ERR_UNKNOWN) {
+		LOG_WRN("Stat_Decode: PD rejected compressed chunk at "
+			"offset:%d", f->offset);
+		return true;
+	}
+#else
+	ARG_UNUSED(pd);
+	ARG_UNUSED(f);
+	ARG_UNUSED(status);
+#endif
+	return false;
+}
+
 int osdp_file_cmd_stat_decode(struct osdp_pd *pd, uint8_t *buf, int len)
 {
 	int pos = 0;
-	bool do_close = false;
+	bool do_close = false, last_chunk;
 	struct osdp_file *f = TO_FILE(pd);
 	struct osdp_cmd_file_stat stat;
 
@@ -152,13 +455,59 @@ int osdp_file_cmd_stat_decode(struct osdp_pd *pd, uint8_t *buf, int len)
 	SET_FLAG_V(f, OSDP_FILE_TX_FLAG_EXCLUSIVE, !(stat.control & 0x01))
 	SET_FLAG_V(f, OSDP_FILE_TX_FLAG_PLAIN_TEXT, stat.control & 0x02)
 	SET_FLAG_V(f, OSDP_FILE_TX_FLAG_POLL_RESP, stat.control & 0x04)
+	SET_FLAG_V(f, OSDP_FILE_TX_FLAG_LZ,
+		   stat.control & OSDP_FILE_STAT_CTRL_LZ)
 
-	f->offset += f->length;
-	do_close = f->length && (f->offset == f->size);
 	f->wait_time_ms = stat.delay;
 	f->tstamp = osdp_millis_now();
+
+	if (stat.rx_size && stat.rx_size != f->rx_size) {
+		if (stat.rx_size < OSDP_PACKET_BUF_SIZE_MIN) {
+			LOG_WRN("Stat_Decode: Ignoring alternate rx_size:%d",
+				stat.rx_size);
+		} else {
+			LOG_INF("Stat_Decode: PD requested rx_size:%d",
+				stat.rx_size);
+			f->rx_size = stat.rx_size;
+		}
+	}
+
+	if (stat.status < 0) {
+		/* PD did not take this chunk; offset stays where it was */
+		last_chunk = f->offset + f->length >= f->size;
+		f->length = 0;
+		f->errors++;
+		if (file_tx_lz_rejected(pd, f, stat.status)) {
+			return 0;
+		}
+		if (last_chunk && !ISSET_FLAG(f, OSDP_FILE_TX_FLAG_RESUMED)) {
+			LOG_ERR("Stat_Decode: File transfer error; "
+				"status:%d offset:%d", stat.status, f->offset);
+			return -1;
+		}
+		/**
+		 * If it was not the first chunk, the PD may have lost what we
+		 * sent earlier (or refused to resume a transfer from a
+		 * checkpoint); start over from offset 0.
+		 */
+		LOG_WRN("Stat_Decode: PD rejected offset:%d; status:%d",
+			f->offset, stat.status);
+		CLEAR_FLAG(f, OSDP_FILE_TX_FLAG_RESUMED);
+		f->offset = 0;
+		f->checkpoint = 0;
+		return 0;
+	}
+
+	f->offset += f->length;
+	do_close = f->length && (f->offset == f->size);
 	f->length = 0;
 	f->errors = 0;
+	CLEAR_FLAG(f, OSDP_FILE_TX_FLAG_RESUMED);
+
+	if (f->offset - f->checkpoint >= OSDP_FILE_CHECKPOINT_INTERVAL ||
+	    f->offset == f->size) {
+		file_checkpoint(pd, f);
+	}
 
 	if (f->offset != f->size) {
 		/* Transfer is in progress */
@@ -191,11 +540,253 @@ int osdp_file_cmd_stat_decode(struct osdp_pd *pd, uint8_t *buf, int len)
 	}
 }
 
+/* --- Receiver Write-Behind --- */
+
+#ifdef CONFIG_OSDP_FILE_WRITE_BEHIND
+
+/**
+ * Hand one contiguous run of staged data to ops.write(). Unless @partial is
+ * set, the run is trimmed to end at a page boundary in the file so that the
+ * app only ever sees page sized (and page aligned) writes. Returns the number
+ * of bytes written out or -1 on error.
+ */
+static int file_wb_flush_once(struct osdp_pd *pd, struct osdp_file *f,
+			      bool partial)
+{
+	int rc;
+	uint32_t idx, len, end;
+
+	idx = f->wb.offset % OSDP_FILE_WB_SIZE;
+	len = f->wb.len;
+	if (idx + len > OSDP_FILE_WB_SIZE) {
+		len = OSDP_FILE_WB_SIZE - idx;
+	}
+	if (!partial) {
+		end = f->wb.offset + len;
+		end -= end % OSDP_FILE_WB_PAGE_SIZE;
+		len = (end > f->wb.offset) ? end - f->wb.offset : 0;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	rc = f->ops.write(f->ops.arg, f->wb.buf + idx, (int)len, f->wb.offset);
+	if (rc != (int)len) {
+		LOG_ERR("WB_Flush: user write failed! rc:%d len:%u off:%u",
+			rc, len, f->wb.offset);
+		f->wb.error = true;
+		return -1;
+	}
+	f->wb.error = false;
+	f->wb.offset += len;
+	f->wb.len -= len;
+	return (int)len;
+}
+
+static int file_wb_drain(struct osdp_pd *pd, struct osdp_file *f)
+{
+	while (f->wb.len) {
+		if (file_wb_flush_once(pd, f, true) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int file_wb_stage(struct osdp_pd *pd, struct osdp_file *f,
+			 const uint8_t *data, int len, uint32_t offset)
+{
+	int rc, n;
+	uint32_t idx, end = f->wb.offset + f->wb.len;
+
+	/* a write failed earlier; the staged data has to go out first */
+	if (f->wb.error && file_wb_drain(pd, f)) {
+		return -1;
+	}
+
+	if (len > OSDP_FILE_WB_SIZE) {
+		if (file_wb_drain(pd, f)) {
+			return -1;
+		}
+		f->wb.offset = offset + len;
+		return f->ops.write(f->ops.arg, data, len, offset);
+	}
+
+	/**
+	 * Chunks normally extend the staged run. A retransmit may land inside
+	 * it; anything else (a seek, or a retransmit that would need the
+	 * overlapped bytes flushed first) restarts the run at this chunk.
+	 */
+	if (offset < f->wb.offset || offset > end ||
+	    (offset != end && offset + len - f->wb.offset > OSDP_FILE_WB_SIZE)) {
+		if (file_wb_drain(pd, f)) {
+			return -1;
+		}
+		f->wb.offset = offset;
+		end = offset;
+	}
+
+	/* CP did not honour our FTSTAT delay; make room in the reply path */
+	while (offset + len - f->wb.offset > OSDP_FILE_WB_SIZE) {
+		rc = file_wb_flush_once(pd, f, false);
+		if (rc == 0) {
+			rc = file_wb_flush_once(pd, f, true);
+		}
+		if (rc < 0) {
+			return -1;
+		}
+	}
+
+	for (n = 0; n < len;) {
+		idx = (offset + n) % OSDP_FILE_WB_SIZE;
+		rc = len - n;
+		if (idx + rc > OSDP_FILE_WB_SIZE) {
+			rc = OSDP_FILE_WB_SIZE - idx;
+		}
+		memcpy(f->wb.buf + idx, data + n, rc);
+		n += rc;
+	}
+	if (offset + len > end) {
+		end = offset + len;
+	}
+	f->wb.len = end - f->wb.offset;
+	return len;
+}
+
+/**
+ * Called by the PD outside the command/reply path to write out staged file
+ * data. At most one page aligned batch is written out per call so a slow
+ * ops.write() doesn't hold up the next command for too long.
+ */
+void osdp_file_rx_flush(struct osdp_pd *pd)
+{
+	struct osdp_file *f = TO_FILE(pd);
+
+	if (!file_tx_in_progress(f) || f->wb.len == 0 || f->wb.error) {
+		return;
+	}
+	file_wb_flush_once(pd, f, false);
+}
+
+#endif /* CONFIG_OSDP_FILE_WRITE_BEHIND */
+
+static int file_rx_write(struct osdp_pd *pd, struct osdp_file *f,
+			 const uint8_t *data, int len, uint32_t offset)
+{
+#ifdef CONFIG_OSDP_FILE_WRITE_BEHIND
+	return file_wb_stage(pd, f, data, len, offset);
+#else
+	ARG_UNUSED(pd);
+	return f->ops.write(f->ops.arg, data, len, offset);
+#endif
+}
+
+static int file_rx_drain(struct osdp_pd *pd, struct osdp_file *f)
+{
+#ifdef CONFIG_OSDP_FILE_WRITE_BEHIND
+	return file_wb_drain(pd, f);
+#else
+	ARG_UNUSED(pd);
+	ARG_UNUSED(f);
+	return 0;
+#endif
+}
+
+/**
+ * Ask the CP to back off when the staging area cannot take another chunk of
+ * the size it has been sending us.
+ */
+static uint16_t file_rx_delay(struct osdp_file *f, int chunk_len)
+{
+#ifdef CONFIG_OSDP_FILE_WRITE_BEHIND
+	if (f->wb.len + chunk_len > OSDP_FILE_WB_SIZE) {
+		return OSDP_FILE_WB_DELAY_MS;
+	}
+#else
+	ARG_UNUSED(f);
+	ARG_UNUSED(chunk_len);
+#endif
+	return 0;
+}
+
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+
+/**
+ * Expand a compressed chunk for file offset @offset into f->lz.buf, right
+ * after the file data before it that we have (if any). Returns the size of
+ * the file data in it and points *data at it, or -1 if the chunk is malformed
+ * or refers back to data that we don't have.
+ */
+static int file_rx_lz_decode(struct osdp_file *f, uint8_t **data, int len,
+			     uint32_t offset)
+{
+	int rc;
+	uint32_t dict_len = 0;
+
+	if (offset >= f->lz.offset && offset <= f->lz.offset + f->lz.len) {
+		dict_len = offset - f->lz.offset;
+	} else {
+		f->lz.offset = offset;
+	}
+	/* anything we had past offset is overwritten now */
+	f->lz.len = dict_len;
+
+	rc = osdp_lz_decompress(*data, len, f->lz.buf, (int)dict_len,
+				(int)(sizeof(f->lz.buf) - dict_len));
+	if (rc <= 0) {
+		return -1;
+	}
+	*data = f->lz.buf + dict_len;
+	return rc;
+}
+
+#endif /* CONFIG_OSDP_FILE_COMPRESSION */
+
+/**
+ * Keep the tail of the file data that has been written so far; compressed
+ * chunks may refer back into it.
+ */
+static void file_rx_lz_record(struct osdp_file *f, const uint8_t *data,
+			      int len, uint32_t offset)
+{
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	uint32_t pos;
+
+	if (offset < f->lz.offset || offset > f->lz.offset + f->lz.len) {
+		f->lz.offset = offset;
+		f->lz.len = 0;
+	}
+	pos = offset - f->lz.offset;
+	if (len >= OSDP_FILE_LZ_HISTORY_SIZE) {
+		data += len - OSDP_FILE_LZ_HISTORY_SIZE;
+		f->lz.offset = offset + len - OSDP_FILE_LZ_HISTORY_SIZE;
+		len = OSDP_FILE_LZ_HISTORY_SIZE;
+		pos = 0;
+	}
+	if (data != f->lz.buf + pos) {
+		memmove(f->lz.buf + pos, data, len);
+	}
+	f->lz.len = pos + len;
+
+	if (f->lz.len > OSDP_FILE_LZ_HISTORY_SIZE) {
+		pos = f->lz.len - OSDP_FILE_LZ_HISTORY_SIZE;
+		memmove(f->lz.buf, f->lz.buf + pos, OSDP_FILE_LZ_HISTORY_SIZE);
+		f->lz.offset += pos;
+		f->lz.len = OSDP_FILE_LZ_HISTORY_SIZE;
+	}
+#else
+	ARG_UNUSED(f);
+	ARG_UNUSED(data);
+	ARG_UNUSED(len);
+	ARG_UNUSED(offset);
+#endif
+}
+
 /* --- Receiver CMD/RESP Handler --- */
 
 int osdp_file_cmd_tx_decode(struct osdp_pd *pd, uint8_t *buf, int len)
 {
-	int rc;
+	int rc, length;
 	int pos = 0;
 	struct osdp_file *f = TO_FILE(pd);
 	struct osdp_cmd_file_xfer xfer;
@@ -229,9 +820,19 @@ int osdp_file_cmd_tx_decode(struct osdp_pd *pd, uint8_t *buf, int len)
 			cmd.id = OSDP_CMD_FILE_TX;
 			cmd.file_tx.flags = f->flags;
 			cmd.file_tx.id = xfer.type;
+			cmd.file_tx.offset = xfer.offset;
+			if (xfer.offset) {
+				cmd.file_tx.flags |= OSDP_CMD_FILE_TX_FLAG_RESUME;
+			}
 			rc = pd->command_callback(pd->command_callback_arg, &cmd);
+			if (rc < 0 && xfer.offset) {
+				goto refuse_resume;
+			}
 			if (rc < 0)
 				return -1;
+		} else if (xfer.offset) {
+			/* only the app can tell if it has the data before it */
+			goto refuse_resume;
 		}
 
 		/* new file write request */
@@ -241,10 +842,12 @@ int osdp_file_cmd_tx_decode(struct osdp_pd *pd, uint8_t *buf, int len)
 			return -1;
 		}
 
-		LOG_INF("TX_Decode: Starting file transfer of size: %d", xfer.size);
+		LOG_INF("TX_Decode: Starting file transfer of size: %d "
+			"at offset: %d", xfer.size, xfer.offset);
 		file_state_reset(f);
 		f->file_id = xfer.type;
 		f->size = xfer.size;
+		f->offset = xfer.offset;
 		f->state = OSDP_FILE_INPROG;
 	}
 
@@ -253,14 +856,52 @@ int osdp_file_cmd_tx_decode(struct osdp_pd *pd, uint8_t *buf, int len)
 		return -1;
 	}
 
-	f->length = f->ops.write(f->ops.arg, data, xfer.length, xfer.offset);
-	if (f->length != xfer.length) {
+	length = xfer.length;
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	/* unless the file itself has ID 255 (from a non-LibOSDP CP) */
+	if (xfer.type == OSDP_FILE_TYPE_LZ &&
+	    f->file_id != OSDP_FILE_TYPE_LZ) {
+		length = file_rx_lz_decode(f, &data, xfer.length, xfer.offset);
+		if (length < 0) {
+			/* the CP sends it again in plain */
+			LOG_ERR("TX_Decode: Bad compressed chunk at offset:%d",
+				xfer.offset);
+			f->reject = OSDP_FILE_TX_STATUS_ERR_UNKNOWN;
+			f->length = 0;
+			return 0;
+		}
+	}
+#endif
+
+	/**
+	 * The CP may go back (it missed our last FTSTAT or is resuming from
+	 * an older checkpoint) but must not leave a hole in the file.
+	 */
+	if (xfer.offset > f->offset ||
+	    xfer.offset + length > f->size) {
+		LOG_ERR("TX_Decode: Unexpected offset:%d; have:%d",
+			xfer.offset, f->offset);
+		f->reject = OSDP_FILE_TX_STATUS_ERR_INVALID;
+		f->length = 0;
+		return 0;
+	}
+	f->offset = xfer.offset;
+
+	f->length = file_rx_write(pd, f, data, length, xfer.offset);
+	if (f->length != length) {
 		LOG_ERR("TX_Decode: user write failed! rc:%d len:%d off:%d",
-			f->length, xfer.length, xfer.offset);
+			f->length, length, xfer.offset);
 		f->errors++;
 		return -1;
 	}
+	file_rx_lz_record(f, data, length, xfer.offset);
+
+	return 0;
 
+refuse_resume:
+	LOG_WRN("TX_Decode: Refusing to resume file:%d at offset:%d",
+		xfer.type, xfer.offset);
+	f->reject = OSDP_FILE_TX_STATUS_ERR_ABORT;
 	return 0;
 }
 
@@ -278,19 +919,31 @@ int osdp_file_cmd_stat_build(struct osdp_pd *pd, uint8_t *buf, int max_len)
 		return -1;
 	}
 
-	if (f->state != OSDP_FILE_INPROG) {
-		LOG_ERR("Stat_Build: File transfer is not in progress!");
-		return -1;
-	}
-
 	if ((size_t)max_len < sizeof(struct osdp_cmd_file_stat)) {
 		LOG_ERR("Stat_Build: insufficient space need:%zu have:%d",
 			sizeof(struct osdp_cmd_file_stat), max_len);
 		return -1;
 	}
 
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	stat.control |= OSDP_FILE_STAT_CTRL_LZ;
+#endif
+	stat.rx_size = f->rx_size;
+	if (f->reject) {
+		/* tell the CP to start over from offset 0 */
+		stat.status = f->reject;
+		f->reject = 0;
+		goto out;
+	}
+
+	if (f->state != OSDP_FILE_INPROG) {
+		LOG_ERR("Stat_Build: File transfer is not in progress!");
+		return -1;
+	}
+
 	if (f->length > 0) {
 		f->offset += f->length;
+		stat.delay = file_rx_delay(f, f->length);
 	} else {
 		stat.status = OSDP_FILE_TX_STATUS_ERR_INVALID;
 	}
@@ -298,17 +951,23 @@ int osdp_file_cmd_stat_build(struct osdp_pd *pd, uint8_t *buf, int max_len)
 	f->length = 0;
 	assert(f->offset <= f->size);
 	if (f->offset == f->size) { /* EOF */
+		stat.delay = 0;
+		if (file_rx_drain(pd, f) < 0) {
+			LOG_ERR("Stat_Build: Flushing staged data failed!");
+			return -1;
+		}
 		if (f->ops.close(f->ops.arg) < 0) {
 			LOG_ERR("Stat_Build: Close failed!");
 			return -1;
 		}
 		f->state = OSDP_FILE_DONE;
+		f->rx_size = 0; /* only good for this transfer */
 		stat.status = OSDP_FILE_TX_STATUS_CONTENTS_PROCESSED;
 		LOG_INF("TX_Decode: File receive complete");
 	}
 
+out:
 	/* fill the packet buffer (layout: struct osdp_cmd_file_stat) */
-
 	U8_TO_BYTES_LE(stat.control, buf, len);
 	U16_TO_BYTES_LE(stat.delay, buf, len);
 	U16_TO_BYTES_LE(stat.status, buf, len);
@@ -325,9 +984,33 @@ void osdp_file_tx_abort(struct osdp_pd *pd)
 	struct osdp_file *f = TO_FILE(pd);
 
 	if (file_tx_in_progress(f)) {
+		/* the CP was told these bytes were written; don't drop them */
+		if (file_rx_drain(pd, f) < 0) {
+			LOG_ERR("Abort: Flushing staged data failed! "
+				"File is incomplete");
+		}
 		f->ops.close(f->ops.arg);
 		file_state_reset(f);
+		f->rx_size = 0;
+	}
+}
+
+/**
+ * @brief Size of the packet buffer that a CMD_FILETRANSFER may fill. If the
+ * PD has asked for an alternate maximum message size through osdp_FTSTAT,
+ * that takes precedence over its receive buffer size (but not over ours).
+ */
+int osdp_file_tx_buf_size(struct osdp_pd *pd, int buf_size)
+{
+	struct osdp_file *f = TO_FILE(pd);
+
+	if (f && f->rx_size) {
+		buf_size = f->rx_size;
+		if (buf_size > pd->packet_buf_size) {
+			buf_size = pd->packet_buf_size;
+		}
 	}
+	return buf_size;
 }
 
 /**
@@ -354,6 +1037,7 @@ int osdp_file_tx_get_command(struct osdp_pd *pd)
 
 	if (f->wait_time_ms &&
 	    osdp_millis_since(f->tstamp) < f->wait_time_ms) {
+		osdp_file_tx_prefetch(pd);
 		return ISSET_FLAG(f, OSDP_FILE_TX_FLAG_EXCLUSIVE) ? -1 : 0;
 	}
 
@@ -361,13 +1045,26 @@ int osdp_file_tx_get_command(struct osdp_pd *pd)
 		return CMD_POLL;
 	}
 
+	/**
+	 * During a rollout, unless the PD asked for a dedicated link, slip in
+	 * a POLL now and then so its events are not held back till the
+	 * transfer ends.
+	 */
+	if (ISSET_FLAG(f, OSDP_FILE_TX_FLAG_ROLLOUT) &&
+	    !ISSET_FLAG(f, OSDP_FILE_TX_FLAG_EXCLUSIVE) &&
+	    osdp_millis_since(f->poll_tstamp) > OSDP_FILE_POLL_INTERVAL_MS) {
+		f->poll_tstamp = osdp_millis_now();
+		return CMD_POLL;
+	}
+
 	return CMD_FILETRANSFER;
 }
 
 /**
  * Entry point based on command OSDP_CMD_FILE to kick off a new file transfer.
  */
-int osdp_file_tx_command(struct osdp_pd *pd, int file_id, uint32_t flags)
+int osdp_file_tx_command(struct osdp_pd *pd, int file_id, uint32_t flags,
+			 uint32_t offset)
 {
 	int size = 0;
 	struct osdp_file *f = TO_FILE(pd);
@@ -395,6 +1092,14 @@ int osdp_file_tx_command(struct osdp_pd *pd, int file_id, uint32_t flags)
 		return -1;
 	}
 
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	if (file_id == OSDP_FILE_TYPE_LZ) {
+		LOG_ERR("TX_init: File ID %d is reserved for compression",
+			file_id);
+		return -1;
+	}
+#endif
+
 	if (f->ops.open(f->ops.arg, file_id, &size) < 0) {
 		LOG_ERR("TX_init: Open failed! fd:%d", file_id);
 		return -1;
@@ -405,16 +1110,181 @@ int osdp_file_tx_command(struct osdp_pd *pd, int file_id, uint32_t flags)
 		return -1;
 	}
 
-	LOG_INF("TX_init: Starting file transfer of size: %d", size);
+	if (!(flags & OSDP_CMD_FILE_TX_FLAG_RESUME)) {
+		offset = 0;
+	} else if (offset >= (uint32_t)size) {
+		LOG_WRN("TX_init: Can't resume at offset:%u of %d; "
+			"starting over", offset, size);
+		offset = 0;
+	}
+
+	LOG_INF("TX_init: Starting file transfer of size: %d at offset: %u",
+		size, offset);
 
 	file_state_reset(f);
-	f->flags = flags;
+	f->flags = flags & ~OSDP_CMD_FILE_TX_FLAG_RESUME;
+	if (offset) {
+		SET_FLAG(f, OSDP_FILE_TX_FLAG_RESUMED);
+	}
+	f->offset = offset;
+	f->checkpoint = offset;
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	f->lz.hist = offset;
+#endif
+	f->rx_size = 0;
+	f->poll_tstamp = osdp_millis_now();
 	f->file_id = file_id;
 	f->size = size;
 	f->state = OSDP_FILE_INPROG;
 	return 0;
 }
 
+/* --- Rollout --- */
+
+static int file_rollout_channel_load(struct osdp *ctx, struct osdp_pd *pd)
+{
+	int i, count = 0;
+	struct osdp_file_rollout *r = ctx->rollout;
+
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		if (r->pd[i].state == OSDP_FILE_ROLLOUT_ACTIVE &&
+		    osdp_to_pd(ctx, i)->channel.id == pd->channel.id) {
+			count++;
+		}
+	}
+	return count;
+}
+
+static void file_rollout_finish(struct osdp_file_rollout *r,
+				struct osdp_file_rollout_pd *p,
+				enum file_rollout_state_e state)
+{
+	p->state = state;
+	if (--r->remaining == 0) {
+		r->end_ms = osdp_millis_now();
+	}
+}
+
+static void file_rollout_failed(struct osdp_pd *pd,
+				struct osdp_file_rollout *r,
+				struct osdp_file_rollout_pd *p)
+{
+	r->retries++;
+	if (++p->retries > OSDP_FILE_ROLLOUT_RETRY_MAX) {
+		LOG_ERR("Rollout: giving up after %d attempts", p->retries);
+		file_rollout_finish(r, p, OSDP_FILE_ROLLOUT_FAILED);
+		return;
+	}
+	LOG_WRN("Rollout: transfer failed; retry %d/%d", p->retries,
+		OSDP_FILE_ROLLOUT_RETRY_MAX);
+	p->state = OSDP_FILE_ROLLOUT_PENDING;
+	p->tstamp = osdp_millis_now() + OSDP_CMD_RETRY_WAIT_MS;
+}
+
+static void file_rollout_start_one(struct osdp_pd *pd,
+				   struct osdp_file_rollout *r,
+				   struct osdp_file_rollout_pd *p)
+{
+	struct osdp_file *f = TO_FILE(pd);
+
+	if (!f) {
+		f = calloc(1, sizeof(struct osdp_file));
+		if (f == NULL) {
+			LOG_ERR("Rollout: Failed to alloc struct osdp_file");
+			file_rollout_finish(r, p, OSDP_FILE_ROLLOUT_FAILED);
+			return;
+		}
+		pd->file = f;
+	}
+	memcpy(&f->ops, &r->ops, sizeof(struct osdp_file_ops));
+
+	if (osdp_file_tx_command(pd, r->file_id, 0, 0)) {
+		file_rollout_failed(pd, r, p);
+		return;
+	}
+	SET_FLAG(f, OSDP_FILE_TX_FLAG_ROLLOUT);
+	p->state = OSDP_FILE_ROLLOUT_ACTIVE;
+	p->offset = 0;
+}
+
+/**
+ * Called from osdp_cp_refresh() to move PDs of an ongoing rollout along. Only
+ * starting, reaping and retrying the transfers happen here; the transfers
+ * are interleaved with everything else by the CP state machine, so shared
+ * channels are time sliced between PDs and FTSTAT delay and control flags
+ * are honoured per PD as they would be for a single transfer.
+ */
+void osdp_file_rollout_refresh(struct osdp *ctx)
+{
+	int i;
+	struct osdp_pd *pd;
+	struct osdp_file_rollout_pd *p;
+	struct osdp_file_rollout *r = ctx->rollout;
+
+	if (r == NULL || r->remaining == 0) {
+		return;
+	}
+
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		p = &r->pd[i];
+		pd = osdp_to_pd(ctx, i);
+
+		switch (p->state) {
+		case OSDP_FILE_ROLLOUT_PENDING:
+			if (pd->state != OSDP_CP_STATE_ONLINE ||
+			    file_tx_in_progress(TO_FILE(pd)) ||
+			    osdp_millis_now() < p->tstamp ||
+			    file_rollout_channel_load(ctx, pd) >=
+				    OSDP_FILE_ROLLOUT_CHANNEL_MAX) {
+				break;
+			}
+			file_rollout_start_one(pd, r, p);
+			break;
+		case OSDP_FILE_ROLLOUT_ACTIVE:
+			if (pd->state != OSDP_CP_STATE_ONLINE) {
+				/**
+				 * Keep the transfer around; the CP picks it up
+				 * from the last acked offset once the PD is
+				 * back. Only give up after too many outages
+				 * with no progress in between. The PD passing
+				 * through the other states on its way back
+				 * (or re-keying the SC) is not an outage.
+				 */
+				if (p->offline ||
+				    (pd->state != OSDP_CP_STATE_OFFLINE &&
+				     pd->state != OSDP_CP_STATE_INIT)) {
+					break;
+				}
+				LOG_WRN("Rollout: PD went offline mid-transfer");
+				p->offline = true;
+				r->retries++;
+				if (TO_FILE(pd)->offset > p->offset) {
+					p->offset = TO_FILE(pd)->offset;
+					p->retries = 0;
+				}
+				if (++p->retries > OSDP_FILE_ROLLOUT_RETRY_MAX) {
+					LOG_ERR("Rollout: giving up after %d "
+						"outages", p->retries);
+					osdp_file_tx_abort(pd);
+					file_rollout_finish(r, p,
+						OSDP_FILE_ROLLOUT_FAILED);
+				}
+				break;
+			}
+			p->offline = false;
+			if (TO_FILE(pd)->state == OSDP_FILE_DONE) {
+				r->bytes_done += TO_FILE(pd)->size;
+				file_rollout_finish(r, p, OSDP_FILE_ROLLOUT_DONE);
+			} else if (TO_FILE(pd)->state == OSDP_FILE_IDLE) {
+				file_rollout_failed(pd, r, p);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
 /* --- Exported Methods --- */
 
 int osdp_file_register_ops(osdp_t *ctx, int pd_idx,
@@ -436,6 +1306,27 @@ int osdp_file_register_ops(osdp_t *ctx, int pd_idx,
 	return 0;
 }
 
+int osdp_file_set_rx_size(osdp_t *ctx, int pd_idx, int rx_size)
+{
+	input_check(ctx, pd_idx);
+	struct osdp_pd *pd = osdp_to_pd(ctx, pd_idx);
+
+	if (!is_pd_mode(pd) || pd->file == NULL) {
+		LOG_PRINT("File ops not registered on a PD");
+		return -1;
+	}
+
+	if (rx_size && (rx_size < OSDP_PACKET_BUF_SIZE_MIN ||
+			rx_size > pd->packet_buf_size)) {
+		LOG_PRINT("Invalid rx_size %d; must be in [%d, %d]", rx_size,
+			  OSDP_PACKET_BUF_SIZE_MIN, pd->packet_buf_size);
+		return -1;
+	}
+
+	pd->file->rx_size = rx_size;
+	return 0;
+}
+
 int osdp_get_file_tx_status(const osdp_t *ctx, int pd_idx,
 			    int *size, int *offset)
 {
@@ -450,4 +1341,239 @@ int osdp_get_file_tx_status(const osdp_t *ctx, int pd_idx,
 	*size = f->size;
 	*offset = f->offset;
 	return 0;
-}
\ No newline at end of file
+}
+
+int osdp_file_rollout_start(osdp_t *ctx, const uint8_t *pd_mask, int file_id,
+			    const struct osdp_file_ops *ops)
+{
+	input_check(ctx);
+	int i;
+	struct osdp_file_rollout *r = TO_OSDP(ctx)->rollout;
+
+	if (is_pd_mode(osdp_to_pd(ctx, 0))) {
+		LOG_PRINT("Rollout: only a CP can roll out files");
+		return -1;
+	}
+
+	if (r && r->remaining) {
+		LOG_PRINT("Rollout: another rollout is in progress");
+		return -1;
+	}
+
+	if (r == NULL) {
+		r = calloc(1, sizeof(struct osdp_file_rollout) +
+			      sizeof(struct osdp_file_rollout_pd) * NUM_PD(ctx));
+		if (r == NULL) {
+			LOG_PRINT("Failed to alloc struct osdp_file_rollout");
+			return -1;
+		}
+		TO_OSDP(ctx)->rollout = r;
+	}
+
+	memset(r, 0, sizeof(struct osdp_file_rollout) +
+		     sizeof(struct osdp_file_rollout_pd) * NUM_PD(ctx));
+	memcpy(&r->ops, ops, sizeof(struct osdp_file_ops));
+	r->file_id = file_id;
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		if (pd_mask[i / 8] & (1 << (i % 8))) {
+			r->pd[i].state = OSDP_FILE_ROLLOUT_PENDING;
+			r->num_pd++;
+		}
+	}
+	r->remaining = r->num_pd;
+	r->start_ms = osdp_millis_now();
+	r->end_ms = r->start_ms;
+	return 0;
+}
+
+int osdp_file_rollout_status(const osdp_t *ctx,
+			     struct osdp_file_rollout_status *status,
+			     uint8_t *failed_mask)
+{
+	input_check(ctx);
+	int i;
+	int64_t bytes;
+	struct osdp_pd *pd;
+	struct osdp_file_rollout *r = TO_OSDP(ctx)->rollout;
+
+	if (r == NULL) {
+		return -1;
+	}
+
+	memset(status, 0, sizeof(struct osdp_file_rollout_status));
+	if (failed_mask) {
+		memset(failed_mask, 0, (NUM_PD(ctx) + 7) / 8);
+	}
+	bytes = r->bytes_done;
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		pd = osdp_to_pd(ctx, i);
+		switch (r->pd[i].state) {
+		case OSDP_FILE_ROLLOUT_PENDING:
+			status->pending++;
+			break;
+		case OSDP_FILE_ROLLOUT_ACTIVE:
+			status->active++;
+			bytes += TO_FILE(pd)->offset;
+			break;
+		case OSDP_FILE_ROLLOUT_DONE:
+			status->done++;
+			break;
+		case OSDP_FILE_ROLLOUT_FAILED:
+			status->failed++;
+			if (failed_mask) {
+				failed_mask[i / 8] |= 1 << (i % 8);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	status->num_pd = r->num_pd;
+	status->retries = r->retries;
+	status->bytes = bytes;
+	status->elapsed_ms = (r->remaining ? osdp_millis_now() : r->end_ms) -
+			     r->start_ms;
+	if (status->elapsed_ms > 0) {
+		status->throughput = bytes * 1000 / status->elapsed_ms;
+	}
+	return r->remaining ? 1 : 0;
+}
+
+int osdp_file_rollout_cancel(osdp_t *ctx)
+{
+	input_check(ctx);
+	int i;
+	struct osdp_pd *pd;
+	struct osdp_file_rollout *r = TO_OSDP(ctx)->rollout;
+
+	if (r == NULL || r->remaining == 0) {
+		return -1;
+	}
+
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		pd = osdp_to_pd(ctx, i);
+		if (r->pd[i].state == OSDP_FILE_ROLLOUT_ACTIVE) {
+			/* CP state machine sends the abort */
+			TO_FILE(pd)->cancel_req = true;
+		}
+		if (r->pd[i].state == OSDP_FILE_ROLLOUT_ACTIVE ||
+		    r->pd[i].state == OSDP_FILE_ROLLOUT_PENDING) {
+			file_rollout_finish(r, &r->pd[i],
+					    OSDP_FILE_ROLLOUT_FAILED);
+		}
+	}
+	return 0;
+}
+
+void osdp_file_set_checkpoint_callback(osdp_t *ctx,
+				       osdp_file_checkpoint_callback_t cb,
+				       void *arg)
+{
+	input_check(ctx);
+
+	TO_OSDP(ctx)->file_checkpoint_callback = cb;
+	TO_OSDP(ctx)->file_checkpoint_callback_arg = arg;
+}
+
+/* --- Built-in memory backed file ops --- */
+
+static int file_mem_open(void *arg, int file_id, int *size)
+{
+	struct osdp_file_mem *mem = arg;
+
+	if (mem->data == NULL ||
+	    (mem->file_id >= 0 && mem->file_id != file_id)) {
+		return -1;
+	}
+	*size = mem->size;
+	return 0;
+}
+
+static int file_mem_read(void *arg, void *buf, int size, int offset)
+{
+	struct osdp_file_mem *mem = arg;
+
+	if (offset < 0 || offset > mem->size) {
+		return -1;
+	}
+	if (size > mem->size - offset) {
+		size = mem->size - offset;
+	}
+	memcpy(buf, mem->data + offset, size);
+	return size;
+}
+
+static int file_mem_write(void *arg, const void *buf, int size, int offset)
+{
+	ARG_UNUSED(arg);
+	ARG_UNUSED(buf);
+	ARG_UNUSED(size);
+	ARG_UNUSED(offset);
+	return -1;
+}
+
+static int file_mem_close(void *arg)
+{
+	ARG_UNUSED(arg);
+	return 0;
+}
+
+void osdp_file_mem_ops(struct osdp_file_ops *ops, struct osdp_file_mem *mem)
+{
+	ops->arg = mem;
+	ops->open = file_mem_open;
+	ops->read = file_mem_read;
+	ops->write = file_mem_write;
+	ops->close = file_mem_close;
+}
+
+int osdp_file_mem_map(struct osdp_file_mem *mem, const char *path,
+		      int file_id)
+{
+#ifdef FILE_MEM_HAS_MMAP
+	int fd;
+	void *data;
+	struct stat st;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		LOG_PRINT("Failed to open %s", path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > INT32_MAX) {
+		LOG_PRINT("Can't serve %s; bad size", path);
+		close(fd);
+		return -1;
+	}
+	data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		LOG_PRINT("Failed to mmap %s", path);
+		return -1;
+	}
+	/* chunks are read front to back */
+	madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	mem->data = data;
+	mem->size = (int)st.st_size;
+	mem->file_id = file_id;
+	mem->priv = data;
+	return 0;
+#else
+	ARG_UNUSED(mem);
+	ARG_UNUSED(path);
+	ARG_UNUSED(file_id);
+	LOG_PRINT("osdp_file_mem_map is not supported on this platform");
+	return -1;
+#endif
+}
+
+void osdp_file_mem_unmap(struct osdp_file_mem *mem)
+{
+#ifdef FILE_MEM_HAS_MMAP
+	if (mem->priv) {
+		munmap(mem->priv, (size_t)mem->size);
+	}
+#endif
+	memset(mem, 0, sizeof(struct osdp_file_mem));
+}
@@ -16,6 +16,13 @@
 #define OSDP_FILE_TX_STATE_ERROR       -1
 #define OSDP_FILE_TX_STATE_WAIT        -2
 
+/**
+ * Private file transfer type used between two LibOSDP peers: the data section
+ * is an osdp_lz block that expands to the file contents at the offset in the
+ * header. Only sent to PDs that set bit-3 of their osdp_FTSTAT control flags.
+ */
+#define OSDP_FILE_TYPE_LZ               0xFF
+
 /**
  * @brief OSDP specified command: File Transfer:
  *
@@ -44,6 +51,7 @@ PACK(struct osdp_cmd_file_xfer {
  *        - bit-1: 1 = shall leave secure channel for file transfer; 0 = stay in
  *                 secure channel if SC is active
  *        - bit-2: 1 = separate poll response is available; 0=no other activity
+ *        - bit-3: (LibOSDP private) PD accepts OSDP_FILE_TYPE_LZ chunks
  * @param delay Request CP for a time delay in milliseconds before next
  *        CMD_FILETRANSFER message
  * @param status File transfer status. This is a signed little- endian number
@@ -72,6 +80,45 @@ enum file_tx_state_e {
 	OSDP_FILE_KEEP_ALIVE,
 };
 
+/**
+ * @brief Write-behind staging area for the receiving (PD) side. Holds the
+ * contiguous run of file data [offset, offset + len) that has been ACKed to
+ * the CP but not yet handed to ops.write(). Byte at file offset X lives at
+ * buf[X % OSDP_FILE_WB_SIZE] so pages in the file map to pages in buf.
+ */
+struct osdp_file_wb {
+	uint8_t buf[OSDP_FILE_WB_SIZE];
+	uint32_t offset;
+	uint32_t len;
+	bool error;
+};
+
+/**
+ * @brief Read-ahead buffer for the sending (CP) side. Holds the file data
+ * [offset, offset + len) starting at the chunk that is due next. Byte at file
+ * offset X lives at buf[X % OSDP_FILE_RA_SIZE].
+ */
+struct osdp_file_ra {
+	uint8_t buf[OSDP_FILE_RA_SIZE];
+	uint32_t offset;
+	uint32_t len;
+	bool error;
+};
+
+/**
+ * @brief Uncompressed file data around the chunk in flight, for
+ * OSDP_FILE_TYPE_LZ chunks. buf holds the file data [offset, offset + len):
+ * on the PD, the tail of what it has written so far (the dictionary the next
+ * chunk is decompressed against); on the CP, that same tail as far as the PD
+ * is known to have it, followed by the data to compress.
+ */
+struct osdp_file_lz {
+	uint8_t buf[OSDP_FILE_LZ_HISTORY_SIZE + OSDP_FILE_LZ_BLOCK_SIZE];
+	uint32_t offset;
+	uint32_t len;
+	uint32_t hist; /* CP: the PD has the file data [hist, file offset) */
+};
+
 struct osdp_file {
 	uint32_t flags;
 	int file_id;
@@ -79,19 +126,86 @@ struct osdp_file {
 	int length;
 	uint32_t size;
 	uint32_t offset;
+	uint32_t checkpoint; /* CP: offset last reported to the app */
+	int16_t reject; /* PD: FTSTAT status to refuse the last FILETRANSFER */
 	int errors;
 	bool cancel_req;
 	int64_t tstamp;
+	int64_t poll_tstamp;
 	uint32_t wait_time_ms;
+	uint16_t rx_size; /* FTSTAT alternate message size (asked/advertised) */
 	struct osdp_file_ops ops;
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	struct osdp_file_lz lz;
+#endif
+#ifdef CONFIG_OSDP_FILE_WRITE_BEHIND
+	struct osdp_file_wb wb;
+#endif
+#ifdef CONFIG_OSDP_FILE_READ_AHEAD
+	struct osdp_file_ra ra;
+#endif
+};
+
+enum file_rollout_state_e {
+	OSDP_FILE_ROLLOUT_SKIP,
+	OSDP_FILE_ROLLOUT_PENDING,
+	OSDP_FILE_ROLLOUT_ACTIVE,
+	OSDP_FILE_ROLLOUT_DONE,
+	OSDP_FILE_ROLLOUT_FAILED,
+};
+
+struct osdp_file_rollout_pd {
+	enum file_rollout_state_e state;
+	int retries;
+	bool offline; /* retry already counted for this offline period */
+	uint32_t offset; /* acked offset at the last outage */
+	int64_t tstamp; /* don't (re)start the transfer before this */
+};
+
+/**
+ * @brief State of a CP side rollout of one file to a set of PDs; see
+ * osdp_file_rollout_start(). The per-PD transfers themselves are regular
+ * transfers driven by the CP state machine.
+ */
+struct osdp_file_rollout {
+	int file_id;
+	struct osdp_file_ops ops;
+	int num_pd;
+	int remaining;
+	int retries;
+	int64_t bytes_done;
+	int64_t start_ms;
+	int64_t end_ms;
+	struct osdp_file_rollout_pd pd[];
 };
 
 int osdp_file_cmd_tx_build(struct osdp_pd *pd, uint8_t *buf, int max_len);
 int osdp_file_cmd_tx_decode(struct osdp_pd *pd, uint8_t *buf, int len);
 int osdp_file_cmd_stat_decode(struct osdp_pd *pd, uint8_t *buf, int len);
 int osdp_file_cmd_stat_build(struct osdp_pd *pd, uint8_t *buf, int max_len);
-int osdp_file_tx_command(struct osdp_pd *pd, int file_id, uint32_t flags);
+int osdp_file_tx_command(struct osdp_pd *pd, int file_id, uint32_t flags,
+			 uint32_t offset);
 int osdp_file_tx_get_command(struct osdp_pd *pd);
+int osdp_file_tx_buf_size(struct osdp_pd *pd, int buf_size);
 void osdp_file_tx_abort(struct osdp_pd *pd);
+void osdp_file_rollout_refresh(struct osdp *ctx);
+
+#ifdef CONFIG_OSDP_FILE_WRITE_BEHIND
+void osdp_file_rx_flush(struct osdp_pd *pd);
+#else
+static inline void osdp_file_rx_flush(struct osdp_pd *pd)
+{
+	ARG_UNUSED(pd);
+}
+#endif
+
+#ifdef CONFIG_OSDP_FILE_READ_AHEAD
+void osdp_file_tx_prefetch(struct osdp_pd *pd);
+#else
+static inline void osdp_file_tx_prefetch(struct osdp_pd *pd)
+{
+	ARG_UNUSED(pd);
+}
+#endif
 
 #endif /* _OSDP_FILE_H_ */
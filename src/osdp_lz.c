@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2024 Siddharth Chandrasekaran <sidcha.dev@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * A small LZ77 block codec in the style of LZ4, used to compress file
+ * transfers between two LibOSDP peers. A block is a series of sequences:
+ *
+ *   token | [literal length] | literals | offset | [match length]
+ *
+ * The high nibble of the token is the literal count and the low nibble is
+ * the match length minus LZ_MIN_MATCH; a nibble of 15 is followed by bytes
+ * that add to it (255 means another byte follows). The offset is two bytes,
+ * little endian, counting back from the current output position. The last
+ * sequence of a block may end right after its literals.
+ *
+ * A match may reach back past the start of the block into a dictionary: data
+ * that the decoder already has just before where the block's output goes (for
+ * file transfers, the tail of the file sent so far). The decoder rejects
+ * matches that reach further back than the dictionary it was given, so both
+ * ends need not agree on its size up front. The encoder packs as much input
+ * as fits into a given output size, so a block always fills one message
+ * without spilling into the next.
+ */
+
+#include <string.h>
+
+#include "osdp_lz.h"
+
+#define LZ_MIN_MATCH    4
+#define LZ_HASH_BITS    10
+#define LZ_INPUT_MAX    65535
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline int lz_hash(uint32_t v)
+{
+	return (int)((v * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+/* Extra bytes needed to code a length of n in a token nibble */
+static inline int lz_len_size(int n)
+{
+	return n < 15 ? 0 : (n - 15) / 255 + 1;
+}
+
+static uint8_t *lz_put_len(uint8_t *op, int n)
+{
+	n -= 15;
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = (uint8_t)n;
+	return op;
+}
+
+static uint8_t *lz_put_seq(uint8_t *op, const uint8_t *lit, int lit_len,
+			   int offset, int match_len)
+{
+	uint8_t *token = op++;
+
+	*token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+	if (lit_len >= 15) {
+		op = lz_put_len(op, lit_len);
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len == 0) {
+		return op;
+	}
+	*op++ = (uint8_t)(offset & 0xff);
+	*op++ = (uint8_t)(offset >> 8);
+	match_len -= LZ_MIN_MATCH;
+	*token |= (uint8_t)(match_len < 15 ? match_len : 15);
+	if (match_len >= 15) {
+		op = lz_put_len(op, match_len);
+	}
+	return op;
+}
+
+int osdp_lz_compress(const uint8_t *src, int dict_len, int *src_len,
+		     uint8_t *dst, int dst_len)
+{
+	uint16_t table[1 << LZ_HASH_BITS];
+	const uint8_t *ip = src + dict_len, *anchor = ip, *ref;
+	const uint8_t *iend = ip + *src_len;
+	uint8_t *op = dst, *oend = dst + dst_len;
+	int i, h, lit_len, match_len, room;
+
+	if (dict_len < 0 || *src_len < 0 || dst_len < 0 ||
+	    dict_len + *src_len > LZ_INPUT_MAX) {
+		return -1;
+	}
+
+	/* empty slots point at src[0]; matches are verified anyway */
+	memset(table, 0, sizeof(table));
+	for (i = 0; i < dict_len && iend - (src + i) >= LZ_MIN_MATCH; i++) {
+		table[lz_hash(lz_read32(src + i))] = (uint16_t)i;
+	}
+
+	while (iend - ip >= LZ_MIN_MATCH) {
+		h = lz_hash(lz_read32(ip));
+		ref = src + table[h];
+		table[h] = (uint16_t)(ip - src);
+		if (ref >= ip || lz_read32(ref) != lz_read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		match_len = LZ_MIN_MATCH;
+		while (ip + match_len < iend && ref[match_len] == ip[match_len]) {
+			match_len++;
+		}
+
+		lit_len = (int)(ip - anchor);
+		if (1 + lz_len_size(lit_len) + lit_len + 2 +
+		    lz_len_size(match_len - LZ_MIN_MATCH) > oend - op) {
+			break;
+		}
+		op = lz_put_seq(op, anchor, lit_len, (int)(ip - ref), match_len);
+		ip += match_len;
+		anchor = ip;
+	}
+
+	/* close the block with as many of the remaining literals as fit */
+	room = (int)(oend - op);
+	lit_len = (int)(iend - anchor);
+	if (lit_len > room - 1) {
+		lit_len = room - 1;
+	}
+	while (lit_len > 0 && 1 + lz_len_size(lit_len) + lit_len > room) {
+		lit_len--;
+	}
+	if (lit_len > 0) {
+		op = lz_put_seq(op, anchor, lit_len, 0, 0);
+		anchor += lit_len;
+	}
+
+	*src_len = (int)(anchor - (src + dict_len));
+	return (int)(op - dst);
+}
+
+static int lz_get_len(const uint8_t **ip, const uint8_t *iend, int n,
+		      int max)
+{
+	uint8_t b;
+
+	if (n != 15) {
+		return n;
+	}
+	do {
+		if (*ip >= iend) {
+			return -1;
+		}
+		b = *(*ip)++;
+		n += b;
+		if (n > max) {
+			return -1;
+		}
+	} while (b == 255);
+	return n;
+}
+
+int osdp_lz_decompress(const uint8_t *src, int src_len, uint8_t *dst,
+		       int dict_len, int dst_len)
+{
+	uint8_t token;
+	int len, offset;
+	const uint8_t *ip = src, *iend = src + src_len, *ref;
+	uint8_t *op = dst + dict_len, *oend = op + dst_len;
+
+	if (src_len < 0 || dict_len < 0 || dst_len < 0) {
+		return -1;
+	}
+
+	while (ip < iend) {
+		token = *ip++;
+
+		len = lz_get_len(&ip, iend, token >> 4, dst_len);
+		if (len < 0 || len > iend - ip || len > oend - op) {
+			return -1;
+		}
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op - dst) {
+			return -1;
+		}
+
+		len = lz_get_len(&ip, iend, token & 0x0f, dst_len);
+		if (len < 0) {
+			return -1;
+		}
+		len += LZ_MIN_MATCH;
+		if (len > oend - op) {
+			return -1;
+		}
+		/* may overlap with its own output; copy byte by byte */
+		ref = op - offset;
+		while (len--) {
+			*op++ = *ref++;
+		}
+	}
+
+	return (int)(op - (dst + dict_len));
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2024 Siddharth Chandrasekaran <sidcha.dev@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _OSDP_LZ_H_
+#define _OSDP_LZ_H_
+
+#include <stdint.h>
+
+/**
+ * @brief Compress as much of the input as fits in dst as one block.
+ *
+ * @param src Dictionary (dict_len bytes) followed by the data to compress
+ * @param dict_len Size of the dictionary; may be 0
+ * @param src_len In: bytes of input after the dictionary (dictionary and
+ *        input together must not exceed 65535 bytes). Out: bytes of input
+ *        that the block holds.
+ * @param dst Output buffer
+ * @param dst_len Size of dst
+ *
+ * @retval Size of the compressed block
+ * @retval -1 on errors.
+ */
+int osdp_lz_compress(const uint8_t *src, int dict_len, int *src_len,
+		     uint8_t *dst, int dst_len);
+
+/**
+ * @brief Decompress a block made by osdp_lz_compress().
+ *
+ * @param src Compressed block
+ * @param src_len Size of the compressed block
+ * @param dst Dictionary (dict_len bytes) followed by space for the output
+ * @param dict_len Size of the dictionary; may be 0
+ * @param dst_len Space for the output after the dictionary
+ *
+ * @retval Number of bytes written to dst after the dictionary
+ * @retval -1 if the block is malformed, refers to data before the
+ *         dictionary, or does not fit in dst.
+ */
+int osdp_lz_decompress(const uint8_t *src, int src_len, uint8_t *dst,
+		       int dict_len, int dst_len);
+
+#endif /* _OSDP_LZ_H_ */
@@ -40,6 +40,7 @@
 #define REPLY_RSTATR_LEN               2
 #define REPLY_COM_LEN                  6
 #define REPLY_NAK_LEN                  2
+#define REPLY_BUSY_LEN                 1
 #define REPLY_CCRYPT_LEN               33
 #define REPLY_RMAC_I_LEN               17
 #define REPLY_KEYPAD_LEN               2
@@ -68,11 +69,6 @@ static struct osdp_pd_cap osdp_pd_cap[] = {
 		1, /* (Bit-0) AES128 support */
 		0, /* N/A */
 	},
-	{
-		OSDP_PD_CAP_RECEIVE_BUFFERSIZE,
-		BYTE_0(OSDP_PACKET_BUF_SIZE),
-		BYTE_1(OSDP_PACKET_BUF_SIZE),
-	},
 	{ -1, 0, 0 } /* Sentinel */
 };
 
@@ -90,6 +86,7 @@ static int pd_event_queue_init(struct osdp_pd *pd)
 		return -1;
 	}
 	queue_init(&pd->event_queue);
+	pd->event_policy = OSDP_PD_EVENT_OVERFLOW_DROP_STATUS;
 	return 0;
 }
 
@@ -120,7 +117,7 @@ static void pd_event_enqueue(struct osdp_pd *pd, struct osdp_event *event)
 	queue_enqueue(&pd->event_queue, &n->node);
 }
 
-static int pd_event_dequeue(struct osdp_pd *pd, struct osdp_event **event)
+static int pd_event_dequeue_head(struct osdp_pd *pd, struct osdp_event **event)
 {
 	struct pd_event_node *n;
 	queue_node_t *node;
@@ -133,6 +130,108 @@ static int pd_event_dequeue(struct osdp_pd *pd, struct osdp_event **event)
 	return 0;
 }
 
+/*
+ * The event queue can never hold more than what the slab can allocate, so it
+ * is cheap enough to pull all of it out, work on it as an array and put back
+ * whatever is left in the same order.
+ */
+#define PD_EVENT_QUEUE_MAX \
+	(OSDP_APP_DATA_QUEUE_SIZE / sizeof(struct pd_event_node))
+
+static int pd_event_queue_take(struct osdp_pd *pd, struct osdp_event **events)
+{
+	int count = 0;
+
+	while (count < (int)PD_EVENT_QUEUE_MAX &&
+	       pd_event_dequeue_head(pd, &events[count]) == 0) {
+		count++;
+	}
+	return count;
+}
+
+static void pd_event_queue_put(struct osdp_pd *pd, struct osdp_event **events,
+			       int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (events[i] != NULL) {
+			pd_event_enqueue(pd, events[i]);
+		}
+	}
+}
+
+/*
+ * Status reports are snapshots; only the latest one of each report type is
+ * worth sending to the CP. Everything else (card reads, keypresses, MFGREP)
+ * is delivered strictly in the order it was notified.
+ */
+static inline bool pd_event_is_snapshot(const struct osdp_event *event)
+{
+	return event->type == OSDP_EVENT_STATUS;
+}
+
+static int pd_event_dequeue(struct osdp_pd *pd, struct osdp_event **event)
+{
+	int i, count, pick = 0;
+	struct osdp_event *events[PD_EVENT_QUEUE_MAX];
+
+	count = pd_event_queue_take(pd, events);
+	if (count == 0) {
+		return -1;
+	}
+
+	/* don't make card reads and keypresses wait behind status snapshots */
+	for (i = 0; i < count; i++) {
+		if (!pd_event_is_snapshot(events[i])) {
+			pick = i;
+			break;
+		}
+	}
+	*event = events[pick];
+	events[pick] = NULL;
+	pd_event_queue_put(pd, events, count);
+	return 0;
+}
+
+/* Queued status snapshot of the same report type as event, if any */
+static struct osdp_event *pd_event_find_snapshot(struct osdp_pd *pd,
+						 const struct osdp_event *event)
+{
+	struct pd_event_node *n;
+	queue_node_t *node;
+
+	if (queue_peek_first(&pd->event_queue, &node)) {
+		return NULL;
+	}
+	for (; node != NULL; node = node->next) {
+		n = CONTAINER_OF(node, struct pd_event_node, node);
+		if (pd_event_is_snapshot(&n->object) &&
+		    n->object.status.type == event->status.type) {
+			return &n->object;
+		}
+	}
+	return NULL;
+}
+
+static int pd_event_evict(struct osdp_pd *pd, struct osdp_event **events,
+			  int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (pd->event_policy == OSDP_PD_EVENT_OVERFLOW_DROP_OLDEST ||
+		    pd_event_is_snapshot(events[i])) {
+			LOG_WRN("Event queue full; dropping queued event type: %d",
+				events[i]->type);
+			pd_event_free(pd, events[i]);
+			events[i] = NULL;
+			return 0;
+		}
+	}
+	return -1;
+}
+
 static int pd_translate_event(struct osdp_pd *pd, struct osdp_event *event)
 {
 	int reply_code = 0;
@@ -183,11 +282,61 @@ static int pd_translate_event(struct osdp_pd *pd, struct osdp_event *event)
 	return reply_code;
 }
 
+/**
+ * A CP retries a command that was answered with osdp_BUSY with the same
+ * sequence number. Anything else means the CP has moved on and the deferred
+ * command (if any) must be dropped.
+ */
+static void pd_deferred_cmd_check(struct osdp_pd *pd)
+{
+	struct osdp_pd_deferred_cmd *d = &pd->deferred_cmd;
+
+	d->calls = 0;
+	d->busy = false;
+	if (d->state == OSDP_PD_DEFERRED_IDLE) {
+		return;
+	}
+	if (d->cmd_id != pd->cmd_id || d->seq_number != pd->seq_number) {
+		LOG_WRN("Deferred CMD: %s(%02x) abandoned by CP",
+			osdp_cmd_name(d->cmd_id), d->cmd_id);
+		d->state = OSDP_PD_DEFERRED_IDLE;
+	}
+}
+
 static bool do_command_callback(struct osdp_pd *pd, struct osdp_cmd *cmd)
 {
 	int ret;
+	struct osdp_pd_deferred_cmd *d = &pd->deferred_cmd;
+	int call = d->calls++;
+
+	if (d->state != OSDP_PD_DEFERRED_IDLE) {
+		/* CP is retrying a command that we deferred earlier */
+		if (call < d->call) {
+			return true; /* was already ACK-ed by the app */
+		}
+		if (call == d->call) {
+			if (d->state == OSDP_PD_DEFERRED_PENDING) {
+				d->busy = true;
+				return false;
+			}
+			memcpy(cmd, &d->cmd, sizeof(struct osdp_cmd));
+			ret = d->result;
+			d->state = OSDP_PD_DEFERRED_IDLE;
+			goto out;
+		}
+	}
 
 	ret = pd->command_callback(pd->command_callback_arg, cmd);
+	if (ret == OSDP_PD_CMD_DEFERRED) {
+		d->state = OSDP_PD_DEFERRED_PENDING;
+		d->cmd_id = pd->cmd_id;
+		d->seq_number = pd->seq_number;
+		d->call = call;
+		memcpy(&d->cmd, cmd, sizeof(struct osdp_cmd));
+		d->busy = true;
+		return false;
+	}
+out:
 	if (ret != 0) {
 		pd->reply_id = REPLY_NAK;
 		pd->ephemeral_data[0] = OSDP_PD_NAK_RECORD;
@@ -261,12 +410,14 @@ static int pd_cmd_cap_ok(struct osdp_pd *pd, struct osdp_cmd *cmd)
 static int pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 {
 	int i, ret = OSDP_PD_ERR_GENERIC, pos = 0;
+	uint16_t rx_size;
 	struct osdp_cmd cmd;
 	struct osdp_event *event;
 
 	pd->reply_id = 0;
 	pd->cmd_id = cmd.id = buf[pos++];
 	len--;
+	pd_deferred_cmd_check(pd);
 
 	if (is_enforce_secure(pd) && !sc_is_active(pd)) {
 		/**
@@ -550,7 +701,12 @@ static int pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 		if (len < CMD_ACURXSIZE_DATA_LEN) {
 			break;
 		}
-		pd->peer_rx_size = buf[pos] | (buf[pos + 1] << 8);
+		rx_size = buf[pos] | (buf[pos + 1] << 8);
+		if (rx_size < OSDP_PACKET_BUF_SIZE_MIN) {
+			LOG_ERR("ACURXSIZE %u is too small", rx_size);
+			break;
+		}
+		pd->peer_rx_size = rx_size;
 		pd->reply_id = REPLY_ACK;
 		ret = OSDP_PD_ERR_NONE;
 		break;
@@ -558,7 +714,9 @@ static int pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 		if (len < CMD_KEEPACTIVE_DATA_LEN) {
 			break;
 		}
-		pd->sc_tstamp += buf[pos] | (buf[pos + 1] << 8);
+		/* the SC may idle this long past its usual timeout */
+		pd->sc_tstamp = osdp_millis_now() +
+				(buf[pos] | (buf[pos + 1] << 8));
 		pd->reply_id = REPLY_ACK;
 		ret = OSDP_PD_ERR_NONE;
 		break;
@@ -624,6 +782,7 @@ static int pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 			break;
 		}
 		sc_deactivate(pd);
+		CLEAR_FLAG(pd, PD_FLAG_SC_CHLNG);
 		memcpy(pd->sc.cp_random, buf + pos, 8);
 		pd->reply_id = REPLY_CCRYPT;
 		ret = OSDP_PD_ERR_NONE;
@@ -642,6 +801,14 @@ static int pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 			LOG_EM("Out of order CMD_SCRYPT; has CP gone rogue?");
 			break;
 		}
+		/* session keys exist only after a CHLNG of this session */
+		if (!ISSET_FLAG(pd, PD_FLAG_SC_CHLNG) || pd->sc.ctx_enc == NULL) {
+			pd->reply_id = REPLY_NAK;
+			pd->ephemeral_data[0] = OSDP_PD_NAK_SC_COND;
+			LOG_ERR("CMD_SCRYPT without a preceding CMD_CHLNG");
+			break;
+		}
+		CLEAR_FLAG(pd, PD_FLAG_SC_CHLNG);
 		memcpy(pd->sc.cp_cryptogram, buf + pos, CMD_SCRYPT_DATA_LEN);
 		pd->reply_id = REPLY_RMAC_I;
 		ret = OSDP_PD_ERR_NONE;
@@ -653,6 +820,12 @@ static int pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 		return OSDP_PD_ERR_REPLY;
 	}
 
+	if (pd->deferred_cmd.busy) {
+		/* app deferred the command; CP will retry after a while */
+		pd->reply_id = REPLY_BUSY;
+		ret = OSDP_PD_ERR_NONE;
+	}
+
 	if (ret == OSDP_PD_ERR_GENERIC) {
 		LOG_ERR("Failed to decode command: CMD(%02x) Len:%d ret:%d",
 			pd->cmd_id, len, ret);
@@ -841,6 +1014,11 @@ static int pd_build_reply(struct osdp_pd *pd, uint8_t *buf, int max_len)
 			pd->address, pd->baud_rate);
 		ret = OSDP_PD_ERR_NONE;
 		break;
+	case REPLY_BUSY:
+		assert_buf_len(REPLY_BUSY_LEN, max_len);
+		buf[len++] = pd->reply_id;
+		ret = OSDP_PD_ERR_NONE;
+		break;
 	case REPLY_NAK:
 		assert_buf_len(REPLY_NAK_LEN, max_len);
 		buf[len++] = pd->reply_id;
@@ -873,9 +1051,12 @@ static int pd_build_reply(struct osdp_pd *pd, uint8_t *buf, int max_len)
 			break;
 		}
 		assert_buf_len(REPLY_CCRYPT_LEN, max_len);
-		osdp_fill_random(pd->sc.pd_random, 8);
-		osdp_compute_session_keys(pd);
-		osdp_compute_pd_cryptogram(pd);
+		osdp_sc_random(pd, pd->sc.pd_random, 8);
+		if (osdp_compute_session_keys(pd) ||
+		    osdp_compute_pd_cryptogram(pd)) {
+			break;
+		}
+		SET_FLAG(pd, PD_FLAG_SC_CHLNG);
 		buf[len++] = pd->reply_id;
 		memcpy(buf + len, pd->sc.pd_client_uid, 8);
 		memcpy(buf + len + 8, pd->sc.pd_random, 8);
@@ -891,7 +1072,9 @@ static int pd_build_reply(struct osdp_pd *pd, uint8_t *buf, int max_len)
 			break;
 		}
 		assert_buf_len(REPLY_RMAC_I_LEN, max_len);
-		osdp_compute_rmac_i(pd);
+		if (osdp_compute_rmac_i(pd)) {
+			break;
+		}
 		buf[len++] = pd->reply_id;
 		memcpy(buf + len, pd->sc.r_mac, 16);
 		len += 16;
@@ -936,21 +1119,29 @@ static int pd_send_reply(struct osdp_pd *pd)
 {
 	int ret, packet_buf_size = get_tx_buf_size(pd);
 
+	if (pd->reply_id == REPLY_ACK &&
+	    !ISSET_FLAG(pd, PD_FLAG_PKT_BROADCAST) && !is_capture_enabled(pd)) {
+		if (osdp_phy_send_ack(pd) < 0) {
+			return OSDP_PD_ERR_GENERIC;
+		}
+		return OSDP_PD_ERR_NONE;
+	}
+
 	/* init packet buf with header */
-	ret = osdp_phy_packet_init(pd, pd->packet_buf, packet_buf_size);
+	ret = osdp_phy_packet_init(pd, pd->rx->packet_buf, packet_buf_size);
 	if (ret < 0) {
 		return OSDP_PD_ERR_GENERIC;
 	}
-	pd->packet_buf_len = ret;
+	pd->rx->packet_buf_len = ret;
 
 	/* fill reply data */
-	ret = pd_build_reply(pd, pd->packet_buf, packet_buf_size);
+	ret = pd_build_reply(pd, pd->rx->packet_buf, packet_buf_size);
 	if (ret <= 0) {
 		return OSDP_PD_ERR_GENERIC;
 	}
-	pd->packet_buf_len += ret;
+	pd->rx->packet_buf_len += ret;
 
-	ret = osdp_phy_send_packet(pd, pd->packet_buf, pd->packet_buf_len,
+	ret = osdp_phy_send_packet(pd, pd->rx->packet_buf, pd->rx->packet_buf_len,
 				   packet_buf_size);
 	if (ret < 0) {
 		return OSDP_PD_ERR_GENERIC;
@@ -1019,6 +1210,8 @@ static void osdp_pd_update(struct osdp_pd *pd)
 	ret = pd_receive_and_process_command(pd);
 
 	if (ret == OSDP_PD_ERR_IGNORE || ret == OSDP_PD_ERR_NO_DATA) {
+		/* line is idle; write out any staged file data */
+		osdp_file_rx_flush(pd);
 		return;
 	}
 
@@ -1033,7 +1226,8 @@ static void osdp_pd_update(struct osdp_pd *pd)
 		return;
 	}
 
-	if (ret == OSDP_PD_ERR_NONE && sc_is_active(pd)) {
+	if (ret == OSDP_PD_ERR_NONE && sc_is_active(pd) &&
+	    pd->cmd_id != CMD_KEEPACTIVE) {
 		pd->sc_tstamp = osdp_millis_now();
 	}
 
@@ -1055,6 +1249,9 @@ static void osdp_pd_update(struct osdp_pd *pd)
 		LOG_EM("REPLY send failed! CP may be waiting..");
 	}
 	osdp_phy_state_reset(pd, false);
+
+	/* the CP needs a while to turn the next command around; use it */
+	osdp_file_rx_flush(pd);
 }
 
 static void osdp_pd_set_attributes(struct osdp_pd *pd,
@@ -1072,6 +1269,13 @@ static void osdp_pd_set_attributes(struct osdp_pd *pd,
 		pd->cap[fc].num_items = cap->num_items;
 		cap++;
 	}
+
+	/* Always report what we actually allocated in osdp_phy_rx_init() */
+	fc = OSDP_PD_CAP_RECEIVE_BUFFERSIZE;
+	pd->cap[fc].function_code = fc;
+	pd->cap[fc].compliance_level = BYTE_0(pd->packet_buf_size);
+	pd->cap[fc].num_items = BYTE_1(pd->packet_buf_size);
+
 	if (id != NULL) {
 		memcpy(&pd->id, id, sizeof(struct osdp_pd_id));
 	}
@@ -1108,6 +1312,8 @@ osdp_t *osdp_pd_setup(const osdp_pd_info_t *info)
 #endif
 
 	input_check_init(ctx);
+	osdp_crypt_setup();
+	osdp_sc_rand_init();
 	ctx->_num_pd = 1;
 
 	SET_CURRENT_PD(ctx, 0);
@@ -1148,6 +1354,11 @@ osdp_t *osdp_pd_setup(const osdp_pd_info_t *info)
 	if (IS_ENABLED(CONFIG_OSDP_SKIP_MARK_BYTE)) {
 		SET_FLAG(pd, PD_FLAG_PKT_SKIP_MARK);
 	}
+	if (osdp_phy_packet_buf_init(pd, info->cap) ||
+	    osdp_phy_rx_init(pd, pd->packet_buf_size) ||
+	    osdp_phy_ack_cache_init(pd)) {
+		goto error;
+	}
 	osdp_pd_set_attributes(pd, info->cap, &info->id);
 	osdp_pd_set_attributes(pd, osdp_pd_cap, NULL);
 
@@ -1175,6 +1386,12 @@ void osdp_pd_teardown(osdp_t *ctx)
 		osdp_packet_capture_finish(pd);
 	}
 
+	osdp_file_tx_abort(pd);
+	osdp_sc_teardown(pd);
+	osdp_crypt_teardown();
+	osdp_phy_rx_free(pd);
+	osdp_phy_ack_cache_free(pd);
+
 #ifndef CONFIG_OSDP_STATIC_PD
 	safe_free(pd->file);
 	safe_free(pd);
@@ -1190,6 +1407,44 @@ void osdp_pd_refresh(osdp_t *ctx)
 	osdp_pd_update(pd);
 }
 
+int osdp_pd_feed(osdp_t *ctx, const uint8_t *buf, int len)
+{
+	input_check(ctx);
+	int n, space, avail, consumed = 0;
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	struct osdp_rb *rb = &pd->rx->rb;
+
+	if (buf == NULL || len < 0) {
+		return -1;
+	}
+
+	for (;;) {
+		space = (int)sizeof(rb->buffer) - 1 - osdp_rb_len(rb);
+		n = len - consumed;
+		if (n > space) {
+			n = space;
+		}
+		if (n > 0) {
+			/* see the pull mode counterpart in osdp_phy_check_packet */
+			if (pd->rx->packet_buf_len == 0 && osdp_rb_len(rb) == 0) {
+				pd->tstamp = osdp_millis_now();
+			}
+			consumed += osdp_rb_push_buf(rb, (uint8_t *)buf + consumed, n);
+		}
+		avail = osdp_rb_len(rb);
+		if (avail == 0) {
+			break;
+		}
+		/* decode, process and reply to as many commands as we have */
+		osdp_pd_update(pd);
+		if (osdp_rb_len(rb) == avail) {
+			break;
+		}
+	}
+
+	return consumed;
+}
+
 void osdp_pd_set_capabilities(osdp_t *ctx, const struct osdp_pd_cap *cap)
 {
 	input_check(ctx);
@@ -1208,13 +1463,61 @@ void osdp_pd_set_command_callback(osdp_t *ctx, pd_command_callback_t cb,
 	pd->command_callback = cb;
 }
 
+int osdp_pd_complete_command(osdp_t *ctx, const struct osdp_cmd *cmd,
+			     int result)
+{
+	input_check(ctx);
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	struct osdp_pd_deferred_cmd *d = &pd->deferred_cmd;
+
+	if (d->state != OSDP_PD_DEFERRED_PENDING) {
+		LOG_ERR("No deferred command to complete");
+		return -1;
+	}
+	if (result == OSDP_PD_CMD_DEFERRED) {
+		LOG_ERR("Deferred command cannot be deferred again");
+		return -1;
+	}
+	if (cmd) {
+		if (cmd->id != d->cmd.id) {
+			LOG_ERR("Command mismatch; deferred: %d completed: %d",
+				d->cmd.id, cmd->id);
+			return -1;
+		}
+		memcpy(&d->cmd, cmd, sizeof(struct osdp_cmd));
+	}
+	d->result = result;
+	d->state = OSDP_PD_DEFERRED_DONE;
+	return 0;
+}
+
 int osdp_pd_notify_event(osdp_t *ctx, const struct osdp_event *event)
 {
 	input_check(ctx);
-	struct osdp_event *ev;
+	int count;
+	struct osdp_event *ev = NULL;
+	struct osdp_event *events[PD_EVENT_QUEUE_MAX];
 	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
 
+	if (pd_event_is_snapshot(event)) {
+		ev = pd_event_find_snapshot(pd, event);
+		if (ev != NULL) {
+			/* merge into the queued snapshot, in place */
+			memcpy(ev, event, sizeof(struct osdp_event));
+			return 0;
+		}
+	}
+
 	ev = pd_event_alloc(pd);
+	if (ev == NULL &&
+	    pd->event_policy != OSDP_PD_EVENT_OVERFLOW_REJECT) {
+		/* queue is full; only then is it worth taking apart */
+		count = pd_event_queue_take(pd, events);
+		if (pd_event_evict(pd, events, count) == 0) {
+			ev = pd_event_alloc(pd);
+		}
+		pd_event_queue_put(pd, events, count);
+	}
 	if (ev == NULL) {
 		return -1;
 	}
@@ -1224,6 +1527,21 @@ int osdp_pd_notify_event(osdp_t *ctx, const struct osdp_event *event)
 	return 0;
 }
 
+int osdp_pd_set_event_overflow_policy(osdp_t *ctx,
+				      enum osdp_pd_event_overflow_policy policy)
+{
+	input_check(ctx);
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+
+	if (policy < OSDP_PD_EVENT_OVERFLOW_REJECT ||
+	    policy > OSDP_PD_EVENT_OVERFLOW_DROP_OLDEST) {
+		LOG_ERR("Invalid event overflow policy: %d", policy);
+		return -1;
+	}
+	pd->event_policy = policy;
+	return 0;
+}
+
 int osdp_pd_flush_events(osdp_t *ctx)
 {
 	input_check(ctx);
@@ -1238,3 +1556,16 @@ int osdp_pd_flush_events(osdp_t *ctx)
 
 	return count;
 }
+
+#ifdef UNIT_TESTING
+
+/**
+ * Force export some private methods for testing.
+ */
+int (*test_pd_decode_command)(struct osdp_pd *, uint8_t *,
+			      int) = pd_decode_command;
+int (*test_pd_send_reply)(struct osdp_pd *) = pd_send_reply;
+int (*test_pd_build_reply)(struct osdp_pd *, uint8_t *,
+			  int) = pd_build_reply;
+
+#endif /* UNIT_TESTING */
@@ -28,14 +28,42 @@ static inline bool packet_has_mark(struct osdp_pd *pd)
 	return ISSET_FLAG(pd, PD_FLAG_PKT_HAS_MARK);
 }
 
-static int osdp_channel_send(struct osdp_pd *pd, uint8_t *buf, int len)
+static void osdp_channel_flush_rx(struct osdp_pd *pd, int discarded)
 {
-	int sent, total_sent = 0;
+	struct osdp_rx *rx = pd->rx;
+
+	/**
+	 * Bytes that were already pulled into rx->rb (and rx->packet_buf, as
+	 * passed by the caller) are lost along with whatever the channel is
+	 * holding. We can only account for the former as the channel flush
+	 * method doesn't report anything back.
+	 */
+	discarded += osdp_rb_clear(&rx->rb);
+	rx->discard_bytes += discarded;
+	rx->flush_count += 1;
+	if (discarded) {
+		LOG_DBG("RX flush discarded %d bytes (total: %u/%u flushes)",
+			discarded, rx->discard_bytes, rx->flush_count);
+	}
 
-	/* flush rx to remove any invalid data. */
 	if (pd->channel.flush) {
 		pd->channel.flush(pd->channel.data);
 	}
+}
+
+static int osdp_channel_send(struct osdp_pd *pd, uint8_t *buf, int len)
+{
+	int sent, total_sent = 0;
+
+	/**
+	 * Flushing RX on every send costs a syscall (or more) per packet and
+	 * isn't required for correctness since stray bytes are dropped by the
+	 * packet scanner anyway. Keep it only for channels that ask for it.
+	 */
+	if (ISSET_FLAG(pd, OSDP_FLAG_FLUSH_RX_ON_SEND)) {
+		/* packet_buf holds what we are about to send; not RX data */
+		osdp_channel_flush_rx(pd, 0);
+	}
 
 	do { /* send can block; so be greedy */
 		sent = pd->channel.send(pd->channel.data,
@@ -52,29 +80,40 @@ static int osdp_channel_send(struct osdp_pd *pd, uint8_t *buf, int len)
 static int osdp_channel_receive(struct osdp_pd *pd)
 {
 	uint8_t buf[64];
-	int recv, total_recv = 0;
+	int recv, space, total_recv = 0;
+	struct osdp_rb *rb = &pd->rx->rb;
 
-#ifdef UNIT_TESTING
 	/**
-	 * Some unit tests don't define pd->channel.recv and directly fill
-	 * pd->packet_buf to test if everything else work correctly.
+	 * PDs driven by osdp_pd_feed() (and some unit tests) don't define
+	 * pd->channel.recv; the bytes are pushed directly into pd->rx->rb.
 	 */
 	if (!pd->channel.recv) {
 		return 0;
 	}
-#endif
 
 	do {
-		recv = pd->channel.recv(pd->channel.data, buf, sizeof(buf));
+		/**
+		 * With negotiated packet sizes, a single frame can be larger
+		 * than rx_rb; leave the rest in the channel until the parser
+		 * has made room for it.
+		 */
+		space = (int)sizeof(rb->buffer) - 1 - osdp_rb_len(rb);
+		if (space <= 0) {
+			break;
+		}
+		if (space > (int)sizeof(buf)) {
+			space = sizeof(buf);
+		}
+		recv = pd->channel.recv(pd->channel.data, buf, space);
 		if (recv <= 0) {
 			break;
 		}
-		if (osdp_rb_push_buf(&pd->rx_rb, buf, recv) != recv) {
+		if (osdp_rb_push_buf(rb, buf, recv) != recv) {
 			LOG_EM("RX ring buffer overflow!");
 			return -1;
 		}
 		total_recv += recv;
-	} while (recv == sizeof(buf));
+	} while (recv == space);
 
 	return total_recv;
 }
@@ -178,7 +217,10 @@ int osdp_phy_packet_init(struct osdp_pd *pd, uint8_t *buf, int max_len)
 	pkt->control = osdp_phy_get_seq_number(pd, is_cp_mode(pd));
 	pkt->control |= PKT_CONTROL_CRC;
 
-	if (sc_is_active(pd)) {
+	if (is_pd_mode(pd) && id == REPLY_BUSY) {
+		/* BUSY goes out unsecured with a sequence number of 0 */
+		pkt->control &= ~PKT_CONTROL_SQN;
+	} else if (sc_is_active(pd)) {
 		pkt->control |= PKT_CONTROL_SCB;
 		pkt->data[0] = scb_len = 2;
 		pkt->data[1] = SCS_15;
@@ -198,7 +240,7 @@ static int osdp_phy_packet_finalize(struct osdp_pd *pd, uint8_t *buf,
 	uint16_t crc16;
 	struct osdp_packet_header *pkt;
 	uint8_t *data;
-	int data_len;
+	int ret, data_len;
 
 	/* Do a sanity check only; we expect header to be pre-filled */
 	if ((unsigned long)len <= sizeof(struct osdp_packet_header)) {
@@ -270,7 +312,11 @@ static int osdp_phy_packet_finalize(struct osdp_pd *pd, uint8_t *buf,
 				/* data_len + 1 for OSDP_SC_EOM_MARKER */
 				goto out_of_space_error;
 			}
-			len += osdp_encrypt_data(pd, is_cp_mode(pd), data, data_len);
+			ret = osdp_encrypt_data(pd, is_cp_mode(pd), data, data_len);
+			if (ret < 0) {
+				goto crypto_error;
+			}
+			len += ret;
 		}
 		/* len: with 4bytes MAC; with 2 byte CRC; without 1 byte mark */
 		if (len + 4 > max_len) {
@@ -282,7 +328,9 @@ static int osdp_phy_packet_finalize(struct osdp_pd *pd, uint8_t *buf,
 		pkt->len_msb = BYTE_1(len + 2 + 4);
 
 		/* compute and extend the buf with 4 MAC bytes */
-		osdp_compute_mac(pd, is_cp_mode(pd), buf, len);
+		if (osdp_compute_mac(pd, is_cp_mode(pd), buf, len)) {
+			goto crypto_error;
+		}
 		data = is_cp_mode(pd) ? pd->sc.c_mac : pd->sc.r_mac;
 		memcpy(buf + len, data, 4);
 		len += 4;
@@ -302,6 +350,9 @@ static int osdp_phy_packet_finalize(struct osdp_pd *pd, uint8_t *buf,
 out_of_space_error:
 	LOG_ERR("PKT_F: Out of buffer space! CMD(%02x)", pd->cmd_id);
 	return OSDP_ERR_PKT_FMT;
+crypto_error:
+	LOG_ERR("PKT_F: SC crypto failed! CMD(%02x)", pd->cmd_id);
+	return OSDP_ERR_PKT_FMT;
 }
 
 int osdp_phy_send_packet(struct osdp_pd *pd, uint8_t *buf,
@@ -329,43 +380,124 @@ int osdp_phy_send_packet(struct osdp_pd *pd, uint8_t *buf,
 	return OSDP_ERR_PKT_NONE;
 }
 
+/*
+ * Returns a osdp_ACK frame for the current sequence number; building it only
+ * when the cache doesn't have one yet (or when our address has changed).
+ */
+static uint8_t *phy_ack_frame_get(struct osdp_pd *pd, int sc, int *len)
+{
+	uint16_t crc16;
+	uint8_t address = (pd->address & 0x7F) | 0x80;
+	int seq = osdp_phy_get_seq_number(pd, false);
+	uint8_t *frame = pd->ack_cache->frame[sc][seq];
+	struct osdp_packet_header *pkt = (struct osdp_packet_header *)frame;
+
+	/* header + ID byte; and in SC mode, SCB too */
+	*len = sizeof(struct osdp_packet_header) + (sc ? 2 : 0) + 1;
+
+	if ((pd->ack_cache->valid[sc] & BIT(seq)) && pkt->pd_address == address) {
+		return frame;
+	}
+
+	pkt->som = OSDP_PKT_SOM;
+	pkt->pd_address = address;
+	pkt->control = seq | PKT_CONTROL_CRC;
+	if (sc) {
+		pkt->control |= PKT_CONTROL_SCB;
+		pkt->data[0] = 2;
+		pkt->data[1] = SCS_16;
+	}
+	frame[*len - 1] = REPLY_ACK;
+	pkt->len_lsb = BYTE_0(*len + (sc ? 4 : 0) + 2);
+	pkt->len_msb = BYTE_1(*len + (sc ? 4 : 0) + 2);
+	if (!sc) {
+		crc16 = osdp_compute_crc16(frame, *len);
+		frame[*len + 0] = BYTE_0(crc16);
+		frame[*len + 1] = BYTE_1(crc16);
+	}
+	pd->ack_cache->valid[sc] |= BIT(seq);
+	return frame;
+}
+
+/**
+ * Fast path for the most frequent reply from a PD -- the osdp_ACK to a POLL.
+ * This is byte-for-byte what osdp_phy_packet_init() + osdp_phy_send_packet()
+ * would have produced, minus the work. Callers must not use this for replies
+ * to broadcast commands or when packet capture is enabled.
+ */
+int osdp_phy_send_ack(struct osdp_pd *pd)
+{
+	uint16_t crc16;
+	uint8_t *buf = pd->rx->packet_buf, *frame;
+	int ret, len, sc = sc_is_active(pd) ? 1 : 0, mark = packet_has_mark(pd);
+
+	frame = phy_ack_frame_get(pd, sc, &len);
+	if (mark) {
+		buf[0] = OSDP_PKT_MARK;
+	}
+	buf += mark;
+	memcpy(buf, frame, len + (sc ? 0 : 2));
+
+	if (sc) {
+		if (osdp_compute_mac(pd, 0, buf, len)) {
+			return OSDP_ERR_PKT_BUILD;
+		}
+		memcpy(buf + len, pd->sc.r_mac, 4);
+		len += 4;
+		crc16 = osdp_compute_crc16(buf, len);
+		buf[len + 0] = BYTE_0(crc16);
+		buf[len + 1] = BYTE_1(crc16);
+	}
+	len += 2 + mark;
+
+	ret = osdp_channel_send(pd, pd->rx->packet_buf, len);
+	if (ret != len) {
+		LOG_ERR("Channel send for %d bytes failed! ret: %d",
+			len, ret);
+		return OSDP_ERR_PKT_BUILD;
+	}
+
+	return OSDP_ERR_PKT_NONE;
+}
+
 static int phy_check_header(struct osdp_pd *pd)
 {
 	int pkt_len, len, target_len;
 	struct osdp_packet_header *pkt;
 	uint8_t cur_byte = 0, prev_byte = 0;
-	uint8_t *buf = pd->packet_buf;
+	struct osdp_rx *rx = pd->rx;
+	uint8_t *buf = rx->packet_buf;
 
 	/* Scan for packet start */
-	while (pd->packet_buf_len == 0) {
-		if (osdp_rb_pop(&pd->rx_rb, &cur_byte)) {
+	while (rx->packet_buf_len == 0) {
+		if (osdp_rb_pop(&rx->rb, &cur_byte)) {
 			return OSDP_ERR_PKT_NO_DATA;
 		}
 		if (cur_byte == OSDP_PKT_SOM) {
 			if (prev_byte == OSDP_PKT_MARK) {
 				buf[0] = OSDP_PKT_MARK;
 				buf[1] = OSDP_PKT_SOM;
-				pd->packet_buf_len = 2;
+				rx->packet_buf_len = 2;
 				SET_FLAG(pd, PD_FLAG_PKT_HAS_MARK);
 			} else {
 				buf[0] = OSDP_PKT_SOM;
-				pd->packet_buf_len = 1;
+				rx->packet_buf_len = 1;
 				CLEAR_FLAG(pd, PD_FLAG_PKT_HAS_MARK);
 			}
 			break;
 		}
 		if (cur_byte != OSDP_PKT_MARK) {
-			pd->packet_scan_skip++;
+			rx->packet_scan_skip++;
 		}
 		prev_byte = cur_byte;
 	}
 
 	/* Found start of a new packet; wait until we have atleast the header */
 	target_len = sizeof(struct osdp_packet_header);
-	len = osdp_rb_pop_buf(&pd->rx_rb, buf + pd->packet_buf_len,
-			      target_len - pd->packet_buf_len);
-	pd->packet_buf_len += len;
-	if (pd->packet_buf_len < target_len) {
+	len = osdp_rb_pop_buf(&rx->rb, buf + rx->packet_buf_len,
+			      target_len - rx->packet_buf_len);
+	rx->packet_buf_len += len;
+	if (rx->packet_buf_len < target_len) {
 		return OSDP_ERR_PKT_WAIT;
 	}
 
@@ -386,7 +518,7 @@ static int phy_check_header(struct osdp_pd *pd)
 	/* validate packet length */
 	pkt_len = (pkt->len_msb << 8) | pkt->len_lsb;
 
-	if (pkt_len > OSDP_PACKET_BUF_SIZE ||
+	if (pkt_len + packet_has_mark(pd) > pd->packet_buf_size ||
 	    (unsigned long)pkt_len < sizeof(struct osdp_packet_header) + 1) {
 		return OSDP_ERR_PKT_FMT;
 	}
@@ -394,6 +526,40 @@ static int phy_check_header(struct osdp_pd *pd)
 	return pkt_len + packet_has_mark(pd);
 }
 
+/**
+ * On a shared channel, the reply from a PD whose command had already timed
+ * out can arrive while some other PD holds the channel. Such a frame is valid
+ * on the wire; it just isn't ours. Attribute it to the PD it was addressed to
+ * (so it shows up in the right log stream) and drop it instead of tearing
+ * down the current PD's transaction.
+ */
+static void phy_drop_late_reply(struct osdp_pd *pd)
+{
+	pd->rx_late_replies += 1;
+	pd->rx->discard_bytes += pd->rx->packet_len;
+	LOG_WRN("Dropped late reply (%u so far)", pd->rx_late_replies);
+}
+
+static bool phy_route_stray_reply(struct osdp_pd *pd, int pd_addr)
+{
+	int i;
+	struct osdp *ctx = pd_to_osdp(pd);
+	struct osdp_pd *peer;
+
+	if (!ISSET_FLAG(pd, PD_FLAG_CHN_SHARED)) {
+		return false;
+	}
+
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		peer = osdp_to_pd(ctx, i);
+		if (peer->rx == pd->rx && peer->address == pd_addr) {
+			phy_drop_late_reply(peer);
+			return true;
+		}
+	}
+	return false;
+}
+
 static int phy_check_packet(struct osdp_pd *pd, uint8_t *buf, int pkt_len)
 {
 	int pd_addr;
@@ -430,6 +596,9 @@ static int phy_check_packet(struct osdp_pd *pd, uint8_t *buf, int pkt_len)
 	if (pd_addr != pd->address && pd_addr != 0x7F) {
 		/* not addressed to us and was not broadcasted */
 		if (is_cp_mode(pd)) {
+			if (phy_route_stray_reply(pd, pd_addr)) {
+				return OSDP_ERR_PKT_SKIP;
+			}
 			LOG_ERR("Invalid pd address %d", pd_addr);
 			return OSDP_ERR_PKT_CHECK;
 		}
@@ -499,6 +668,7 @@ static int phy_check_packet(struct osdp_pd *pd, uint8_t *buf, int pkt_len)
 int osdp_phy_check_packet(struct osdp_pd *pd)
 {
 	int ret = OSDP_ERR_PKT_FMT;
+	struct osdp_rx *rx = pd->rx;
 
 	ret = osdp_channel_receive(pd); /* always pull new bytes first */
 
@@ -507,42 +677,49 @@ int osdp_phy_check_packet(struct osdp_pd *pd)
 	 * from CP, we need to capture the timestamp so we can timeout and
 	 * clear the buffer on errors and stray RX data.
 	 */
-	if (is_pd_mode(pd) && pd->packet_buf_len == 0 && ret > 0) {
+	if (is_pd_mode(pd) && rx->packet_buf_len == 0 && ret > 0) {
 		pd->tstamp = osdp_millis_now();
 	}
 
-	if (pd->packet_len == 0) {
+	if (rx->packet_len == 0) {
 		ret = phy_check_header(pd);
 		if (ret < 0) {
 			return ret;
 		}
-		pd->packet_len = ret;
-		if (pd->packet_scan_skip) {
+		rx->packet_len = ret;
+		if (rx->packet_scan_skip) {
 			LOG_DBG("Packet scan skipped:%u mark:%d",
-				pd->packet_scan_skip,
+				rx->packet_scan_skip,
 				ISSET_FLAG(pd, PD_FLAG_PKT_HAS_MARK));
-			pd->packet_scan_skip = 0;
+			rx->packet_scan_skip = 0;
 		}
 	}
 
 	/* We have a valid header, collect one full packet */
-	ret = osdp_rb_pop_buf(&pd->rx_rb, pd->packet_buf + pd->packet_buf_len,
-				pd->packet_len - pd->packet_buf_len);
-	pd->packet_buf_len += ret;
-	if (pd->packet_buf_len != pd->packet_len)
+	ret = osdp_rb_pop_buf(&rx->rb, rx->packet_buf + rx->packet_buf_len,
+			      rx->packet_len - rx->packet_buf_len);
+	rx->packet_buf_len += ret;
+	if (rx->packet_buf_len != rx->packet_len)
 		return OSDP_ERR_PKT_WAIT;
 
 	if (is_packet_trace_enabled(pd)) {
-		osdp_capture_packet(pd, pd->packet_buf, pd->packet_buf_len);
+		osdp_capture_packet(pd, rx->packet_buf, rx->packet_buf_len);
 	}
 
-	return phy_check_packet(pd, pd->packet_buf, pd->packet_len);
+	ret = phy_check_packet(pd, rx->packet_buf, rx->packet_len);
+	if (ret == OSDP_ERR_PKT_SKIP && is_cp_mode(pd)) {
+		/* Stray frame for another PD; keep waiting for ours */
+		rx->packet_buf_len = 0;
+		rx->packet_len = 0;
+		return OSDP_ERR_PKT_WAIT;
+	}
+	return ret;
 }
 
 int osdp_phy_decode_packet(struct osdp_pd *pd, uint8_t **pkt_start)
 {
-	uint8_t *data, *mac, *buf = pd->packet_buf;
-	int mac_offset, is_cmd, len = pd->packet_buf_len;
+	uint8_t *data, *mac, *buf = pd->rx->packet_buf;
+	int mac_offset, is_cmd, len = pd->rx->packet_buf_len;
 	struct osdp_packet_header *pkt;
 	bool is_sc_active = sc_is_active(pd);
 
@@ -627,9 +804,9 @@ int osdp_phy_decode_packet(struct osdp_pd *pd, uint8_t **pkt_start)
 	    pkt->control & PKT_CONTROL_SCB && pkt->data[1] >= SCS_15) {
 		/* validate MAC */
 		is_cmd = is_pd_mode(pd);
-		osdp_compute_mac(pd, is_cmd, buf, mac_offset);
 		mac = is_cmd ? pd->sc.c_mac : pd->sc.r_mac;
-		if (memcmp(buf + mac_offset, mac, 4) != 0) {
+		if (osdp_compute_mac(pd, is_cmd, buf, mac_offset) ||
+		    memcmp(buf + mac_offset, mac, 4) != 0) {
 			LOG_ERR("Invalid MAC; discarding SC");
 			sc_deactivate(pd);
 			pd->reply_id = REPLY_NAK;
@@ -711,16 +888,118 @@ int osdp_phy_decode_packet(struct osdp_pd *pd, uint8_t **pkt_start)
 
 void osdp_phy_state_reset(struct osdp_pd *pd, bool is_error)
 {
-	pd->packet_buf_len = 0;
-	pd->packet_len = 0;
-	pd->phy_state = 0;
 	if (is_error) {
+		osdp_channel_flush_rx(pd, pd->rx->packet_buf_len);
 		pd->phy_retry_count = 0;
 		pd->seq_number = -1;
-		if (pd->channel.flush) {
-			pd->channel.flush(pd->channel.data);
+	}
+	pd->rx->packet_buf_len = 0;
+	pd->rx->packet_len = 0;
+	pd->phy_state = 0;
+}
+
+int osdp_phy_packet_buf_init(struct osdp_pd *pd, const struct osdp_pd_cap *cap)
+{
+	int size = OSDP_PACKET_BUF_SIZE;
+
+	while (cap && cap->function_code > 0 &&
+	       cap->function_code < OSDP_PD_CAP_SENTINEL) {
+		if (cap->function_code == OSDP_PD_CAP_RECEIVE_BUFFERSIZE) {
+			size = cap->compliance_level | (cap->num_items << 8);
+			break;
 		}
+		cap++;
 	}
+
+	if (size < OSDP_PACKET_BUF_SIZE_MIN ||
+	    size > OSDP_PACKET_BUF_SIZE_MAX) {
+		LOG_ERR("Invalid packet buffer size %d; must be in [%d, %d]",
+			size, OSDP_PACKET_BUF_SIZE_MIN,
+			OSDP_PACKET_BUF_SIZE_MAX);
+		return -1;
+	}
+
+	pd->packet_buf_size = size;
+	return 0;
+}
+
+int osdp_phy_rx_init(struct osdp_pd *pd, int buf_size)
+{
+	struct osdp_rx *rx;
+
+#ifdef CONFIG_OSDP_STATIC_PD
+	static struct osdp_rx g_rx;
+	static uint8_t g_packet_buf[OSDP_PACKET_BUF_SIZE];
+
+	if (buf_size > (int)sizeof(g_packet_buf)) {
+		LOG_WRN("Static PD; packet buffer capped to %d bytes",
+			(int)sizeof(g_packet_buf));
+		buf_size = sizeof(g_packet_buf);
+		pd->packet_buf_size = buf_size;
+	}
+	rx = &g_rx;
+	memset(rx, 0, sizeof(struct osdp_rx));
+	rx->packet_buf = g_packet_buf;
+#else
+	rx = calloc(1, sizeof(struct osdp_rx) + buf_size);
+	if (rx == NULL) {
+		LOG_ERR("Failed to allocate RX context");
+		return -1;
+	}
+	rx->packet_buf = (uint8_t *)(rx + 1);
+#endif
+	rx->packet_buf_size = buf_size;
+	rx->refcount = 1;
+	pd->rx = rx;
+	return 0;
+}
+
+void osdp_phy_rx_share(struct osdp_pd *pd, struct osdp_pd *owner)
+{
+	assert(pd->packet_buf_size <= owner->rx->packet_buf_size);
+	owner->rx->refcount += 1;
+	pd->rx = owner->rx;
+}
+
+void osdp_phy_rx_free(struct osdp_pd *pd)
+{
+	struct osdp_rx *rx = pd->rx;
+
+	if (rx == NULL) {
+		return;
+	}
+	pd->rx = NULL;
+	if (--rx->refcount > 0) {
+		return;
+	}
+#ifndef CONFIG_OSDP_STATIC_PD
+	free(rx);
+#endif
+}
+
+int osdp_phy_ack_cache_init(struct osdp_pd *pd)
+{
+#ifdef CONFIG_OSDP_STATIC_PD
+	static struct osdp_ack_cache g_ack_cache;
+
+	memset(&g_ack_cache, 0, sizeof(struct osdp_ack_cache));
+	pd->ack_cache = &g_ack_cache;
+#else
+	pd->ack_cache = calloc(1, sizeof(struct osdp_ack_cache));
+	if (pd->ack_cache == NULL) {
+		LOG_ERR("Failed to allocate ACK cache");
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+void osdp_phy_ack_cache_free(struct osdp_pd *pd)
+{
+#ifndef CONFIG_OSDP_STATIC_PD
+	safe_free(pd->ack_cache);
+#endif
+	pd->ack_cache = NULL;
 }
 
 #ifdef UNIT_TESTING
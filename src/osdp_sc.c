@@ -4,6 +4,11 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define SC_RAND_POOL_CHECK_FORK
+#endif
+
 #include "osdp_common.h"
 
 #define OSDP_SC_EOM_MARKER             0x80  /* End of Message Marker */
@@ -14,6 +19,61 @@ static const uint8_t osdp_scbk_default[16] = {
 	0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F
 };
 
+#ifdef SC_RAND_POOL_CHECK_FORK
+/* bumped in a forked child; pools filled before that are the parent's */
+static unsigned int sc_fork_gen;
+static bool sc_fork_handler_set;
+
+static void sc_fork_child(void)
+{
+	sc_fork_gen++;
+}
+#endif
+
+void osdp_sc_rand_init(void)
+{
+#ifdef SC_RAND_POOL_CHECK_FORK
+	/* a second registration (setup racing in two threads) is harmless */
+	if (!sc_fork_handler_set) {
+		sc_fork_handler_set = true;
+		pthread_atfork(NULL, NULL, sc_fork_child);
+	}
+#endif
+}
+
+/**
+ * Hand out random bytes from the context's pool; the pool is refilled from
+ * the crypto backend only when it runs dry, so a handshake costs a memcpy
+ * instead of a trip to the backend's RNG.
+ */
+void osdp_sc_random(struct osdp_pd *pd, uint8_t *buf, int len)
+{
+	int n;
+	uint8_t *src;
+	struct osdp_rand_pool *pool = &pd_to_osdp(pd)->rand_pool;
+
+#ifdef SC_RAND_POOL_CHECK_FORK
+	/* a forked child must not hand out the same bytes as its parent */
+	if (pool->fork_gen != sc_fork_gen) {
+		pool->avail = 0;
+		pool->fork_gen = sc_fork_gen;
+	}
+#endif
+	while (len > 0) {
+		if (pool->avail == 0) {
+			osdp_fill_random(pool->buf, OSDP_RAND_POOL_SIZE);
+			pool->avail = OSDP_RAND_POOL_SIZE;
+		}
+		n = (len < pool->avail) ? len : pool->avail;
+		src = pool->buf + OSDP_RAND_POOL_SIZE - pool->avail;
+		memcpy(buf, src, n);
+		memset(src, 0, n);
+		pool->avail -= n;
+		buf += n;
+		len -= n;
+	}
+}
+
 void osdp_compute_scbk(struct osdp_pd *pd, uint8_t *master_key, uint8_t *scbk)
 {
 	int i;
@@ -25,15 +85,104 @@ void osdp_compute_scbk(struct osdp_pd *pd, uint8_t *master_key, uint8_t *scbk)
 	osdp_encrypt(master_key, NULL, scbk, 16);
 }
 
-void osdp_compute_session_keys(struct osdp_pd *pd)
+/**
+ * Derive the SCBKs of many PDs from one master key. The master key schedule
+ * is expanded once and the derivations are run through the batched cipher.
+ *
+ * client_uids holds count back-to-back 8 byte UIDs; scbks receives count
+ * back-to-back 16 byte keys.
+ */
+int osdp_compute_scbk_list(const uint8_t *master_key, const uint8_t *client_uids,
+			   uint8_t *scbks, int count)
+{
+	int i, j, k, n;
+	uint8_t *blocks[8];
+	struct osdp_crypt_ctx *ctx[8];
+	struct osdp_crypt_ctx *mk_ctx;
+
+	mk_ctx = osdp_crypt_ctx_new();
+	if (mk_ctx == NULL) {
+		return -1;
+	}
+	if (osdp_crypt_ctx_set_key(mk_ctx, master_key)) {
+		goto error;
+	}
+
+	for (i = 0; i < count; i += n) {
+		n = (count - i < 8) ? count - i : 8;
+		for (j = 0; j < n; j++) {
+			blocks[j] = scbks + (i + j) * 16;
+			ctx[j] = mk_ctx;
+			memcpy(blocks[j], client_uids + (i + j) * 8, 8);
+			for (k = 8; k < 16; k++) {
+				blocks[j][k] = ~blocks[j][k - 8];
+			}
+		}
+		if (osdp_crypt_ctx_encrypt_batch(ctx, blocks, n)) {
+			goto error;
+		}
+	}
+
+	osdp_crypt_ctx_free(mk_ctx);
+	return 0;
+error:
+	osdp_crypt_ctx_free(mk_ctx);
+	return -1;
+}
+
+static void osdp_sc_free_ctx(struct osdp_pd *pd)
+{
+	osdp_crypt_ctx_free(pd->sc.ctx_enc);
+	osdp_crypt_ctx_free(pd->sc.ctx_mac1);
+	osdp_crypt_ctx_free(pd->sc.ctx_mac2);
+	pd->sc.ctx_enc = NULL;
+	pd->sc.ctx_mac1 = NULL;
+	pd->sc.ctx_mac2 = NULL;
+}
+
+/**
+ * Cipher contexts are allocated once per SC session and re-keyed when the
+ * session keys change; subsequent operations only re-initialize the IV.
+ */
+static int osdp_sc_alloc_ctx(struct osdp_pd *pd)
+{
+	if (pd->sc.ctx_enc != NULL) {
+		return 0;
+	}
+	pd->sc.ctx_enc = osdp_crypt_ctx_new();
+	pd->sc.ctx_mac1 = osdp_crypt_ctx_new();
+	pd->sc.ctx_mac2 = osdp_crypt_ctx_new();
+	if (pd->sc.ctx_enc == NULL || pd->sc.ctx_mac1 == NULL ||
+	    pd->sc.ctx_mac2 == NULL) {
+		LOG_ERR("Failed to allocate cipher contexts");
+		osdp_sc_free_ctx(pd);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Key ctx_enc with SCBK and lay out the S-ENC, S-MAC1 and S-MAC2 derivation
+ * blocks in place; they become the session keys once encrypted with ctx_enc
+ * (see sc_session_keys_commit()).
+ */
+static int sc_session_keys_prepare(struct osdp_pd *pd)
 {
 	int i;
-	uint8_t scbk[16];
+	const uint8_t *scbk;
 
+	if (osdp_sc_alloc_ctx(pd)) {
+		return -1;
+	}
+
+	/* ctx_enc is borrowed to hold SCBK until the session keys are ready */
 	if (ISSET_FLAG(pd, PD_FLAG_SC_USE_SCBKD)) {
-		memcpy(scbk, osdp_scbk_default, 16);
+		scbk = osdp_scbk_default;
 	} else {
-		memcpy(scbk, pd->sc.scbk, 16);
+		scbk = pd->sc.scbk;
+	}
+	if (osdp_crypt_ctx_set_key(pd->sc.ctx_enc, scbk)) {
+		return -1;
 	}
 
 	memset(pd->sc.s_enc, 0, 16);
@@ -52,18 +201,43 @@ void osdp_compute_session_keys(struct osdp_pd *pd)
 		pd->sc.s_mac1[i] = pd->sc.cp_random[i - 2];
 		pd->sc.s_mac2[i] = pd->sc.cp_random[i - 2];
 	}
+	return 0;
+}
 
-	osdp_encrypt(scbk, NULL, pd->sc.s_enc, 16);
-	osdp_encrypt(scbk, NULL, pd->sc.s_mac1, 16);
-	osdp_encrypt(scbk, NULL, pd->sc.s_mac2, 16);
+static int sc_session_keys_commit(struct osdp_pd *pd)
+{
+	if (osdp_crypt_ctx_set_key(pd->sc.ctx_enc, pd->sc.s_enc) ||
+	    osdp_crypt_ctx_set_key(pd->sc.ctx_mac1, pd->sc.s_mac1) ||
+	    osdp_crypt_ctx_set_key(pd->sc.ctx_mac2, pd->sc.s_mac2)) {
+		return -1;
+	}
+	return 0;
 }
 
-void osdp_compute_cp_cryptogram(struct osdp_pd *pd)
+int osdp_compute_session_keys(struct osdp_pd *pd)
+{
+	struct osdp_crypt_ctx *ctx[3];
+	uint8_t *keys[3] = { pd->sc.s_enc, pd->sc.s_mac1, pd->sc.s_mac2 };
+
+	if (sc_session_keys_prepare(pd)) {
+		return -1;
+	}
+
+	/* All three keys derive from SCBK; run them as one batch */
+	ctx[0] = ctx[1] = ctx[2] = pd->sc.ctx_enc;
+	if (osdp_crypt_ctx_encrypt_batch(ctx, keys, 3)) {
+		return -1;
+	}
+	return sc_session_keys_commit(pd);
+}
+
+int osdp_compute_cp_cryptogram(struct osdp_pd *pd)
 {
 	/* cp_cryptogram = AES-ECB( pd_random[8] || cp_random[8], s_enc ) */
 	memcpy(pd->sc.cp_cryptogram + 0, pd->sc.pd_random, 8);
 	memcpy(pd->sc.cp_cryptogram + 8, pd->sc.cp_random, 8);
-	osdp_encrypt(pd->sc.s_enc, NULL, pd->sc.cp_cryptogram, 16);
+	return osdp_crypt_ctx_encrypt(pd->sc.ctx_enc, NULL,
+				      pd->sc.cp_cryptogram, 16);
 }
 
 /**
@@ -72,7 +246,7 @@ void osdp_compute_cp_cryptogram(struct osdp_pd *pd)
  * Returns 0 if memory pointed to by s1 and and s2 are identical; non-zero
  * otherwise.
  */
-static int osdp_ct_compare(const void *s1, const void *s2, size_t len)
+int osdp_ct_compare(const void *s1, const void *s2, size_t len)
 {
 	size_t i, ret = 0;
 	const uint8_t *_s1 = s1;
@@ -91,7 +265,9 @@ int osdp_verify_cp_cryptogram(struct osdp_pd *pd)
 	/* cp_cryptogram = AES-ECB( pd_random[8] || cp_random[8], s_enc ) */
 	memcpy(cp_crypto + 0, pd->sc.pd_random, 8);
 	memcpy(cp_crypto + 8, pd->sc.cp_random, 8);
-	osdp_encrypt(pd->sc.s_enc, NULL, cp_crypto, 16);
+	if (osdp_crypt_ctx_encrypt(pd->sc.ctx_enc, NULL, cp_crypto, 16)) {
+		return -1;
+	}
 
 	if (osdp_ct_compare(pd->sc.cp_cryptogram, cp_crypto, 16) != 0) {
 		return -1;
@@ -99,12 +275,13 @@ int osdp_verify_cp_cryptogram(struct osdp_pd *pd)
 	return 0;
 }
 
-void osdp_compute_pd_cryptogram(struct osdp_pd *pd)
+int osdp_compute_pd_cryptogram(struct osdp_pd *pd)
 {
 	/* pd_cryptogram = AES-ECB( cp_random[8] || pd_random[8], s_enc ) */
 	memcpy(pd->sc.pd_cryptogram + 0, pd->sc.cp_random, 8);
 	memcpy(pd->sc.pd_cryptogram + 8, pd->sc.pd_random, 8);
-	osdp_encrypt(pd->sc.s_enc, NULL, pd->sc.pd_cryptogram, 16);
+	return osdp_crypt_ctx_encrypt(pd->sc.ctx_enc, NULL,
+				      pd->sc.pd_cryptogram, 16);
 }
 
 int osdp_verify_pd_cryptogram(struct osdp_pd *pd)
@@ -114,7 +291,9 @@ int osdp_verify_pd_cryptogram(struct osdp_pd *pd)
 	/* pd_cryptogram = AES-ECB( cp_random[8] || pd_random[8], s_enc ) */
 	memcpy(pd_crypto + 0, pd->sc.cp_random, 8);
 	memcpy(pd_crypto + 8, pd->sc.pd_random, 8);
-	osdp_encrypt(pd->sc.s_enc, NULL, pd_crypto, 16);
+	if (osdp_crypt_ctx_encrypt(pd->sc.ctx_enc, NULL, pd_crypto, 16)) {
+		return -1;
+	}
 
 	if (osdp_ct_compare(pd->sc.pd_cryptogram, pd_crypto, 16) != 0) {
 		return -1;
@@ -122,12 +301,91 @@ int osdp_verify_pd_cryptogram(struct osdp_pd *pd)
 	return 0;
 }
 
-void osdp_compute_rmac_i(struct osdp_pd *pd)
+int osdp_compute_rmac_i(struct osdp_pd *pd)
 {
 	/* rmac_i = AES-ECB( AES-ECB( cp_cryptogram, s_mac1 ), s_mac2 ) */
 	memcpy(pd->sc.r_mac, pd->sc.cp_cryptogram, 16);
-	osdp_encrypt(pd->sc.s_mac1, NULL, pd->sc.r_mac, 16);
-	osdp_encrypt(pd->sc.s_mac2, NULL, pd->sc.r_mac, 16);
+	if (osdp_crypt_ctx_encrypt(pd->sc.ctx_mac1, NULL, pd->sc.r_mac, 16) ||
+	    osdp_crypt_ctx_encrypt(pd->sc.ctx_mac2, NULL, pd->sc.r_mac, 16)) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * CP side of the CCRYPT step of several SC handshakes at once. This is
+ * osdp_compute_session_keys(), osdp_verify_pd_cryptogram() and
+ * osdp_compute_cp_cryptogram() for each PD, but the key derivations of all
+ * PDs go through the batched cipher together, and so do their cryptograms.
+ *
+ * results[i] is set to 0 on success, -2 if the cryptogram of pds[i] did not
+ * verify and -1 on other failures.
+ */
+void osdp_sc_ccrypt_batch(struct osdp_pd **pds, int *results, int count)
+{
+	int i, j, n, nb;
+	struct osdp_pd *pd, *ok[OSDP_SC_BATCH_SIZE];
+	uint8_t pd_crypto[OSDP_SC_BATCH_SIZE][16];
+	uint8_t *blocks[OSDP_SC_BATCH_SIZE * 3];
+	struct osdp_crypt_ctx *ctx[OSDP_SC_BATCH_SIZE * 3];
+	int *res[OSDP_SC_BATCH_SIZE];
+
+	for (i = 0; i < count; i += OSDP_SC_BATCH_SIZE) {
+		n = 0;
+		nb = 0;
+		for (j = i; j < count && j < i + OSDP_SC_BATCH_SIZE; j++) {
+			pd = pds[j];
+			results[j] = -1;
+			if (sc_session_keys_prepare(pd)) {
+				continue;
+			}
+			ctx[nb] = pd->sc.ctx_enc;
+			blocks[nb++] = pd->sc.s_enc;
+			ctx[nb] = pd->sc.ctx_enc;
+			blocks[nb++] = pd->sc.s_mac1;
+			ctx[nb] = pd->sc.ctx_enc;
+			blocks[nb++] = pd->sc.s_mac2;
+			res[n] = &results[j];
+			ok[n++] = pd;
+		}
+		if (n == 0 || osdp_crypt_ctx_encrypt_batch(ctx, blocks, nb)) {
+			continue;
+		}
+
+		/* pd_cryptogram and cp_cryptogram; both under the new S-ENC */
+		nb = 0;
+		for (j = 0; j < n; j++) {
+			pd = ok[j];
+			if (sc_session_keys_commit(pd)) {
+				ok[j] = NULL;
+				continue;
+			}
+			memcpy(pd_crypto[j] + 0, pd->sc.cp_random, 8);
+			memcpy(pd_crypto[j] + 8, pd->sc.pd_random, 8);
+			memcpy(pd->sc.cp_cryptogram + 0, pd->sc.pd_random, 8);
+			memcpy(pd->sc.cp_cryptogram + 8, pd->sc.cp_random, 8);
+			ctx[nb] = pd->sc.ctx_enc;
+			blocks[nb++] = pd_crypto[j];
+			ctx[nb] = pd->sc.ctx_enc;
+			blocks[nb++] = pd->sc.cp_cryptogram;
+		}
+		if (nb == 0 || osdp_crypt_ctx_encrypt_batch(ctx, blocks, nb)) {
+			continue;
+		}
+
+		for (j = 0; j < n; j++) {
+			pd = ok[j];
+			if (pd == NULL) {
+				continue;
+			}
+			if (osdp_ct_compare(pd->sc.pd_cryptogram,
+					    pd_crypto[j], 16) != 0) {
+				*res[j] = -2;
+			} else {
+				*res[j] = 0;
+			}
+		}
+	}
 }
 
 int osdp_decrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int length)
@@ -144,7 +402,9 @@ int osdp_decrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int length)
 		iv[i] = ~iv[i];
 	}
 
-	osdp_decrypt(pd->sc.s_enc, iv, data, length);
+	if (osdp_crypt_ctx_decrypt(pd->sc.ctx_enc, iv, data, length)) {
+		return -1;
+	}
 
 	length--;
 	while (length && data[length] == 0x00) {
@@ -173,7 +433,9 @@ int osdp_encrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int length)
 		iv[i] = ~iv[i];
 	}
 
-	osdp_encrypt(pd->sc.s_enc, iv, data, pad_len);
+	if (osdp_crypt_ctx_encrypt(pd->sc.ctx_enc, iv, data, pad_len)) {
+		return -1;
+	}
 
 	return pad_len;
 }
@@ -181,33 +443,47 @@ int osdp_encrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int length)
 int osdp_compute_mac(struct osdp_pd *pd, int is_cmd,
 		     const uint8_t *data, int len)
 {
-	int pad_len;
-	uint8_t buf[OSDP_PACKET_BUF_SIZE] = { 0 };
-	uint8_t iv[16];
+	int i;
+	uint8_t iv[16], last[16] = { 0 };
 
-	memcpy(buf, data, len);
-	pad_len = (len % 16 == 0) ? len : AES_PAD_LEN(len);
-	if (len % 16 != 0) {
-		buf[len] = 0x80; /* end marker */
-	}
+	assert(len > 0);
 	/**
 	 * MAC for data blocks B[1] .. B[N] (post padding) is computed as:
 	 * IV1 = R_MAC (or) C_MAC  -- depending on is_cmd
 	 * IV2 = B[N-1] after -- AES-CBC ( IV1, B[1] to B[N-1], SMAC-1 )
 	 * MAC = AES-ECB ( IV2, B[N], SMAC-2 )
+	 *
+	 * The packet is walked one block at a time and only the CBC chaining
+	 * value is kept in `iv`, so the packet itself is never copied. Only
+	 * the last block is padded, in a local buffer.
 	 */
 
 	memcpy(iv, is_cmd ? pd->sc.r_mac : pd->sc.c_mac, 16);
-	if (pad_len > 16) {
-		/* N-1 blocks -- encrypted with SMAC-1 */
-		osdp_encrypt(pd->sc.s_mac1, iv, buf, pad_len - 16);
-		/* N-1 th block is the IV for N th block */
-		memcpy(iv, buf + pad_len - 32, 16);
+	while (len > 16) {
+		/* B[1] .. B[N-1] -- encrypted with SMAC-1 */
+		for (i = 0; i < 16; i++) {
+			iv[i] ^= data[i];
+		}
+		if (osdp_crypt_ctx_encrypt(pd->sc.ctx_mac1, NULL, iv, 16)) {
+			return -1;
+		}
+		data += 16;
+		len -= 16;
+	}
+
+	memcpy(last, data, len);
+	if (len < 16) {
+		last[len] = 0x80; /* end marker */
 	}
 
 	/* N-th Block encrypted with SMAC-2 == MAC */
-	osdp_encrypt(pd->sc.s_mac2, iv, buf + pad_len - 16, 16);
-	memcpy(is_cmd ? pd->sc.c_mac : pd->sc.r_mac, buf + pad_len - 16, 16);
+	for (i = 0; i < 16; i++) {
+		iv[i] ^= last[i];
+	}
+	if (osdp_crypt_ctx_encrypt(pd->sc.ctx_mac2, NULL, iv, 16)) {
+		return -1;
+	}
+	memcpy(is_cmd ? pd->sc.c_mac : pd->sc.r_mac, iv, 16);
 
 	return 0;
 }
@@ -217,7 +493,7 @@ void osdp_sc_setup(struct osdp_pd *pd)
 	uint8_t scbk[16];
 	bool preserve_scbk = is_pd_mode(pd) || ISSET_FLAG(pd, PD_FLAG_HAS_SCBK);
 
-	osdp_crypt_setup();
+	osdp_sc_free_ctx(pd);
 
 	if (preserve_scbk) {
 		memcpy(scbk, pd->sc.scbk, 16);
@@ -236,12 +512,11 @@ void osdp_sc_setup(struct osdp_pd *pd)
 		pd->sc.pd_client_uid[6] = BYTE_2(pd->id.serial_number);
 		pd->sc.pd_client_uid[7] = BYTE_3(pd->id.serial_number);
 	} else {
-		osdp_fill_random(pd->sc.cp_random, 8);
+		osdp_sc_random(pd, pd->sc.cp_random, 8);
 	}
 }
 
 void osdp_sc_teardown(struct osdp_pd *pd)
 {
-	ARG_UNUSED(pd);
-	osdp_crypt_teardown();
+	osdp_sc_free_ctx(pd);
 }
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2024 Siddharth Chandrasekaran <sidcha.dev@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * Secure channel crypto worker. The CP hands the key derivation and
+ * cryptogram work of a SC handshake to a small pool of threads so that
+ * osdp_cp_refresh() can keep servicing other PDs in the meantime. Each PD
+ * has at most one job in flight; the CP FSM parks that PD in
+ * OSDP_CP_PHY_STATE_CRYPTO_WAIT and polls for the result.
+ */
+
+#include <pthread.h>
+
+#include "osdp_common.h"
+
+struct osdp_sc_worker {
+	pthread_t threads[OSDP_SC_WORKER_THREADS];
+	int num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	queue_t jobs;
+	bool stop;
+};
+
+static void *sc_worker_thread(void *arg)
+{
+	int result;
+	queue_node_t *node;
+	struct osdp_sc_job *job;
+	struct osdp_sc_worker *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		if (queue_dequeue(&w->jobs, &node) == 0) {
+			job = CONTAINER_OF(node, struct osdp_sc_job, node);
+			pthread_mutex_unlock(&w->lock);
+			result = job->fn(job->pd);
+			pthread_mutex_lock(&w->lock);
+			job->result = result;
+			job->state = OSDP_SC_JOB_DONE;
+			continue;
+		}
+		if (w->stop) {
+			break;
+		}
+		pthread_cond_wait(&w->cond, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+int osdp_sc_worker_start(struct osdp *ctx)
+{
+	int i;
+	struct osdp_sc_worker *w;
+
+	w = calloc(1, sizeof(struct osdp_sc_worker));
+	if (w == NULL) {
+		return -1;
+	}
+	queue_init(&w->jobs);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	for (i = 0; i < OSDP_SC_WORKER_THREADS; i++) {
+		if (pthread_create(&w->threads[i], NULL, sc_worker_thread, w)) {
+			break;
+		}
+		w->num_threads++;
+	}
+	ctx->sc_worker = w;
+
+	if (w->num_threads == 0) {
+		osdp_sc_worker_stop(ctx);
+		return -1;
+	}
+	return 0;
+}
+
+void osdp_sc_worker_stop(struct osdp *ctx)
+{
+	int i;
+	struct osdp_sc_worker *w = ctx->sc_worker;
+
+	if (w == NULL) {
+		return;
+	}
+
+	/* workers drain the jobs already queued before they exit */
+	pthread_mutex_lock(&w->lock);
+	w->stop = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 0; i < w->num_threads; i++) {
+		pthread_join(w->threads[i], NULL);
+	}
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+	ctx->sc_worker = NULL;
+}
+
+int osdp_sc_worker_submit(struct osdp_pd *pd, int (*fn)(struct osdp_pd *pd))
+{
+	struct osdp_sc_worker *w = pd_to_osdp(pd)->sc_worker;
+
+	if (w == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	if (pd->sc_job.state == OSDP_SC_JOB_PENDING) {
+		pthread_mutex_unlock(&w->lock);
+		return -1;
+	}
+	pd->sc_job.pd = pd;
+	pd->sc_job.fn = fn;
+	pd->sc_job.result = 0;
+	pd->sc_job.state = OSDP_SC_JOB_PENDING;
+	queue_enqueue(&w->jobs, &pd->sc_job.node);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+int osdp_sc_worker_poll(struct osdp_pd *pd, int *result)
+{
+	int state;
+	struct osdp_sc_worker *w = pd_to_osdp(pd)->sc_worker;
+
+	if (w == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	state = pd->sc_job.state;
+	if (state == OSDP_SC_JOB_DONE) {
+		*result = pd->sc_job.result;
+		pd->sc_job.state = OSDP_SC_JOB_IDLE;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	if (state == OSDP_SC_JOB_IDLE) {
+		return -1;
+	}
+	return (state == OSDP_SC_JOB_PENDING) ? 1 : 0;
+}
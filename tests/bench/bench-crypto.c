@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2024 Siddharth Chandrasekaran <sidcha.dev@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * Microbenchmarks for the crypto backend and the secure channel primitives
+ * built on top of it. Each case is run for at least BENCH_MIN_NS and the
+ * average cost is reported as ns/op and ops/s.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "osdp_common.h"
+
+#ifndef BENCH_BACKEND
+#define BENCH_BACKEND "unknown"
+#endif
+
+#define BENCH_MIN_NS   (200 * 1000 * 1000ULL)
+#define BENCH_MAX_LEN  1024
+
+struct bench_state {
+	struct osdp_pd *pd;
+	uint8_t key[16];
+	uint8_t iv[16];
+	uint8_t buf[BENCH_MAX_LEN + 16];
+	uint8_t ct[BENCH_MAX_LEN + 16];
+	int len;
+	int ct_len;
+};
+
+typedef void (*bench_fn_t)(struct bench_state *s);
+
+static volatile int bench_sink;
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_run(const char *name, bench_fn_t fn,
+		      struct bench_state *s, int len)
+{
+	uint64_t i, iters = 16, start, elapsed;
+	double ns_per_op;
+
+	s->len = len;
+	for (;;) {
+		start = bench_now_ns();
+		for (i = 0; i < iters; i++) {
+			fn(s);
+		}
+		elapsed = bench_now_ns() - start;
+		if (elapsed >= BENCH_MIN_NS) {
+			break;
+		}
+		iters *= 2;
+	}
+
+	ns_per_op = (double)elapsed / iters;
+	printf("%-8s  %-22s  %5d  %12.1f  %12.0f\n", BENCH_BACKEND, name, len,
+	       ns_per_op, 1e9 / ns_per_op);
+}
+
+static void bench_ecb_encrypt(struct bench_state *s)
+{
+	osdp_encrypt(s->key, NULL, s->buf, 16);
+}
+
+static void bench_ecb_decrypt(struct bench_state *s)
+{
+	osdp_decrypt(s->key, NULL, s->buf, 16);
+}
+
+static void bench_cbc_encrypt(struct bench_state *s)
+{
+	osdp_encrypt(s->key, s->iv, s->buf, s->len);
+}
+
+static void bench_cbc_decrypt(struct bench_state *s)
+{
+	osdp_decrypt(s->key, s->iv, s->buf, s->len);
+}
+
+static void bench_compute_mac(struct bench_state *s)
+{
+	osdp_compute_mac(s->pd, 1, s->buf, s->len);
+}
+
+static void bench_encrypt_data(struct bench_state *s)
+{
+	bench_sink = osdp_encrypt_data(s->pd, 1, s->buf, s->len);
+}
+
+static void bench_decrypt_data(struct bench_state *s)
+{
+	memcpy(s->buf, s->ct, s->ct_len);
+	bench_sink = osdp_decrypt_data(s->pd, 1, s->buf, s->ct_len);
+}
+
+static void bench_handshake(struct bench_state *s)
+{
+	struct osdp_pd *pd = s->pd;
+
+	/* both ends of a SC handshake, minus the I/O */
+	osdp_compute_session_keys(pd);
+	osdp_compute_pd_cryptogram(pd);
+	bench_sink = osdp_verify_pd_cryptogram(pd);
+	osdp_compute_cp_cryptogram(pd);
+	bench_sink = osdp_verify_cp_cryptogram(pd);
+	osdp_compute_rmac_i(pd);
+}
+
+static struct osdp_pd *bench_pd_setup(const uint8_t *scbk)
+{
+	struct osdp *ctx;
+	struct osdp_pd *pd;
+
+	ctx = calloc(1, sizeof(struct osdp));
+	pd = calloc(1, sizeof(struct osdp_pd));
+	if (ctx == NULL || pd == NULL) {
+		printf("bench: alloc failed\n");
+		exit(EXIT_FAILURE);
+	}
+	ctx->pd = pd;
+	ctx->_num_pd = 1;
+	pd->osdp_ctx = ctx;
+	logger_get_default(&pd->logger);
+
+	memcpy(pd->sc.scbk, scbk, 16);
+	SET_FLAG(pd, PD_FLAG_HAS_SCBK);
+	osdp_sc_setup(pd);
+	osdp_fill_random(pd->sc.pd_random, 8);
+	if (osdp_compute_session_keys(pd)) {
+		printf("bench: failed to compute session keys\n");
+		exit(EXIT_FAILURE);
+	}
+	osdp_compute_cp_cryptogram(pd);
+	osdp_compute_rmac_i(pd);
+	return pd;
+}
+
+static void bench_pd_teardown(struct osdp_pd *pd)
+{
+	struct osdp *ctx = pd_to_osdp(pd);
+
+	osdp_sc_teardown(pd);
+	free(pd);
+	free(ctx);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	struct bench_state s;
+	static const int sizes[] = { 16, 64, 128, 256, 1024 };
+	const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	memset(&s, 0, sizeof(s));
+	osdp_crypt_setup();
+	osdp_fill_random(s.key, 16);
+	osdp_fill_random(s.iv, 16);
+	osdp_fill_random(s.buf, sizeof(s.buf));
+	s.pd = bench_pd_setup(s.key);
+
+	printf("%-8s  %-22s  %5s  %12s  %12s\n",
+	       "backend", "operation", "bytes", "ns/op", "ops/s");
+
+	bench_run("osdp_encrypt (ECB)", bench_ecb_encrypt, &s, 16);
+	bench_run("osdp_decrypt (ECB)", bench_ecb_decrypt, &s, 16);
+	for (i = 0; i < num_sizes; i++) {
+		bench_run("osdp_encrypt (CBC)", bench_cbc_encrypt, &s, sizes[i]);
+	}
+	for (i = 0; i < num_sizes; i++) {
+		bench_run("osdp_decrypt (CBC)", bench_cbc_decrypt, &s, sizes[i]);
+	}
+	for (i = 0; i < num_sizes; i++) {
+		bench_run("osdp_compute_mac", bench_compute_mac, &s, sizes[i]);
+	}
+	for (i = 0; i < num_sizes; i++) {
+		/* leave room for the EOM marker and padding */
+		bench_run("osdp_encrypt_data", bench_encrypt_data, &s,
+			  sizes[i] - 1);
+	}
+	for (i = 0; i < num_sizes; i++) {
+		osdp_fill_random(s.ct, sizes[i] - 1);
+		s.ct_len = osdp_encrypt_data(s.pd, 1, s.ct, sizes[i] - 1);
+		bench_run("osdp_decrypt_data", bench_decrypt_data, &s,
+			  s.ct_len);
+	}
+	bench_run("sc_handshake", bench_handshake, &s, 0);
+
+	bench_pd_teardown(s.pd);
+	osdp_crypt_teardown();
+	return 0;
+}
@@ -0,0 +1,634 @@
+/*
+ * Copyright (c) 2024 Siddharth Chandrasekaran <sidcha.dev@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * PD farm: hosts N virtual PDs on a single in-memory channel and drives a CP
+ * against them. Time is virtual (see osdp_millis_now() below) so the run is
+ * reproducible and much faster than real time. At the end, the CP's command
+ * throughput, per-PD service interval and card read delivery latency are
+ * reported.
+ *
+ * Each PD is a regular PD context driven in push mode with osdp_pd_feed();
+ * the farm decodes the address byte of each command to find its recipient.
+ *
+ * Optionally (-f), a file is rolled out to all PDs with
+ * osdp_file_rollout_start() and the PDs verify every byte they receive.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <osdp.h>
+
+#define FARM_MAX_PDS        126
+#define FARM_FRAME_MAX      1024
+#define FARM_TICK_US        100
+#define FARM_PD_REFRESH_US  (10 * 1000)
+
+struct farm_samples {
+	int64_t *v;
+	size_t len;
+	size_t size;
+};
+
+struct farm_pd {
+	osdp_t *ctx;
+	int address;
+	int64_t next_card_us;
+	int64_t next_status_us;
+	int64_t last_cmd_us;
+	uint32_t input_mask;
+	int file_bad;
+};
+
+struct farm {
+	/* configuration */
+	int num_pd;
+	int64_t duration_us;
+	int baud_rate;
+	int latency_us;
+	double card_rate;      /* card reads per PD per second */
+	double status_rate;    /* input status changes per PD per second */
+	int drop_pct;          /* % of commands that never reach the PD */
+	int corrupt_pct;       /* % of replies with a corrupted byte */
+	bool sc;
+	int file_size;         /* roll out a file of this size; 0 to not */
+	uint64_t seed;
+	uint64_t rand_state;
+
+	/* virtual bus */
+	int64_t now_us;
+	uint8_t cmd[FARM_FRAME_MAX];
+	int cmd_len;
+	int64_t cmd_at;
+	uint8_t reply[FARM_FRAME_MAX];
+	int reply_len;
+	int reply_pos;
+	int64_t reply_at;
+
+	osdp_t *cp;
+	struct farm_pd pd[FARM_MAX_PDS];
+	struct farm_pd *by_address[128];
+
+	/* results */
+	uint64_t commands;
+	uint64_t dropped;
+	uint64_t corrupted;
+	uint64_t cards_sent;
+	uint64_t cards_received;
+	uint64_t status_sent;
+	uint64_t status_received;
+	struct farm_samples service_interval;
+	struct farm_samples card_latency;
+	uint8_t file_failed[FARM_MAX_PDS / 8 + 1];
+};
+
+static struct farm g_farm;
+
+/* Virtual clock; overrides the weak definition in LibOSDP */
+int64_t osdp_millis_now(void)
+{
+	return g_farm.now_us / 1000;
+}
+
+static uint64_t farm_rand(void)
+{
+	/* xorshift64*; good enough and the same on all platforms */
+	g_farm.rand_state ^= g_farm.rand_state >> 12;
+	g_farm.rand_state ^= g_farm.rand_state << 25;
+	g_farm.rand_state ^= g_farm.rand_state >> 27;
+	return g_farm.rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+static bool farm_chance(int pct)
+{
+	return pct > 0 && (int)(farm_rand() % 100) < pct;
+}
+
+static int64_t farm_next_arrival(double rate)
+{
+	double u;
+
+	if (rate <= 0) {
+		return INT64_MAX;
+	}
+	u = (double)((farm_rand() >> 11) + 1) / (double)(1ULL << 53);
+	return g_farm.now_us + (int64_t)(-log(u) / rate * 1e6);
+}
+
+static int64_t farm_wire_time(int len)
+{
+	if (g_farm.baud_rate <= 0) {
+		return 0;
+	}
+	/* 8N1: 10 bits per byte */
+	return (int64_t)len * 10 * 1000000 / g_farm.baud_rate;
+}
+
+static void farm_sample_add(struct farm_samples *s, int64_t v)
+{
+	int64_t *p;
+
+	if (s->len == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		p = realloc(s->v, s->size * sizeof(int64_t));
+		if (p == NULL) {
+			printf("pd-farm: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		s->v = p;
+	}
+	s->v[s->len++] = v;
+}
+
+static int farm_sample_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void farm_sample_report(const char *name, struct farm_samples *s)
+{
+	if (s->len == 0) {
+		printf("%-24s  (no samples)\n", name);
+		return;
+	}
+	qsort(s->v, s->len, sizeof(int64_t), farm_sample_cmp);
+	printf("%-24s  p50 %8.2f  p99 %8.2f  max %8.2f ms  (n=%zu)\n", name,
+	       s->v[s->len / 2] / 1000.0,
+	       s->v[(s->len * 99) / 100] / 1000.0,
+	       s->v[s->len - 1] / 1000.0, s->len);
+}
+
+/* --- channel methods --- */
+
+static int farm_cp_send(void *data, uint8_t *buf, int len)
+{
+	(void)data;
+
+	if (len > FARM_FRAME_MAX) {
+		return -1;
+	}
+	/* CP waits for a reply (or times out) before it sends again */
+	memcpy(g_farm.cmd, buf, len);
+	g_farm.cmd_len = len;
+	g_farm.cmd_at = g_farm.now_us + farm_wire_time(len);
+	g_farm.reply_len = 0;
+	g_farm.reply_pos = 0;
+	g_farm.commands++;
+	return len;
+}
+
+static int farm_cp_recv(void *data, uint8_t *buf, int max_len)
+{
+	int len;
+
+	(void)data;
+
+	if (g_farm.reply_pos >= g_farm.reply_len ||
+	    g_farm.now_us < g_farm.reply_at) {
+		return 0;
+	}
+	len = g_farm.reply_len - g_farm.reply_pos;
+	if (len > max_len) {
+		len = max_len;
+	}
+	memcpy(buf, g_farm.reply + g_farm.reply_pos, len);
+	g_farm.reply_pos += len;
+	return len;
+}
+
+static int farm_pd_send(void *data, uint8_t *buf, int len)
+{
+	(void)data;
+
+	if (g_farm.reply_len + len > FARM_FRAME_MAX) {
+		return -1;
+	}
+	memcpy(g_farm.reply + g_farm.reply_len, buf, len);
+	if (farm_chance(g_farm.corrupt_pct)) {
+		g_farm.reply[g_farm.reply_len + farm_rand() % len] ^= 0x5A;
+		g_farm.corrupted++;
+	}
+	g_farm.reply_len += len;
+	g_farm.reply_at = g_farm.now_us + g_farm.latency_us +
+			  farm_wire_time(g_farm.reply_len);
+	return len;
+}
+
+/* --- CP side --- */
+
+static int farm_cp_event_cb(void *arg, int pd, struct osdp_event *ev)
+{
+	int64_t ts;
+
+	(void)arg;
+	(void)pd;
+
+	switch (ev->type) {
+	case OSDP_EVENT_CARDREAD:
+		memcpy(&ts, ev->cardread.data, sizeof(ts));
+		farm_sample_add(&g_farm.card_latency, g_farm.now_us - ts);
+		g_farm.cards_received++;
+		break;
+	case OSDP_EVENT_STATUS:
+		g_farm.status_received++;
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* --- PD side --- */
+
+static int farm_pd_command_cb(void *arg, struct osdp_cmd *cmd)
+{
+	struct farm_pd *p = arg;
+
+	if (cmd->id == OSDP_CMD_STATUS) {
+		cmd->status.nr_entries = 8;
+		cmd->status.mask = p->input_mask;
+	}
+	return 0;
+}
+
+static void farm_deliver_command(void)
+{
+	int address, off = 0;
+	struct farm_pd *p;
+
+	if (g_farm.cmd_len == 0 || g_farm.now_us < g_farm.cmd_at) {
+		return;
+	}
+	if (g_farm.cmd[0] == 0xFF) {
+		off = 1; /* mark byte */
+	}
+	if (g_farm.cmd_len < off + 2) {
+		g_farm.cmd_len = 0;
+		return;
+	}
+	address = g_farm.cmd[off + 1] & 0x7F;
+	p = g_farm.by_address[address];
+	if (p != NULL) {
+		if (p->last_cmd_us) {
+			farm_sample_add(&g_farm.service_interval,
+					g_farm.now_us - p->last_cmd_us);
+		}
+		p->last_cmd_us = g_farm.now_us;
+		if (farm_chance(g_farm.drop_pct)) {
+			g_farm.dropped++;
+		} else {
+			osdp_pd_feed(p->ctx, g_farm.cmd, g_farm.cmd_len);
+		}
+	}
+	g_farm.cmd_len = 0;
+}
+
+static void farm_pd_generate_events(struct farm_pd *p)
+{
+	struct osdp_event ev;
+
+	if (g_farm.now_us >= p->next_card_us) {
+		memset(&ev, 0, sizeof(ev));
+		ev.type = OSDP_EVENT_CARDREAD;
+		ev.cardread.format = OSDP_CARD_FMT_RAW_UNSPECIFIED;
+		ev.cardread.length = sizeof(int64_t) * 8; /* bits */
+		memcpy(ev.cardread.data, &g_farm.now_us, sizeof(int64_t));
+		if (osdp_pd_notify_event(p->ctx, &ev) == 0) {
+			g_farm.cards_sent++;
+		}
+		p->next_card_us = farm_next_arrival(g_farm.card_rate);
+	}
+
+	if (g_farm.now_us >= p->next_status_us) {
+		p->input_mask ^= 1 << (farm_rand() % 8);
+		memset(&ev, 0, sizeof(ev));
+		ev.type = OSDP_EVENT_STATUS;
+		ev.status.type = OSDP_STATUS_REPORT_INPUT;
+		ev.status.nr_entries = 8;
+		ev.status.mask = p->input_mask;
+		if (osdp_pd_notify_event(p->ctx, &ev) == 0) {
+			g_farm.status_sent++;
+		}
+		p->next_status_us = farm_next_arrival(g_farm.status_rate);
+	}
+}
+
+/* --- file rollout --- */
+
+static uint8_t farm_file_byte(int offset)
+{
+	return (uint8_t)(offset * 7 + (offset >> 8));
+}
+
+static int farm_file_open(void *arg, int file_id, int *size)
+{
+	(void)file_id;
+
+	if (arg == NULL) { /* CP */
+		*size = g_farm.file_size;
+	}
+	return 0;
+}
+
+static int farm_file_read(void *arg, void *buf, int size, int offset)
+{
+	int i;
+	uint8_t *p = buf;
+
+	(void)arg;
+
+	if (offset + size > g_farm.file_size) {
+		size = g_farm.file_size - offset;
+	}
+	for (i = 0; i < size; i++) {
+		p[i] = farm_file_byte(offset + i);
+	}
+	return size;
+}
+
+static int farm_file_write(void *arg, const void *buf, int size, int offset)
+{
+	int i;
+	struct farm_pd *p = arg;
+	const uint8_t *data = buf;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] != farm_file_byte(offset + i)) {
+			p->file_bad++;
+			break;
+		}
+	}
+	return size;
+}
+
+static int farm_file_close(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static void farm_file_rollout_start(void)
+{
+	uint8_t mask[FARM_MAX_PDS / 8 + 1];
+	struct osdp_file_ops ops = {
+		.arg = NULL,
+		.open = farm_file_open,
+		.read = farm_file_read,
+		.write = farm_file_write,
+		.close = farm_file_close,
+	};
+
+	memset(mask, 0xFF, sizeof(mask));
+	if (osdp_file_rollout_start(g_farm.cp, mask, 1, &ops)) {
+		printf("pd-farm: failed to start file rollout\n");
+	}
+}
+
+/* --- setup --- */
+
+static void farm_fill_scbk(uint8_t *scbk, int address)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		scbk[i] = (uint8_t)(address * 31 + i);
+	}
+}
+
+static int farm_setup(void)
+{
+	int i;
+	struct farm_pd *p;
+	static uint8_t scbk[FARM_MAX_PDS][16];
+	static osdp_pd_info_t cp_info[FARM_MAX_PDS];
+	osdp_pd_info_t pd_info;
+	struct osdp_pd_cap cap[] = {
+		{ OSDP_PD_CAP_CONTACT_STATUS_MONITORING, 1, 8 },
+		{ OSDP_PD_CAP_CARD_DATA_FORMAT, 1, 0 },
+		{ (uint8_t)-1, 0, 0 }
+	};
+
+	for (i = 0; i < g_farm.num_pd; i++) {
+		p = &g_farm.pd[i];
+		p->address = i + 1;
+		farm_fill_scbk(scbk[i], p->address);
+
+		memset(&pd_info, 0, sizeof(pd_info));
+		pd_info.baud_rate = 115200;
+		pd_info.address = p->address;
+		pd_info.id.vendor_code = 0xA0B0C0;
+		pd_info.id.serial_number = p->address;
+		pd_info.cap = cap;
+		pd_info.channel.data = p;
+		pd_info.channel.send = farm_pd_send;
+		pd_info.scbk = g_farm.sc ? scbk[i] : NULL;
+		p->ctx = osdp_pd_setup(&pd_info);
+		if (p->ctx == NULL) {
+			printf("pd-farm: PD-%d setup failed\n", p->address);
+			return -1;
+		}
+		osdp_pd_set_command_callback(p->ctx, farm_pd_command_cb, p);
+		if (g_farm.file_size) {
+			struct osdp_file_ops ops = {
+				.arg = p,
+				.open = farm_file_open,
+				.read = farm_file_read,
+				.write = farm_file_write,
+				.close = farm_file_close,
+			};
+			osdp_file_register_ops(p->ctx, 0, &ops);
+		}
+		p->next_card_us = farm_next_arrival(g_farm.card_rate);
+		p->next_status_us = farm_next_arrival(g_farm.status_rate);
+		g_farm.by_address[p->address] = p;
+
+		cp_info[i].baud_rate = 115200;
+		cp_info[i].address = p->address;
+		cp_info[i].channel.id = 1; /* all on the same bus */
+		cp_info[i].channel.send = farm_cp_send;
+		cp_info[i].channel.recv = farm_cp_recv;
+		cp_info[i].scbk = g_farm.sc ? scbk[i] : NULL;
+	}
+
+	g_farm.cp = osdp_cp_setup(g_farm.num_pd, cp_info);
+	if (g_farm.cp == NULL) {
+		printf("pd-farm: CP setup failed\n");
+		return -1;
+	}
+	osdp_cp_set_event_callback(g_farm.cp, farm_cp_event_cb, NULL);
+	if (g_farm.file_size) {
+		farm_file_rollout_start();
+	}
+	return 0;
+}
+
+static void farm_teardown(void)
+{
+	int i;
+
+	osdp_cp_teardown(g_farm.cp);
+	for (i = 0; i < g_farm.num_pd; i++) {
+		osdp_pd_teardown(g_farm.pd[i].ctx);
+	}
+	free(g_farm.service_interval.v);
+	free(g_farm.card_latency.v);
+}
+
+static void farm_run(void)
+{
+	int i;
+	int64_t next_pd_refresh = 0;
+
+	while (g_farm.now_us < g_farm.duration_us) {
+		farm_deliver_command();
+		osdp_cp_refresh(g_farm.cp);
+		for (i = 0; i < g_farm.num_pd; i++) {
+			farm_pd_generate_events(&g_farm.pd[i]);
+		}
+		if (g_farm.now_us >= next_pd_refresh) {
+			/* only for timeouts; commands are handled in feed */
+			for (i = 0; i < g_farm.num_pd; i++) {
+				osdp_pd_refresh(g_farm.pd[i].ctx);
+			}
+			next_pd_refresh = g_farm.now_us + FARM_PD_REFRESH_US;
+		}
+		g_farm.now_us += FARM_TICK_US;
+	}
+}
+
+static void farm_file_report(void)
+{
+	int i, bad = 0;
+	struct osdp_file_rollout_status st;
+
+	if (osdp_file_rollout_status(g_farm.cp, &st, g_farm.file_failed) < 0) {
+		return;
+	}
+	for (i = 0; i < g_farm.num_pd; i++) {
+		bad += !!g_farm.pd[i].file_bad;
+	}
+	printf("%-24s  %d bytes to %d PDs: %d done, %d failed, %d active, "
+	       "%d pending; %d retries\n", "file rollout", g_farm.file_size,
+	       st.num_pd, st.done, st.failed, st.active, st.pending, st.retries);
+	printf("%-24s  %.1fs; %lld bytes at %lld B/s; corrupt PDs %d\n",
+	       "", st.elapsed_ms / 1000.0, (long long)st.bytes,
+	       (long long)st.throughput, bad);
+}
+
+static void farm_report(double wall_s)
+{
+	int i, online = 0, sc_active = 0;
+	uint8_t status[FARM_MAX_PDS / 8 + 1], sc_status[FARM_MAX_PDS / 8 + 1];
+	double sim_s = g_farm.duration_us / 1e6;
+
+	osdp_get_status_mask(g_farm.cp, status);
+	osdp_get_sc_status_mask(g_farm.cp, sc_status);
+	for (i = 0; i < g_farm.num_pd; i++) {
+		online += !!(status[i / 8] & (1 << (i % 8)));
+		sc_active += !!(sc_status[i / 8] & (1 << (i % 8)));
+	}
+
+	printf("pd-farm: %d PDs, SC %s, %d baud, %d us latency, seed %llu\n",
+	       g_farm.num_pd, g_farm.sc ? "on" : "off", g_farm.baud_rate,
+	       g_farm.latency_us, (unsigned long long)g_farm.seed);
+	printf("%.1fs simulated in %.2fs (%.1fx real time)\n", sim_s, wall_s,
+	       wall_s > 0 ? sim_s / wall_s : 0);
+	printf("%-24s  %d/%d (SC active: %d)\n", "PDs online", online,
+	       g_farm.num_pd, sc_active);
+	printf("%-24s  %llu (%.1f/s); dropped %llu; corrupted %llu\n",
+	       "commands", (unsigned long long)g_farm.commands,
+	       g_farm.commands / sim_s, (unsigned long long)g_farm.dropped,
+	       (unsigned long long)g_farm.corrupted);
+	printf("%-24s  %llu/%llu\n", "card reads delivered",
+	       (unsigned long long)g_farm.cards_received,
+	       (unsigned long long)g_farm.cards_sent);
+	printf("%-24s  %llu/%llu\n", "status events delivered",
+	       (unsigned long long)g_farm.status_received,
+	       (unsigned long long)g_farm.status_sent);
+	farm_sample_report("PD service interval", &g_farm.service_interval);
+	farm_sample_report("card read latency", &g_farm.card_latency);
+	if (g_farm.file_size) {
+		farm_file_report();
+	}
+}
+
+static void farm_usage(const char *prog)
+{
+	printf("Usage: %s [options]\n"
+	       "  -n <num>    number of PDs (1-%d; default 16)\n"
+	       "  -t <sec>    simulated duration in seconds (default 60)\n"
+	       "  -b <baud>   bus baud rate; 0 for no wire time (default 115200)\n"
+	       "  -l <us>     PD reply latency in microseconds (default 2000)\n"
+	       "  -c <rate>   card reads per PD per second (default 0.2)\n"
+	       "  -s <rate>   status changes per PD per second (default 1.0)\n"
+	       "  -d <pct>    %% of commands dropped before the PD (default 0)\n"
+	       "  -e <pct>    %% of replies corrupted on the wire (default 0)\n"
+	       "  -S          enable secure channel\n"
+	       "  -f <bytes>  roll out a file of this size to all PDs\n"
+	       "  -r <seed>   random seed (default 1)\n"
+	       "  -v          enable LibOSDP logs\n",
+	       prog, FARM_MAX_PDS);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, log_level = OSDP_LOG_EMERG;
+	struct timespec t0, t1;
+
+	g_farm.num_pd = 16;
+	g_farm.duration_us = 60 * 1000000LL;
+	g_farm.baud_rate = 115200;
+	g_farm.latency_us = 2000;
+	g_farm.card_rate = 0.2;
+	g_farm.status_rate = 1.0;
+	g_farm.seed = 1;
+
+	while ((opt = getopt(argc, argv, "n:t:b:l:c:s:d:e:Sf:r:vh")) != -1) {
+		switch (opt) {
+		case 'n': g_farm.num_pd = atoi(optarg); break;
+		case 't': g_farm.duration_us = atof(optarg) * 1e6; break;
+		case 'b': g_farm.baud_rate = atoi(optarg); break;
+		case 'l': g_farm.latency_us = atoi(optarg); break;
+		case 'c': g_farm.card_rate = atof(optarg); break;
+		case 's': g_farm.status_rate = atof(optarg); break;
+		case 'd': g_farm.drop_pct = atoi(optarg); break;
+		case 'e': g_farm.corrupt_pct = atoi(optarg); break;
+		case 'S': g_farm.sc = true; break;
+		case 'f': g_farm.file_size = atoi(optarg); break;
+		case 'r': g_farm.seed = strtoull(optarg, NULL, 0); break;
+		case 'v': log_level = OSDP_LOG_INFO; break;
+		default:
+			farm_usage(argv[0]);
+			return opt == 'h' ? 0 : EXIT_FAILURE;
+		}
+	}
+	if (g_farm.num_pd < 1 || g_farm.num_pd > FARM_MAX_PDS ||
+	    g_farm.seed == 0) {
+		farm_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	g_farm.rand_state = g_farm.seed;
+	osdp_logger_init("osdp", log_level, NULL);
+	if (farm_setup()) {
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	farm_run();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	farm_report((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	farm_teardown();
+	return 0;
+}
@@ -151,3 +151,34 @@ def test_file_tx_abort(utils):
 
     assert cp.get_file_tx_status(101) == None
     assert pd.get_file_tx_status() == None
+
+def test_file_transfer_image(utils):
+    global receiver_data
+    receiver_data = [0] * 4096
+
+    # Serve the file from memory; no python callbacks on the CP side
+    assert cp.register_file_image(101, 13, bytes(sender_data))
+    assert pd.register_file_ops(receiver_fops)
+    file_tx_cmd = {
+        'command': Command.FileTransfer,
+        'id': 13,
+        'flags': 0
+    }
+    assert cp.send_command(101, file_tx_cmd)
+    assert pd.get_command() == file_tx_cmd
+
+    # Monitor transfer status
+    file_tx_status = False
+    tries = 0
+    while tries < 10:
+        time.sleep(0.5)
+        status = cp.get_file_tx_status(101)
+        if not status or 'size' not in status or 'offset' not in status:
+            break
+        if status['size'] == status['offset']:
+            file_tx_status = True
+            break
+        tries += 1
+    assert file_tx_status
+
+    assert sender_data == receiver_data
@@ -11,6 +11,7 @@
 
 struct test_data {
 	bool cmd_seen;
+	struct osdp_cmd cmd;
 };
 
 int event_callback(void *arg, int pd, struct osdp_event *ev)
@@ -23,8 +24,8 @@ int event_callback(void *arg, int pd, struct osdp_event *ev)
 
 int command_callback(void *arg, struct osdp_cmd *cmd)
 {
-	ARG_UNUSED(cmd);
 	struct test_data *d = arg;
+	memcpy(&d->cmd, cmd, sizeof(struct osdp_cmd));
 	d->cmd_seen = true;
 	return 0;
 }
@@ -56,6 +57,63 @@ struct osdp_cmd test_make_cmd(int cmd_id)
 	}
 }
 
+static bool test_keyset_master_key(osdp_t *cp_ctx, osdp_t *pd_ctx,
+				   struct test_data *d)
+{
+	int rc;
+	uint8_t status = 0, scbk[16];
+	struct osdp_pd *cp_pd = osdp_to_pd(cp_ctx, 0);
+	struct osdp_pd *pd = osdp_to_pd(pd_ctx, 0);
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_KEYSET,
+		.keyset = {
+			.type = 0,
+			.length = 16,
+			.data = { 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+				  0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf },
+		},
+	};
+
+	printf(SUB_1 "sending KEYSET with a master key\n");
+
+	osdp_compute_scbk(cp_pd, cmd.keyset.data, scbk);
+	d->cmd_seen = false;
+	if (osdp_cp_send_command(cp_ctx, 0, &cmd)) {
+		printf(SUB_1 "Failed to send command\n");
+		return false;
+	}
+
+	/* PD must get the derived SCBK; never the master key */
+	rc = 0;
+	while (!d->cmd_seen) {
+		if (rc++ > 10) {
+			printf(SUB_1 "PD failed to check KEYSET\n");
+			return false;
+		}
+		usleep(1000 * 1000);
+	}
+	if (d->cmd.id != OSDP_CMD_KEYSET || d->cmd.keyset.type != 1 ||
+	    memcmp(d->cmd.keyset.data, scbk, 16)) {
+		printf(SUB_1 "PD got the wrong key\n");
+		return false;
+	}
+
+	/* both ends commit it and SC comes back up with the new SCBK */
+	rc = 0;
+	while (1) {
+		if (rc++ > 10) {
+			printf(SUB_1 "SC did not restart with the new SCBK\n");
+			return false;
+		}
+		usleep(1000 * 1000);
+		osdp_get_sc_status_mask(cp_ctx, &status);
+		if ((status & 1) && !memcmp(cp_pd->sc.scbk, scbk, 16) &&
+		    !memcmp(pd->sc.scbk, scbk, 16))
+			break;
+	}
+	return true;
+}
+
 void run_command_tests(struct test *t)
 {
 	int rc;
@@ -125,6 +183,8 @@ void run_command_tests(struct test *t)
 
 	printf(SUB_1 "Commands %s\n",
 	       result ? "succeeded" : "failed");
+
+	TEST_REPORT(t, test_keyset_master_key(cp_ctx, pd_ctx, &d));
 error:
 	async_runner_stop(cp_runner);
 	async_runner_stop(pd_runner);
@@ -111,6 +111,116 @@ void test_cp_fsm_teardown(struct test *t)
 	osdp_cp_teardown(t->mock_data);
 }
 
+/* Run both devices in lock step, without the async runners */
+static void test_cp_fsm_step(osdp_t *cp_ctx, osdp_t *pd_ctx, int ms)
+{
+	osdp_cp_refresh(cp_ctx);
+	osdp_pd_refresh(pd_ctx);
+	usleep(ms * 1000);
+}
+
+static bool test_cp_fsm_acurxsize(struct test *t, int cp_rx_size)
+{
+	int i;
+	bool result = false;
+	uint8_t status = 0;
+	osdp_t *cp_ctx, *pd_ctx;
+	struct osdp_pd *cp_pd, *pd;
+	/* the PD is told only when the CP can take less than the PD */
+	int exp_rx_size = cp_rx_size < OSDP_PACKET_BUF_SIZE ? cp_rx_size : 0;
+
+	printf(SUB_1 "Testing ACURXSIZE with CP rx size %d\n", cp_rx_size);
+
+	if (test_setup_devices(t, &cp_ctx, &pd_ctx)) {
+		return false;
+	}
+	cp_pd = osdp_to_pd(cp_ctx, 0);
+	pd = osdp_to_pd(pd_ctx, 0);
+	cp_pd->packet_buf_size = cp_rx_size;
+
+	for (i = 0; i < 5000 && !(status & 1); i++) {
+		test_cp_fsm_step(cp_ctx, pd_ctx, 1);
+		osdp_get_status_mask(cp_ctx, &status);
+	}
+	if (!(status & 1)) {
+		printf(SUB_2 "PD did not come online\n");
+		goto out;
+	}
+	/* ACURXSIZE is the first thing the CP sends once online */
+	for (i = 0; i < 200; i++) {
+		test_cp_fsm_step(cp_ctx, pd_ctx, 1);
+	}
+	if (cp_pd->peer_rx_size != pd->packet_buf_size ||
+	    pd->peer_rx_size != exp_rx_size) {
+		printf(SUB_2 "rx sizes CP: %u PD: %u\n", cp_pd->peer_rx_size,
+		       pd->peer_rx_size);
+		goto out;
+	}
+	result = true;
+out:
+	osdp_cp_teardown(cp_ctx);
+	osdp_pd_teardown(pd_ctx);
+	return result;
+}
+
+static bool test_cp_fsm_keepactive(struct test *t)
+{
+	int i;
+	bool seen = false;
+	uint8_t status = 0;
+	osdp_t *cp_ctx, *pd_ctx;
+	struct osdp_pd *cp_pd, *pd;
+
+	printf(SUB_1 "Testing SC keep-alive\n");
+
+	if (test_setup_devices(t, &cp_ctx, &pd_ctx)) {
+		return false;
+	}
+	cp_pd = osdp_to_pd(cp_ctx, 0);
+	pd = osdp_to_pd(pd_ctx, 0);
+
+	for (i = 0; i < 5000 && !(status & 1); i++) {
+		test_cp_fsm_step(cp_ctx, pd_ctx, 1);
+		osdp_get_sc_status_mask(cp_ctx, &status);
+	}
+	if (!(status & 1)) {
+		printf(SUB_2 "SC did not come up\n");
+		goto error;
+	}
+
+	/* CP's last secure reply is now close to the PD's SC timeout */
+	cp_pd->sc_tstamp -= OSDP_PD_SC_TIMEOUT_MS - OSDP_CP_SC_KEEPALIVE_MS;
+	for (i = 0; i < 500 && !seen; i++) {
+		test_cp_fsm_step(cp_ctx, pd_ctx, 1);
+		seen = pd->cmd_id == CMD_KEEPACTIVE && pd->reply_id == REPLY_ACK;
+	}
+	if (!seen) {
+		printf(SUB_2 "KEEPACTIVE not sent\n");
+		goto error;
+	}
+	if (osdp_millis_since(pd->sc_tstamp) >= 0) {
+		printf(SUB_2 "PD ignored the keep-alive time\n");
+		goto error;
+	}
+
+	for (i = 0; i < 200; i++) {
+		test_cp_fsm_step(cp_ctx, pd_ctx, 1);
+	}
+	if (!sc_is_active(cp_pd) || !sc_is_active(pd) ||
+	    cp_pd->state != OSDP_CP_STATE_ONLINE) {
+		printf(SUB_2 "SC did not survive\n");
+		goto error;
+	}
+	osdp_cp_teardown(cp_ctx);
+	osdp_pd_teardown(pd_ctx);
+	printf(SUB_1 "SC keep-alive test succeeded\n");
+	return true;
+error:
+	osdp_cp_teardown(cp_ctx);
+	osdp_pd_teardown(pd_ctx);
+	return false;
+}
+
 void run_cp_fsm_tests(struct test *t)
 {
 	int result = true;
@@ -142,6 +252,11 @@ void run_cp_fsm_tests(struct test *t)
 	TEST_REPORT(t, result);
 
 	test_cp_fsm_teardown(t);
+
+	TEST_REPORT(t, test_cp_fsm_acurxsize(t, 128));
+	TEST_REPORT(t, test_cp_fsm_acurxsize(t, OSDP_PACKET_BUF_SIZE));
+	result = test_cp_fsm_keepactive(t);
+	TEST_REPORT(t, result);
 }
 
 // unnecessary
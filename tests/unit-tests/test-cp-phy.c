@@ -4,6 +4,8 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <sys/wait.h>
+
 #include "test.h"
 
 extern int (*test_osdp_phy_packet_finalize)(struct osdp_pd *pd, uint8_t *buf,
@@ -91,7 +93,7 @@ int test_phy_decode_packet_ack(struct osdp *ctx)
 	uint8_t expected[] = { REPLY_ACK };
 
 	printf(SUB_1 "Testing phy_decode_packet(REPLY_ACK) -- ");
-	osdp_rb_push_buf(&p->rx_rb, packet, sizeof(packet));
+	osdp_rb_push_buf(&p->rx->rb, packet, sizeof(packet));
 	err = osdp_phy_check_packet(p);
 	if (err) {
 		printf("failed!\n");
@@ -119,7 +121,7 @@ int test_phy_decode_packet_ignore_leading_mark_bytes(struct osdp *ctx)
 	uint8_t expected[] = { REPLY_ACK };
 
 	printf(SUB_1 "Testing test_phy_decode_packet_ignore_leading_mark_bytes -- ");
-	osdp_rb_push_buf(&p->rx_rb, packet, sizeof(packet));
+	osdp_rb_push_buf(&p->rx->rb, packet, sizeof(packet));
 	err = osdp_phy_check_packet(p);
 	if (err) {
 		printf("failed!\n");
@@ -134,6 +136,516 @@ int test_phy_decode_packet_ignore_leading_mark_bytes(struct osdp *ctx)
 	return 0;
 }
 
+/* NIST SP 800-38A, F.1.1 (ECB-AES128) and F.2.1 (CBC-AES128) */
+static const uint8_t aes_kat_key[16] = {
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+	0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+static const uint8_t aes_kat_iv[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+static const uint8_t aes_kat_plain[64] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+	0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+	0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+	0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+	0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+static const uint8_t aes_kat_ecb[64] = {
+	0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60,
+	0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97,
+	0xf5, 0xd3, 0xd5, 0x85, 0x03, 0xb9, 0x69, 0x9d,
+	0xe7, 0x85, 0x89, 0x5a, 0x96, 0xfd, 0xba, 0xaf,
+	0x43, 0xb1, 0xcd, 0x7f, 0x59, 0x8e, 0xce, 0x23,
+	0x88, 0x1b, 0x00, 0xe3, 0xed, 0x03, 0x06, 0x88,
+	0x7b, 0x0c, 0x78, 0x5e, 0x27, 0xe8, 0xad, 0x3f,
+	0x82, 0x23, 0x20, 0x71, 0x04, 0x72, 0x5d, 0xd4,
+};
+static const uint8_t aes_kat_cbc[64] = {
+	0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46,
+	0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+	0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee,
+	0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+	0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b,
+	0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+	0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09,
+	0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7,
+};
+
+static int test_aes_kat_oneshot(void)
+{
+	int i;
+	uint8_t key[16], iv[16], buf[64];
+
+	memcpy(key, aes_kat_key, 16);
+	for (i = 0; i < 64; i += 16) {
+		memcpy(buf, aes_kat_plain + i, 16);
+		osdp_encrypt(key, NULL, buf, 16);
+		if (memcmp(buf, aes_kat_ecb + i, 16)) {
+			return -1;
+		}
+		osdp_decrypt(key, NULL, buf, 16);
+		if (memcmp(buf, aes_kat_plain + i, 16)) {
+			return -1;
+		}
+	}
+
+	memcpy(buf, aes_kat_plain, 64);
+	memcpy(iv, aes_kat_iv, 16);
+	osdp_encrypt(key, iv, buf, 64);
+	if (memcmp(buf, aes_kat_cbc, 64)) {
+		return -1;
+	}
+	memcpy(iv, aes_kat_iv, 16);
+	osdp_decrypt(key, iv, buf, 64);
+	return memcmp(buf, aes_kat_plain, 64) ? -1 : 0;
+}
+
+static int test_aes_kat_ctx(void)
+{
+	int i, rc = -1;
+	uint8_t iv[16], buf[64], *blocks[4];
+	struct osdp_crypt_ctx *ctx, *batch[4];
+
+	ctx = osdp_crypt_ctx_new();
+	if (ctx == NULL || osdp_crypt_ctx_set_key(ctx, aes_kat_key)) {
+		goto out;
+	}
+	for (i = 0; i < 64; i += 16) {
+		memcpy(buf, aes_kat_plain + i, 16);
+		if (osdp_crypt_ctx_encrypt(ctx, NULL, buf, 16) ||
+		    memcmp(buf, aes_kat_ecb + i, 16) ||
+		    osdp_crypt_ctx_decrypt(ctx, NULL, buf, 16) ||
+		    memcmp(buf, aes_kat_plain + i, 16)) {
+			goto out;
+		}
+	}
+
+	memcpy(buf, aes_kat_plain, 64);
+	memcpy(iv, aes_kat_iv, 16);
+	if (osdp_crypt_ctx_encrypt(ctx, iv, buf, 64) ||
+	    memcmp(buf, aes_kat_cbc, 64)) {
+		goto out;
+	}
+	memcpy(iv, aes_kat_iv, 16);
+	if (osdp_crypt_ctx_decrypt(ctx, iv, buf, 64) ||
+	    memcmp(buf, aes_kat_plain, 64)) {
+		goto out;
+	}
+
+	/* the same key in every lane of the batched cipher */
+	memcpy(buf, aes_kat_plain, 64);
+	for (i = 0; i < 4; i++) {
+		batch[i] = ctx;
+		blocks[i] = buf + i * 16;
+	}
+	if (osdp_crypt_ctx_encrypt_batch(batch, blocks, 4) ||
+	    memcmp(buf, aes_kat_ecb, 64)) {
+		goto out;
+	}
+	rc = 0;
+out:
+	osdp_crypt_ctx_free(ctx);
+	return rc;
+}
+
+int test_aes_known_answer(struct osdp *ctx)
+{
+	ARG_UNUSED(ctx);
+
+	printf(SUB_1 "Testing AES known answers -- ");
+	if (test_aes_kat_oneshot()) {
+		printf("failed! osdp_encrypt/osdp_decrypt\n");
+		return -1;
+	}
+	if (test_aes_kat_ctx()) {
+		printf("failed! osdp_crypt_ctx ops\n");
+		return -1;
+	}
+	printf("success!\n");
+	return 0;
+}
+
+int test_cp_sc_ccrypt_batch(struct osdp *ctx)
+{
+	int i, rc = -1, results[10];
+	struct osdp_pd *pds[10], *ref = GET_CURRENT_PD(ctx);
+	struct osdp_pd pd[10], ref_pd[10];
+
+	printf(SUB_1 "Testing osdp_sc_ccrypt_batch -- ");
+	memset(pd, 0, sizeof(pd));
+	memset(ref_pd, 0, sizeof(ref_pd));
+	for (i = 0; i < 10; i++) {
+		ref_pd[i].logger = ref->logger;
+		osdp_fill_random(ref_pd[i].sc.scbk, 16);
+		osdp_fill_random(ref_pd[i].sc.cp_random, 8);
+		osdp_fill_random(ref_pd[i].sc.pd_random, 8);
+		if (osdp_compute_session_keys(&ref_pd[i]) ||
+		    osdp_compute_pd_cryptogram(&ref_pd[i]) ||
+		    osdp_compute_cp_cryptogram(&ref_pd[i])) {
+			printf("failed! reference handshake\n");
+			goto out;
+		}
+		pd[i].logger = ref->logger;
+		memcpy(&pd[i].sc, &ref_pd[i].sc, sizeof(pd[i].sc));
+		pd[i].sc.ctx_enc = NULL;
+		pd[i].sc.ctx_mac1 = NULL;
+		pd[i].sc.ctx_mac2 = NULL;
+		memset(pd[i].sc.cp_cryptogram, 0, 16);
+		if (i & 1) {
+			pd[i].sc.pd_cryptogram[i] ^= 0x01;
+		}
+		pds[i] = &pd[i];
+	}
+
+	/* spans more than one OSDP_SC_BATCH_SIZE chunk */
+	osdp_sc_ccrypt_batch(pds, results, 10);
+	for (i = 0; i < 10; i++) {
+		if (results[i] != ((i & 1) ? -2 : 0)) {
+			printf("failed! PD-%d result %d\n", i, results[i]);
+			goto out;
+		}
+		if (!(i & 1) && memcmp(pd[i].sc.cp_cryptogram,
+				       ref_pd[i].sc.cp_cryptogram, 16)) {
+			printf("failed! PD-%d cp_cryptogram mismatch\n", i);
+			goto out;
+		}
+	}
+	printf("success!\n");
+	rc = 0;
+out:
+	for (i = 0; i < 10; i++) {
+		osdp_sc_teardown(&pd[i]);
+		osdp_sc_teardown(&ref_pd[i]);
+	}
+	return rc;
+}
+
+int test_sc_random_fork(struct osdp *ctx)
+{
+	pid_t pid;
+	int status, fds[2];
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	uint8_t parent[16], child[16];
+
+	printf(SUB_1 "Testing osdp_sc_random across fork -- ");
+
+	/* leave bytes in the pool for the child to inherit */
+	osdp_sc_random(pd, parent, 1);
+	if (pipe(fds)) {
+		printf("failed! pipe\n");
+		return -1;
+	}
+	pid = fork();
+	if (pid < 0) {
+		printf("failed! fork\n");
+		return -1;
+	}
+	if (pid == 0) {
+		osdp_sc_random(pd, child, sizeof(child));
+		_exit(write(fds[1], child, sizeof(child)) != sizeof(child));
+	}
+	osdp_sc_random(pd, parent, sizeof(parent));
+	close(fds[1]);
+	if (read(fds[0], child, sizeof(child)) != sizeof(child) ||
+	    waitpid(pid, &status, 0) != pid || status != 0) {
+		close(fds[0]);
+		printf("failed! child\n");
+		return -1;
+	}
+	close(fds[0]);
+	if (memcmp(parent, child, sizeof(parent)) == 0) {
+		printf("failed! child replayed the parent's bytes\n");
+		return -1;
+	}
+	printf("success!\n");
+	return 0;
+}
+
+#ifdef CONFIG_OSDP_SC_WORKER
+
+static int test_sc_worker_ccrypt(struct osdp_pd *pd)
+{
+	if (osdp_compute_session_keys(pd) ||
+	    osdp_verify_pd_cryptogram(pd) ||
+	    osdp_compute_cp_cryptogram(pd)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int test_sc_worker_wait(struct osdp_pd *pd, int *result)
+{
+	int i, rc;
+
+	for (i = 0; i < 100; i++) {
+		rc = osdp_sc_worker_poll(pd, result);
+		if (rc != 1) {
+			return rc;
+		}
+		usleep(10 * 1000);
+	}
+	return -1;
+}
+
+int test_sc_worker_handshake(struct osdp *ctx)
+{
+	int result = -1, rc = -1;
+	struct osdp_pd ref, *pd = GET_CURRENT_PD(ctx);
+
+	printf(SUB_1 "Testing SC handshake on the crypto worker -- ");
+	memset(&ref, 0, sizeof(ref));
+	ref.logger = pd->logger;
+	osdp_fill_random(ref.sc.scbk, 16);
+	osdp_fill_random(ref.sc.cp_random, 8);
+	osdp_fill_random(ref.sc.pd_random, 8);
+	if (osdp_compute_session_keys(&ref) ||
+	    osdp_compute_pd_cryptogram(&ref) ||
+	    osdp_compute_cp_cryptogram(&ref)) {
+		printf("failed! reference handshake\n");
+		goto out;
+	}
+	memcpy(pd->sc.scbk, ref.sc.scbk, 16);
+	memcpy(pd->sc.cp_random, ref.sc.cp_random, 8);
+	memcpy(pd->sc.pd_random, ref.sc.pd_random, 8);
+	memcpy(pd->sc.pd_cryptogram, ref.sc.pd_cryptogram, 16);
+
+	if (osdp_sc_worker_submit(pd, test_sc_worker_ccrypt)) {
+		printf("failed! submit\n");
+		goto out;
+	}
+	if (test_sc_worker_wait(pd, &result) || result != 0) {
+		printf("failed! result %d\n", result);
+		goto out;
+	}
+	if (memcmp(pd->sc.cp_cryptogram, ref.sc.cp_cryptogram, 16)) {
+		printf("failed! cp_cryptogram mismatch\n");
+		goto out;
+	}
+	/* the result is handed out only once */
+	if (osdp_sc_worker_poll(pd, &result) != -1) {
+		printf("failed! job still around\n");
+		goto out;
+	}
+	printf("success!\n");
+	rc = 0;
+out:
+	osdp_sc_teardown(pd);
+	osdp_sc_teardown(&ref);
+	memset(&pd->sc, 0, sizeof(pd->sc));
+	return rc;
+}
+
+static volatile bool sc_worker_job_done;
+
+static int test_sc_worker_slow_job(struct osdp_pd *pd)
+{
+	ARG_UNUSED(pd);
+	usleep(200 * 1000);
+	sc_worker_job_done = true;
+	return 0;
+}
+
+static bool test_sc_worker_teardown(struct test *t)
+{
+	osdp_t *ctx;
+	osdp_pd_info_t info = {
+		.address = 101,
+		.baud_rate = 9600,
+	};
+
+	osdp_logger_init("osdp::cp", t->loglevel, NULL);
+	ctx = osdp_cp_setup(1, &info);
+	if (ctx == NULL) {
+		printf(SUB_1 "init failed!\n");
+		return false;
+	}
+
+	printf(SUB_1 "Testing teardown with a SC job in flight -- ");
+	sc_worker_job_done = false;
+	if (osdp_sc_worker_submit(osdp_to_pd(ctx, 0),
+				  test_sc_worker_slow_job)) {
+		printf("failed! submit\n");
+		osdp_cp_teardown(ctx);
+		return false;
+	}
+
+	/* the worker finishes the job before the PD goes away */
+	osdp_cp_teardown(ctx);
+	if (!sc_worker_job_done) {
+		printf("failed! job dropped\n");
+		return false;
+	}
+	printf("success!\n");
+	return true;
+}
+
+#endif /* CONFIG_OSDP_SC_WORKER */
+
+static int test_phy_mock_send(void *data, uint8_t *buf, int len)
+{
+	ARG_UNUSED(data);
+	ARG_UNUSED(buf);
+	return len;
+}
+
+static int test_phy_flush_calls;
+
+static void test_phy_mock_flush(void *data)
+{
+	ARG_UNUSED(data);
+	test_phy_flush_calls++;
+}
+
+static int test_phy_send_poll(struct osdp_pd *p)
+{
+	uint8_t buf[128];
+	int len;
+
+	p->cmd_id = CMD_POLL;
+	if ((len = osdp_phy_packet_init(p, buf, sizeof(buf))) < 0) {
+		return -1;
+	}
+	buf[len++] = CMD_POLL;
+	return osdp_phy_send_packet(p, buf, len, sizeof(buf));
+}
+
+int test_phy_rx_flush(struct osdp *ctx)
+{
+	int rc = -1;
+	uint8_t b, junk[5] = { 0x53, 0x01, 0x02, 0x03, 0x04 };
+	uint32_t discard_bytes, flush_count, d0, f0;
+	struct osdp_pd *p = GET_CURRENT_PD(ctx);
+
+	printf(SUB_1 "Testing RX flush accounting -- ");
+
+	p->channel.send = test_phy_mock_send;
+	p->channel.flush = test_phy_mock_flush;
+	test_phy_flush_calls = 0;
+	while (osdp_rb_pop(&p->rx->rb, &b) == 0)
+		; /* leftovers from the decode tests */
+	osdp_get_rx_stats(ctx, 0, &d0, &f0);
+
+	/* sends don't flush unless the app asked for it */
+	if (test_phy_send_poll(p) || test_phy_flush_calls != 0) {
+		printf("failed! flushed on send\n");
+		goto out;
+	}
+
+	/* packet_buf holds the command being sent; that isn't RX data */
+	SET_FLAG(p, OSDP_FLAG_FLUSH_RX_ON_SEND);
+	p->rx->packet_buf_len = 8;
+	if (test_phy_send_poll(p) || test_phy_flush_calls != 1) {
+		printf("failed! not flushed on send\n");
+		goto out;
+	}
+	osdp_get_rx_stats(ctx, 0, &discard_bytes, &flush_count);
+	if (discard_bytes != d0 || flush_count != f0 + 1) {
+		printf("failed! send discarded %u bytes\n", discard_bytes - d0);
+		goto out;
+	}
+	CLEAR_FLAG(p, OSDP_FLAG_FLUSH_RX_ON_SEND);
+
+	/* an error reset drops what was already pulled in and counts it */
+	osdp_rb_push_buf(&p->rx->rb, junk, sizeof(junk));
+	p->rx->packet_buf_len = 3;
+	osdp_phy_state_reset(p, true);
+	osdp_get_rx_stats(ctx, 0, &discard_bytes, &flush_count);
+	if (test_phy_flush_calls != 2 || osdp_rb_pop(&p->rx->rb, &b) == 0 ||
+	    flush_count != f0 + 2 || discard_bytes != d0 + sizeof(junk) + 3) {
+		printf("failed! flushes:%d/%u discard:%u\n", test_phy_flush_calls,
+		       flush_count - f0, discard_bytes - d0);
+		goto out;
+	}
+	printf("success!\n");
+	rc = 0;
+out:
+	CLEAR_FLAG(p, OSDP_FLAG_FLUSH_RX_ON_SEND);
+	p->channel.send = NULL;
+	p->channel.flush = NULL;
+	return rc;
+}
+
+static int test_phy_reply_frame(uint8_t *buf, int address, uint8_t reply_id)
+{
+	int len = 0, start;
+	uint16_t crc;
+
+#ifndef CONFIG_OSDP_SKIP_MARK_BYTE
+	buf[len++] = 0xff;
+#endif
+	start = len;
+	buf[len++] = 0x53;
+	buf[len++] = (uint8_t)(address | 0x80);
+	buf[len++] = 0x08;
+	buf[len++] = 0x00;
+	buf[len++] = 0x05; /* CRC, sequence 1 */
+	buf[len++] = reply_id;
+	crc = osdp_compute_crc16(buf + start, len - start);
+	buf[len++] = BYTE_0(crc);
+	buf[len++] = BYTE_1(crc);
+	return len;
+}
+
+static bool test_cp_phy_stray_reply(struct test *t)
+{
+	int len;
+	bool result = false;
+	uint8_t *data, frame[16];
+	uint32_t discard_bytes, discard_before, flush_count;
+	osdp_t *ctx;
+	struct osdp_pd *a, *b;
+	osdp_pd_info_t info[2] = {
+		{ .address = 101, .baud_rate = 9600, .channel.id = 1 },
+		{ .address = 102, .baud_rate = 9600, .channel.id = 1 },
+	};
+
+	osdp_logger_init("osdp::cp", t->loglevel, NULL);
+	ctx = osdp_cp_setup(2, info);
+	if (ctx == NULL) {
+		printf(SUB_1 "init failed!\n");
+		return false;
+	}
+	a = osdp_to_pd(ctx, 0);
+	b = osdp_to_pd(ctx, 1);
+
+	printf(SUB_1 "Testing late reply on a shared channel -- ");
+
+	/* A holds the channel; B's reply to a timed out command shows up */
+	a->seq_number = 1;
+	osdp_get_rx_stats(ctx, 1, &discard_before, &flush_count);
+	len = test_phy_reply_frame(frame, b->address, REPLY_ACK);
+	osdp_rb_push_buf(&a->rx->rb, frame, len);
+	len = test_phy_reply_frame(frame, a->address, REPLY_ACK);
+	osdp_rb_push_buf(&a->rx->rb, frame, len);
+
+	if (osdp_phy_check_packet(a) != OSDP_ERR_PKT_WAIT) {
+		printf("failed! B's reply not skipped\n");
+		goto out;
+	}
+	if (osdp_phy_check_packet(a) != OSDP_ERR_PKT_NONE ||
+	    osdp_phy_decode_packet(a, &data) != 1 || data[0] != REPLY_ACK) {
+		printf("failed! A's reply lost\n");
+		goto out;
+	}
+	osdp_get_rx_stats(ctx, 1, &discard_bytes, &flush_count);
+	if (b->rx_late_replies != 1 || a->rx_late_replies != 0 ||
+	    discard_bytes <= discard_before) {
+		printf("failed! late:%u/%u discard:%u\n", a->rx_late_replies,
+		       b->rx_late_replies, discard_bytes);
+		goto out;
+	}
+	printf("success!\n");
+	result = true;
+out:
+	osdp_cp_teardown(ctx);
+	return result;
+}
+
 int test_cp_phy_setup(struct test *t)
 {
 	/* mock application data */
@@ -174,8 +686,21 @@ void run_cp_phy_tests(struct test *t)
 	DO_TEST(t, test_cp_build_packet_id);
 	DO_TEST(t, test_phy_decode_packet_ack);
 	DO_TEST(t, test_phy_decode_packet_ignore_leading_mark_bytes);
+	DO_TEST(t, test_aes_known_answer);
+	DO_TEST(t, test_cp_sc_ccrypt_batch);
+	DO_TEST(t, test_sc_random_fork);
+#ifdef CONFIG_OSDP_SC_WORKER
+	DO_TEST(t, test_sc_worker_handshake);
+#endif
+	DO_TEST(t, test_phy_rx_flush);
 
 	printf(SUB_1 "cp_phy tests %s\n", t->failure ? "succeeded" : "failed");
 
 	test_cp_phy_teardown(t);
+
+	TEST_REPORT(t, test_cp_phy_stray_reply(t));
+
+#ifdef CONFIG_OSDP_SC_WORKER
+	TEST_REPORT(t, test_sc_worker_teardown(t));
+#endif
 }
@@ -8,6 +8,7 @@
 
 #include <osdp.h>
 #include "test.h"
+#include "osdp_file.h"
 
 #define SEND_FILE "test-file-tx-send.txt"
 #define REC_FILE "test-file-tx-receive.txt"
@@ -19,6 +20,7 @@ struct test_data {
 	bool is_cp;
 	int file_id;
 	int fd;
+	int min_offset;
 };
 
 struct test_data sender_data;
@@ -80,6 +82,8 @@ static int test_fops_write(void *arg, const void *buf, int size, int offset)
 	}
 
 	ret = pwrite(t->fd, buf, (size_t)size, (size_t)offset);
+	if (offset < t->min_offset)
+		t->min_offset = offset;
 
 	return (int)ret;
 }
@@ -119,6 +123,28 @@ static int test_create_file()
 	return 0;
 }
 
+static int test_create_partial_rec_file(int reps)
+{
+	int fd, rc, i;
+
+	fd = open(REC_FILE, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror(SUB_1 "receiver_open: partial file open failed");
+		return -1;
+	}
+
+	for (i = 0; i < reps; i++) {
+		rc = write(fd, FILE_CONTENT_CHUNK, FILE_CONTENT_CHUNK_LEN);
+		if (rc != FILE_CONTENT_CHUNK_LEN) {
+			printf(SUB_1 "partial file write failed at chunk%i\n", i);
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
 static bool test_check_rec_file()
 {
 	int i, rc, rec_fd;
@@ -177,66 +203,74 @@ static int cmd_callback(void *arg, struct osdp_cmd *cmd)
 	return 0;
 }
 
-void run_file_tx_tests(struct test *t, bool line_noise)
-{
-	bool result = false;
-	int rc, size, offset;
-	osdp_t *cp_ctx, *pd_ctx;
-	int cp_runner = -1, pd_runner = -1;
-	uint8_t status = 0;
+struct file_tx_fixture {
+	osdp_t *cp_ctx;
+	osdp_t *pd_ctx;
+	int cp_runner;
+	int pd_runner;
+};
 
-	sender_data.is_cp = true;
-	struct osdp_file_ops sender_ops = {
-		.arg = (void *)&sender_data,
-		.open = test_fops_open,
-		.read = test_fops_read,
-		.write = test_fops_write,
-		.close = test_fops_close
-	};
+static struct osdp_file_ops sender_ops = {
+	.arg = (void *)&sender_data,
+	.open = test_fops_open,
+	.read = test_fops_read,
+	.write = test_fops_write,
+	.close = test_fops_close
+};
 
-	struct osdp_file_ops receiver_ops = {
-		.arg = (void *)&receiver_data,
-		.open = test_fops_open,
-		.read = test_fops_read,
-		.write = test_fops_write,
-		.close = test_fops_close
-	};
+static struct osdp_file_ops receiver_ops = {
+	.arg = (void *)&receiver_data,
+	.open = test_fops_open,
+	.read = test_fops_read,
+	.write = test_fops_write,
+	.close = test_fops_close
+};
 
-	printf("\nBegin file transfer test\n");
+static int test_file_tx_setup(struct test *t, struct file_tx_fixture *fx)
+{
+	memset(fx, 0, sizeof(*fx));
+	fx->cp_runner = fx->pd_runner = -1;
+	sender_data.is_cp = true;
 
 	printf(SUB_1 "setting up OSDP devices\n");
 
-	if (test_setup_devices(t, &cp_ctx, &pd_ctx)) {
+	if (test_setup_devices(t, &fx->cp_ctx, &fx->pd_ctx)) {
 		printf(SUB_1 "Failed to setup devices!\n");
-		goto error;
+		return -1;
 	}
 
 	if (test_create_file())
-		goto error;
+		return -1;
 
-	osdp_cp_set_event_callback(cp_ctx, event_callback, NULL);
-	osdp_pd_set_command_callback(pd_ctx, cmd_callback, NULL);
+	osdp_file_register_ops(fx->cp_ctx, 0, &sender_ops);
+	osdp_file_register_ops(fx->pd_ctx, 0, &receiver_ops);
+	return 0;
+}
 
-	osdp_file_register_ops(cp_ctx, 0, &sender_ops);
-	osdp_file_register_ops(pd_ctx, 0, &receiver_ops);
+/* Returns the file size once the whole file has been sent; -1 on errors */
+static int test_file_tx_run(struct file_tx_fixture *fx, struct osdp_cmd *cmd,
+			    bool line_noise)
+{
+	int rc, size, offset;
+	uint8_t status = 0;
 
 	printf(SUB_1 "starting async runners\n");
 
-	cp_runner = async_runner_start(cp_ctx, osdp_cp_refresh);
-	pd_runner = async_runner_start(pd_ctx, osdp_pd_refresh);
+	fx->cp_runner = async_runner_start(fx->cp_ctx, osdp_cp_refresh);
+	fx->pd_runner = async_runner_start(fx->pd_ctx, osdp_pd_refresh);
 
-	if (cp_runner < 0 || pd_runner < 0) {
+	if (fx->cp_runner < 0 || fx->pd_runner < 0) {
 		printf(SUB_1 "Failed to created CP/PD runners\n");
-		goto error;
+		return -1;
 	}
 
 	rc = 0;
 	while (1) {
 		if (rc > 10) {
 			printf(SUB_1 "PD failed to come online");
-			goto error;
+			return -1;
 		}
-		osdp_get_status_mask(cp_ctx, &status);
+		osdp_get_status_mask(fx->cp_ctx, &status);
 		if (status & 1)
 			break;
 		usleep(1000 * 1000);
@@ -245,16 +279,9 @@ void run_file_tx_tests(struct test *t, bool line_noise)
 
 	printf(SUB_1 "initiating file tx command\n");
 
-	struct osdp_cmd cmd = {
-		.id = OSDP_CMD_FILE_TX,
-		.file_tx = {
-			.id = 1,
-			.flags = 0,
-		}
-	};
-	if (osdp_cp_send_command(cp_ctx, 0, &cmd)) {
+	if (osdp_cp_send_command(fx->cp_ctx, 0, cmd)) {
 		printf(SUB_1 "Failed to initiate file tx command\n");
-		goto error;
+		return -1;
 	}
 
 	printf(SUB_1 "monitoring file tx progress\n");
@@ -263,27 +290,972 @@ void run_file_tx_tests(struct test *t, bool line_noise)
 
 	while (1) {
 		usleep(100 * 1000);
-		rc = osdp_get_file_tx_status(cp_ctx, 0, &size, &offset);
+		rc = osdp_get_file_tx_status(fx->cp_ctx, 0, &size, &offset);
 		if (rc < 0) {
 			printf(SUB_1 "status query failed!\n");
 			if (line_noise)
 				print_line_noise_stats();
-			goto error;
+			return -1;
 		}
 		if (offset == size)
 			break;
 	}
+	return size;
+}
+
+static void test_file_tx_teardown(struct file_tx_fixture *fx)
+{
+	disable_line_noise();
+	if (fx->cp_runner >= 0)
+		async_runner_stop(fx->cp_runner);
+	if (fx->pd_runner >= 0)
+		async_runner_stop(fx->pd_runner);
+	if (fx->cp_ctx)
+		osdp_cp_teardown(fx->cp_ctx);
+	if (fx->pd_ctx)
+		osdp_pd_teardown(fx->pd_ctx);
+}
+
+void run_file_tx_tests(struct test *t, bool line_noise)
+{
+	bool result = false;
+	struct file_tx_fixture fx;
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_FILE_TX,
+		.file_tx = {
+			.id = 1,
+			.flags = 0,
+		}
+	};
+
+	printf("\nBegin file transfer test\n");
+
+	if (test_file_tx_setup(t, &fx))
+		goto error;
+
+	osdp_cp_set_event_callback(fx.cp_ctx, event_callback, NULL);
+	osdp_pd_set_command_callback(fx.pd_ctx, cmd_callback, NULL);
+
+	if (test_file_tx_run(&fx, &cmd, line_noise) < 0)
+		goto error;
 
 	result = test_check_rec_file();
 	printf(SUB_1 "file transfer test %s\n",
 	       result ? "succeeded" : "failed");
 error:
-	disable_line_noise();
-	async_runner_stop(cp_runner);
-	async_runner_stop(pd_runner);
-
-	osdp_cp_teardown(cp_ctx);
-	osdp_pd_teardown(pd_ctx);
+	test_file_tx_teardown(&fx);
 
 	TEST_REPORT(t, result);
 }
+
+#define TEST_CHUNK_FILE_SIZE (64 * 1024)
+
+extern int (*test_cp_build_and_send_packet)(struct osdp_pd *pd);
+
+static int chunk_sent_len;
+
+static int chunk_mock_send(void *data, uint8_t *buf, int len)
+{
+	ARG_UNUSED(data);
+	ARG_UNUSED(buf);
+	chunk_sent_len = len;
+	return len;
+}
+
+static int chunk_mock_receive(void *data, uint8_t *buf, int len)
+{
+	ARG_UNUSED(data);
+	ARG_UNUSED(buf);
+	ARG_UNUSED(len);
+	return 0;
+}
+
+static int chunk_fops_open(void *arg, int file_id, int *size)
+{
+	ARG_UNUSED(arg);
+	ARG_UNUSED(file_id);
+	*size = TEST_CHUNK_FILE_SIZE;
+	return 0;
+}
+
+static int chunk_fops_read(void *arg, void *buf, int size, int offset)
+{
+	int i;
+	uint8_t *p = buf;
+
+	ARG_UNUSED(arg);
+	for (i = 0; i < size; i++) {
+		p[i] = (uint8_t)(offset + i);
+	}
+	return size;
+}
+
+static int chunk_fops_write(void *arg, const void *buf, int size, int offset)
+{
+	ARG_UNUSED(arg);
+	ARG_UNUSED(buf);
+	ARG_UNUSED(offset);
+	return size;
+}
+
+static int chunk_fops_close(void *arg)
+{
+	ARG_UNUSED(arg);
+	return 0;
+}
+
+static struct osdp_file_ops chunk_ops = {
+	.open = chunk_fops_open,
+	.read = chunk_fops_read,
+	.write = chunk_fops_write,
+	.close = chunk_fops_close,
+};
+
+/* Send the next chunk; the PD acks it asking for packets of rx_size */
+static int test_chunk_send(struct osdp_pd *pd, int rx_size, int exp_len)
+{
+	int len = 0;
+	uint8_t stat[sizeof(struct osdp_cmd_file_stat)];
+
+	pd->cmd_id = CMD_FILETRANSFER;
+	chunk_sent_len = 0;
+	if (test_cp_build_and_send_packet(pd) || chunk_sent_len != exp_len) {
+		printf("failed! packet len:%d exp:%d\n",
+		       chunk_sent_len, exp_len);
+		return -1;
+	}
+
+	U8_TO_BYTES_LE(0x01, stat, len);
+	U16_TO_BYTES_LE(0, stat, len);
+	U16_TO_BYTES_LE(0, stat, len);
+	U16_TO_BYTES_LE(rx_size, stat, len);
+	return osdp_file_cmd_stat_decode(pd, stat, len);
+}
+
+static int test_file_tx_chunk_size(struct osdp *ctx)
+{
+	struct osdp_pd *pd = osdp_to_pd(ctx, 0);
+	int buf_size = get_tx_buf_size(pd);
+
+	printf(SUB_1 "Testing file chunk sizing -- ");
+
+	if (osdp_file_register_ops(ctx, 0, &chunk_ops) ||
+	    osdp_file_tx_command(pd, 1, 0, 0)) {
+		printf("failed! transfer not started\n");
+		return -1;
+	}
+
+	/* plain text chunks fill the packet to the last byte */
+	if (test_chunk_send(pd, 0, buf_size) ||
+	    test_chunk_send(pd, 128, buf_size) ||
+	    test_chunk_send(pd, 0, 128)) {
+		return -1;
+	}
+
+	/**
+	 * With SC, the encrypted data is padded to the AES block size so the
+	 * packet is full when the mark, header, SCB, command ID, MAC and CRC
+	 * (8 + 1 + 4 + 2) plus whole blocks add up to the buffer size. With
+	 * 128 bytes, the packet comes out one byte short as another block
+	 * doesn't fit.
+	 */
+	osdp_fill_random(pd->sc.scbk, 16);
+	osdp_fill_random(pd->sc.cp_random, 8);
+	osdp_fill_random(pd->sc.pd_random, 8);
+	if (osdp_compute_session_keys(pd)) {
+		printf("failed! session keys\n");
+		return -1;
+	}
+	sc_activate(pd);
+	if (test_chunk_send(pd, 8 + 1 + 4 + 2 + 15 * 16, 127) ||
+	    test_chunk_send(pd, 0, 8 + 1 + 4 + 2 + 15 * 16)) {
+		return -1;
+	}
+	sc_deactivate(pd);
+
+	osdp_file_tx_abort(pd);
+	printf("success!\n");
+	return 0;
+}
+
+static bool test_file_rx_size_reset(struct test *t)
+{
+	int len = 0;
+	bool result = false;
+	osdp_t *ctx;
+	struct osdp_pd *pd;
+	uint8_t buf[sizeof(struct osdp_cmd_file_xfer) + 64];
+	osdp_pd_info_t info = {
+		.address = 101,
+		.baud_rate = 9600,
+		.channel.send = chunk_mock_send,
+		.channel.recv = chunk_mock_receive,
+	};
+
+	printf(SUB_1 "Testing PD rx_size reset -- ");
+
+	osdp_logger_init("osdp::pd", t->loglevel, NULL);
+	ctx = osdp_pd_setup(&info);
+	if (ctx == NULL) {
+		printf("failed! init\n");
+		return false;
+	}
+	pd = osdp_to_pd(ctx, 0);
+	if (osdp_file_register_ops(ctx, 0, &chunk_ops) ||
+	    osdp_file_set_rx_size(ctx, 0, 128)) {
+		printf("failed! file setup\n");
+		goto out;
+	}
+
+	/* a one chunk file; the rx_size goes out with its FTSTAT */
+	U8_TO_BYTES_LE(1, buf, len);
+	U32_TO_BYTES_LE(64, buf, len);
+	U32_TO_BYTES_LE(0, buf, len);
+	U16_TO_BYTES_LE(64, buf, len);
+	len += 64;
+	if (osdp_file_cmd_tx_decode(pd, buf, len) ||
+	    osdp_file_cmd_stat_build(pd, buf, sizeof(buf)) < 0) {
+		printf("failed! chunk not taken\n");
+		goto out;
+	}
+	if ((buf[5] | (buf[6] << 8)) != 128) {
+		printf("failed! FTSTAT rx_size %d\n", buf[5] | (buf[6] << 8));
+		goto out;
+	}
+
+	/* and is only good for that transfer */
+	if (TO_FILE(pd)->rx_size != 0) {
+		printf("failed! rx_size not reset\n");
+		goto out;
+	}
+	printf("success!\n");
+	result = true;
+out:
+	osdp_pd_teardown(ctx);
+	return result;
+}
+
+static int test_file_chunk_cp_setup(struct test *t)
+{
+	osdp_pd_info_t info = {
+		.address = 101,
+		.baud_rate = 9600,
+		.channel.send = chunk_mock_send,
+		.channel.recv = chunk_mock_receive,
+	};
+
+	osdp_logger_init("osdp::cp", t->loglevel, NULL);
+	t->mock_data = osdp_cp_setup(1, &info);
+	if (t->mock_data == NULL) {
+		printf(SUB_1 "init failed!\n");
+		return -1;
+	}
+	return 0;
+}
+
+void run_file_tx_chunk_tests(struct test *t)
+{
+	printf("\nBegin file transfer chunk tests\n");
+
+	if (test_file_chunk_cp_setup(t))
+		return;
+
+	DO_TEST(t, test_file_tx_chunk_size);
+
+	osdp_cp_teardown(t->mock_data);
+
+	TEST_REPORT(t, test_file_rx_size_reset(t));
+}
+
+static struct osdp_file_checkpoint last_checkpoint;
+static bool early_checkpoint;
+
+static int checkpoint_callback(void *arg, int pd,
+			       const struct osdp_file_checkpoint *ckpt)
+{
+	ARG_UNUSED(arg);
+	ARG_UNUSED(pd);
+	last_checkpoint = *ckpt;
+	/* only offsets the PD has acked (so, written) may be reported */
+	if (receiver_data.min_offset == INT32_MAX)
+		early_checkpoint = true;
+	return 0;
+}
+
+static int resume_cmd_callback(void *arg, struct osdp_cmd *cmd)
+{
+	int have = *(int *)arg;
+
+	if (cmd->id == OSDP_CMD_FILE_TX &&
+	    (cmd->file_tx.flags & OSDP_CMD_FILE_TX_FLAG_RESUME)) {
+		printf(SUB_1 "PD asked to resume at offset %u\n",
+		       cmd->file_tx.offset);
+		return (int)cmd->file_tx.offset <= have ? 0 : -1;
+	}
+	return 0;
+}
+
+static bool test_file_tx_resume(struct test *t, int resume_at, int have)
+{
+	bool result = false;
+	int size;
+	struct file_tx_fixture fx;
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_FILE_TX,
+		.file_tx = {
+			.id = 1,
+			.flags = OSDP_CMD_FILE_TX_FLAG_RESUME,
+			.offset = (uint32_t)resume_at,
+		}
+	};
+
+	receiver_data.min_offset = INT32_MAX;
+	memset(&last_checkpoint, 0, sizeof(last_checkpoint));
+	early_checkpoint = false;
+
+	if (test_file_tx_setup(t, &fx) ||
+	    test_create_partial_rec_file(have / FILE_CONTENT_CHUNK_LEN))
+		goto error;
+
+	osdp_file_set_checkpoint_callback(fx.cp_ctx, checkpoint_callback, NULL);
+	osdp_pd_set_command_callback(fx.pd_ctx, resume_cmd_callback, &have);
+
+	printf(SUB_1 "resuming file tx at offset %d\n", resume_at);
+
+	size = test_file_tx_run(&fx, &cmd, false);
+	if (size < 0)
+		goto error;
+
+	/* PD refuses to resume past what it has; CP must start over */
+	if (resume_at > have)
+		resume_at = 0;
+
+	if (receiver_data.min_offset != resume_at) {
+		printf(SUB_1 "PD wrote at offset %d; expected %d\n",
+		       receiver_data.min_offset, resume_at);
+		goto error;
+	}
+
+	if (early_checkpoint) {
+		printf(SUB_1 "checkpoint reported for a rejected chunk\n");
+		goto error;
+	}
+
+	if (last_checkpoint.file_id != 1 ||
+	    last_checkpoint.offset != last_checkpoint.size ||
+	    (int)last_checkpoint.size != size) {
+		printf(SUB_1 "bad final checkpoint %u/%u\n",
+		       last_checkpoint.offset, last_checkpoint.size);
+		goto error;
+	}
+
+	result = test_check_rec_file();
+	printf(SUB_1 "file transfer resume test %s\n",
+	       result ? "succeeded" : "failed");
+error:
+	test_file_tx_teardown(&fx);
+
+	return result;
+}
+
+void run_file_tx_resume_tests(struct test *t)
+{
+	int size = FILE_CONTENT_REPS * FILE_CONTENT_CHUNK_LEN;
+	int have = (FILE_CONTENT_REPS / 2) * FILE_CONTENT_CHUNK_LEN;
+
+	printf("\nBegin file transfer resume test\n");
+	TEST_REPORT(t, test_file_tx_resume(t, have, have));
+
+	printf("\nBegin file transfer rejected resume test\n");
+	TEST_REPORT(t, test_file_tx_resume(t, size - FILE_CONTENT_CHUNK_LEN,
+					   0));
+}
+
+#define TEST_ROLLOUT_NUM_PD (OSDP_FILE_ROLLOUT_CHANNEL_MAX + 1)
+
+static int rollout_fops_open(void *arg, int file_id, int *size)
+{
+	ARG_UNUSED(arg);
+	ARG_UNUSED(file_id);
+	*size = FILE_CONTENT_REPS * FILE_CONTENT_CHUNK_LEN;
+	return 0;
+}
+
+static int rollout_fops_close(void *arg)
+{
+	ARG_UNUSED(arg);
+	return 0;
+}
+
+static int rollout_mock_send(void *data, uint8_t *buf, int len)
+{
+	ARG_UNUSED(data);
+	ARG_UNUSED(buf);
+	return len;
+}
+
+static int rollout_mock_receive(void *data, uint8_t *buf, int len)
+{
+	ARG_UNUSED(data);
+	ARG_UNUSED(buf);
+	ARG_UNUSED(len);
+	return 0;
+}
+
+static void rollout_set_state(struct osdp *ctx, enum osdp_cp_state_e state)
+{
+	int i;
+
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		osdp_to_pd(ctx, i)->state = state;
+	}
+}
+
+static int test_rollout_start(struct osdp *ctx)
+{
+	int i, active = 0;
+	uint8_t pd_mask[1] = { (1 << TEST_ROLLOUT_NUM_PD) - 1 };
+	struct osdp_file_ops ops = {
+		.open = rollout_fops_open,
+		.close = rollout_fops_close,
+	};
+	struct osdp_file_rollout *r;
+
+	printf(SUB_1 "Testing rollout start -- ");
+
+	if (osdp_file_rollout_start(ctx, pd_mask, 1, &ops)) {
+		printf("failed! rollout not started\n");
+		return -1;
+	}
+	r = ctx->rollout;
+
+	/* nothing starts on PDs that are not online yet */
+	osdp_file_rollout_refresh(ctx);
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		if (r->pd[i].state != OSDP_FILE_ROLLOUT_PENDING) {
+			printf("failed! PD-%d started while offline\n", i);
+			return -1;
+		}
+	}
+
+	/* all PDs share one channel; only so many transfers at a time */
+	rollout_set_state(ctx, OSDP_CP_STATE_ONLINE);
+	osdp_file_rollout_refresh(ctx);
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		if (r->pd[i].state == OSDP_FILE_ROLLOUT_ACTIVE)
+			active++;
+	}
+	if (active != OSDP_FILE_ROLLOUT_CHANNEL_MAX ||
+	    r->pd[NUM_PD(ctx) - 1].state != OSDP_FILE_ROLLOUT_PENDING) {
+		printf("failed! %d transfers active\n", active);
+		return -1;
+	}
+
+	/* rollout transfers slip in a POLL now and then */
+	TO_FILE(osdp_to_pd(ctx, 0))->poll_tstamp =
+		osdp_millis_now() - OSDP_FILE_POLL_INTERVAL_MS - 1;
+	if (osdp_file_tx_get_command(osdp_to_pd(ctx, 0)) != CMD_POLL) {
+		printf("failed! no POLL during rollout\n");
+		return -1;
+	}
+	printf("success!\n");
+	return 0;
+}
+
+static int test_rollout_outage(struct osdp *ctx)
+{
+	int retries;
+	struct osdp_pd *pd = osdp_to_pd(ctx, 0);
+	struct osdp_file_rollout *r = ctx->rollout;
+	struct osdp_file_rollout_pd *p = &r->pd[0];
+
+	printf(SUB_1 "Testing rollout outage accounting -- ");
+
+	/* SC re-keying is not an outage */
+	retries = r->retries;
+	pd->state = OSDP_CP_STATE_SC_CHLNG;
+	osdp_file_rollout_refresh(ctx);
+	pd->state = OSDP_CP_STATE_SC_SCRYPT;
+	osdp_file_rollout_refresh(ctx);
+	if (r->retries != retries || p->offline) {
+		printf("failed! SC handshake counted as an outage\n");
+		return -1;
+	}
+
+	/* one outage is counted once, however long it lasts */
+	pd->state = OSDP_CP_STATE_OFFLINE;
+	osdp_file_rollout_refresh(ctx);
+	pd->state = OSDP_CP_STATE_INIT;
+	osdp_file_rollout_refresh(ctx);
+	pd->state = OSDP_CP_STATE_SC_CHLNG;
+	osdp_file_rollout_refresh(ctx);
+	pd->state = OSDP_CP_STATE_ONLINE;
+	osdp_file_rollout_refresh(ctx);
+	if (r->retries != retries + 1 || p->retries != 1 || p->offline ||
+	    p->state != OSDP_FILE_ROLLOUT_ACTIVE) {
+		printf("failed! retries:%d/%d\n", r->retries, p->retries);
+		return -1;
+	}
+
+	/* progress in between outages resets the count */
+	TO_FILE(pd)->offset = FILE_CONTENT_CHUNK_LEN;
+	pd->state = OSDP_CP_STATE_OFFLINE;
+	osdp_file_rollout_refresh(ctx);
+	pd->state = OSDP_CP_STATE_ONLINE;
+	osdp_file_rollout_refresh(ctx);
+	if (p->retries != 1) {
+		printf("failed! retries:%d after progress\n", p->retries);
+		return -1;
+	}
+
+	/* without progress, give up after too many outages */
+	while (p->state == OSDP_FILE_ROLLOUT_ACTIVE &&
+	       p->retries <= OSDP_FILE_ROLLOUT_RETRY_MAX) {
+		pd->state = OSDP_CP_STATE_OFFLINE;
+		osdp_file_rollout_refresh(ctx);
+		pd->state = OSDP_CP_STATE_ONLINE;
+		osdp_file_rollout_refresh(ctx);
+	}
+	if (p->state != OSDP_FILE_ROLLOUT_FAILED ||
+	    TO_FILE(pd)->state != OSDP_FILE_IDLE) {
+		printf("failed! state:%d retries:%d\n", p->state, p->retries);
+		return -1;
+	}
+	printf("success!\n");
+	return 0;
+}
+
+static int test_rollout_done(struct osdp *ctx)
+{
+	int i;
+	struct osdp_file_rollout *r = ctx->rollout;
+	struct osdp_file_rollout_status status;
+	uint8_t failed_mask[1] = { 0 };
+
+	printf(SUB_1 "Testing rollout completion -- ");
+
+	/* the failed PD frees its slot on the channel for the pending one */
+	osdp_file_rollout_refresh(ctx);
+	for (i = 1; i < NUM_PD(ctx); i++) {
+		if (r->pd[i].state != OSDP_FILE_ROLLOUT_ACTIVE) {
+			printf("failed! PD-%d not active\n", i);
+			return -1;
+		}
+		TO_FILE(osdp_to_pd(ctx, i))->state = OSDP_FILE_DONE;
+	}
+	osdp_file_rollout_refresh(ctx);
+
+	if (osdp_file_rollout_status(ctx, &status, failed_mask) != 0 ||
+	    status.num_pd != NUM_PD(ctx) || status.failed != 1 ||
+	    status.done != NUM_PD(ctx) - 1 || failed_mask[0] != 0x01) {
+		printf("failed! done:%d failed:%d mask:%02x\n",
+		       status.done, status.failed, failed_mask[0]);
+		return -1;
+	}
+
+	/* a transfer outside of a rollout keeps the link to itself */
+	osdp_file_tx_command(osdp_to_pd(ctx, 1), 1, 0, 0);
+	TO_FILE(osdp_to_pd(ctx, 1))->poll_tstamp =
+		osdp_millis_now() - OSDP_FILE_POLL_INTERVAL_MS - 1;
+	if (osdp_file_tx_get_command(osdp_to_pd(ctx, 1)) != CMD_FILETRANSFER) {
+		printf("failed! POLL outside of rollout\n");
+		return -1;
+	}
+	printf("success!\n");
+	return 0;
+}
+
+/* a CP with num_pd PDs on one channel that never answer */
+static int test_file_cp_setup(struct test *t, int num_pd)
+{
+	int i;
+	osdp_pd_info_t info[TEST_ROLLOUT_NUM_PD];
+
+	memset(info, 0, sizeof(info));
+	for (i = 0; i < num_pd; i++) {
+		info[i].address = 101 + i;
+		info[i].baud_rate = 9600;
+		info[i].channel.id = 1;
+		info[i].channel.send = rollout_mock_send;
+		info[i].channel.recv = rollout_mock_receive;
+	}
+
+	osdp_logger_init("osdp::cp", t->loglevel, NULL);
+	t->mock_data = osdp_cp_setup(num_pd, info);
+	if (t->mock_data == NULL) {
+		printf(SUB_1 "init failed!\n");
+		return -1;
+	}
+	return 0;
+}
+
+void run_file_rollout_tests(struct test *t)
+{
+	printf("\nBegin file rollout tests\n");
+
+	if (test_file_cp_setup(t, TEST_ROLLOUT_NUM_PD))
+		return;
+
+	DO_TEST(t, test_rollout_start);
+	DO_TEST(t, test_rollout_outage);
+	DO_TEST(t, test_rollout_done);
+
+	osdp_cp_teardown(t->mock_data);
+}
+
+#ifdef CONFIG_OSDP_FILE_READ_AHEAD
+
+#define TEST_RA_CHUNK_BUF_SIZE (128)
+#define TEST_RA_HDR_SIZE       sizeof(struct osdp_cmd_file_xfer)
+
+static int ra_fail_reads;
+
+static int ra_fops_read(void *arg, void *buf, int size, int offset)
+{
+	int i;
+	uint8_t *p = buf;
+
+	ARG_UNUSED(arg);
+	if (ra_fail_reads > 0) {
+		ra_fail_reads--;
+		return -1;
+	}
+	for (i = 0; i < size; i++) {
+		p[i] = (uint8_t)(offset + i);
+	}
+	return size;
+}
+
+static int test_ra_build(struct osdp_pd *pd, int exp_len)
+{
+	int i, len;
+	uint8_t buf[TEST_RA_CHUNK_BUF_SIZE];
+
+	len = osdp_file_cmd_tx_build(pd, buf, sizeof(buf));
+	if (len != exp_len) {
+		printf("failed! chunk len:%d exp:%d\n", len, exp_len);
+		return -1;
+	}
+	for (i = TEST_RA_HDR_SIZE; i < len; i++) {
+		if (buf[i] != (uint8_t)(TO_FILE(pd)->offset + i -
+					TEST_RA_HDR_SIZE)) {
+			printf("failed! data mismatch at %d\n", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int test_file_ra_error(struct osdp *ctx)
+{
+	int ref_len;
+	uint8_t buf[TEST_RA_CHUNK_BUF_SIZE];
+	struct osdp_pd *pd = osdp_to_pd(ctx, 0);
+	struct osdp_file_ops ops = {
+		.open = rollout_fops_open,
+		.read = ra_fops_read,
+		.close = rollout_fops_close,
+	};
+
+	printf(SUB_1 "Testing file read-ahead errors -- ");
+
+	ra_fail_reads = 0;
+	if (osdp_file_register_ops(ctx, 0, &ops) ||
+	    osdp_file_tx_command(pd, 1, 0, 0)) {
+		printf("failed! transfer not started\n");
+		return -1;
+	}
+	ref_len = osdp_file_cmd_tx_build(pd, buf, sizeof(buf));
+	if (ref_len <= (int)TEST_RA_HDR_SIZE) {
+		printf("failed! chunk len:%d\n", ref_len);
+		return -1;
+	}
+
+	/* a failed prefetch is retried when the chunk is due */
+	TO_FILE(pd)->ra.len = 0;
+	ra_fail_reads = 1;
+	osdp_file_tx_prefetch(pd);
+	if (!TO_FILE(pd)->ra.error || test_ra_build(pd, ref_len)) {
+		return -1;
+	}
+	if (TO_FILE(pd)->ra.error) {
+		printf("failed! error not cleared after refill\n");
+		return -1;
+	}
+
+	/* a failed refill falls back to a direct read of the chunk */
+	TO_FILE(pd)->ra.len = 0;
+	ra_fail_reads = 1;
+	if (test_ra_build(pd, ref_len)) {
+		return -1;
+	}
+
+	/* only when that fails too is the transfer aborted */
+	TO_FILE(pd)->ra.len = 0;
+	ra_fail_reads = 2;
+	if (test_ra_build(pd, -1) ||
+	    TO_FILE(pd)->state != OSDP_FILE_IDLE) {
+		return -1;
+	}
+	printf("success!\n");
+	return 0;
+}
+
+#endif /* CONFIG_OSDP_FILE_READ_AHEAD */
+
+void run_file_ra_tests(struct test *t)
+{
+#ifdef CONFIG_OSDP_FILE_READ_AHEAD
+	printf("\nBegin file read-ahead tests\n");
+
+	if (test_file_cp_setup(t, 1))
+		return;
+
+	DO_TEST(t, test_file_ra_error);
+
+	osdp_cp_teardown(t->mock_data);
+#else
+	ARG_UNUSED(t);
+#endif
+}
+
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+
+#define TEST_LZ_FILE_SIZE   (16 * 1024)
+#define TEST_LZ_FILE_ID     1
+#define TEST_LZ_PACKET_SIZE 128
+
+static uint8_t lz_send_file[TEST_LZ_FILE_SIZE];
+static uint8_t lz_rec_file[TEST_LZ_FILE_SIZE];
+
+static int lz_fops_open(void *arg, int file_id, int *size)
+{
+	ARG_UNUSED(file_id);
+	if (arg == lz_send_file) {
+		*size = TEST_LZ_FILE_SIZE;
+	}
+	return 0;
+}
+
+static int lz_fops_read(void *arg, void *buf, int size, int offset)
+{
+	if (offset + size > TEST_LZ_FILE_SIZE) {
+		size = TEST_LZ_FILE_SIZE - offset;
+	}
+	memcpy(buf, (uint8_t *)arg + offset, size);
+	return size;
+}
+
+static int lz_fops_write(void *arg, const void *buf, int size, int offset)
+{
+	if (offset + size > TEST_LZ_FILE_SIZE) {
+		return -1;
+	}
+	memcpy((uint8_t *)arg + offset, buf, size);
+	return size;
+}
+
+static int lz_fops_close(void *arg)
+{
+	ARG_UNUSED(arg);
+	return 0;
+}
+
+static struct osdp_file_ops lz_sender_ops = {
+	.arg = lz_send_file,
+	.open = lz_fops_open,
+	.read = lz_fops_read,
+	.close = lz_fops_close,
+};
+
+static struct osdp_file_ops lz_receiver_ops = {
+	.arg = lz_rec_file,
+	.open = lz_fops_open,
+	.write = lz_fops_write,
+	.close = lz_fops_close,
+};
+
+static void test_lz_fill_file(void)
+{
+	int i = 0;
+	const char *w, *words[] = { "osdp ", "file ", "transfer ", "chunk ",
+				    "offset ", "\x7f\x45\x4c\x46" };
+
+	/* compresses well, mostly against the file data before it */
+	while (i < TEST_LZ_FILE_SIZE) {
+		if (rand() % 8 == 0) {
+			lz_send_file[i++] = rand();
+			continue;
+		}
+		w = words[rand() % 6];
+		while (*w && i < TEST_LZ_FILE_SIZE) {
+			lz_send_file[i++] = *w++;
+		}
+	}
+	memset(lz_rec_file, 0, sizeof(lz_rec_file));
+}
+
+/**
+ * Carry the next chunk from the CP to the PD and the PD's FTSTAT back. If
+ * @pd_lz is false, the FTSTAT looks like it came from a PD that can't take
+ * compressed chunks; if @lose_dict is set, the PD forgets the file data it
+ * has seen so far. Returns the type of the chunk sent or -1 on errors.
+ */
+static int test_lz_xfer(struct osdp_pd *cp_pd, struct osdp_pd *pd_pd,
+			bool pd_lz, bool lose_dict)
+{
+	int len;
+	uint8_t buf[TEST_LZ_PACKET_SIZE];
+	uint8_t stat[sizeof(struct osdp_cmd_file_stat)];
+
+	len = osdp_file_cmd_tx_build(cp_pd, buf, sizeof(buf));
+	if (len <= 0) {
+		return -1;
+	}
+	if (lose_dict) {
+		TO_FILE(pd_pd)->lz.len = 0;
+	}
+	if (osdp_file_cmd_tx_decode(pd_pd, buf, len) ||
+	    osdp_file_cmd_stat_build(pd_pd, stat, sizeof(stat)) < 0) {
+		return -1;
+	}
+	if (!pd_lz) {
+		stat[0] &= ~0x08;
+	}
+	if (osdp_file_cmd_stat_decode(cp_pd, stat, sizeof(stat))) {
+		return -1;
+	}
+	return buf[0];
+}
+
+static bool test_file_lz_transfer(osdp_t *cp_ctx, osdp_t *pd_ctx, bool pd_lz)
+{
+	int type, num_chunks = 0, num_lz = 0;
+	bool lose_dict, rejected = false;
+	struct osdp_pd *cp_pd = osdp_to_pd(cp_ctx, 0);
+	struct osdp_pd *pd_pd = osdp_to_pd(pd_ctx, 0);
+
+	printf(SUB_1 "Testing %s file transfer -- ",
+	       pd_lz ? "compressed" : "uncompressed");
+
+	test_lz_fill_file();
+	if (osdp_file_tx_command(cp_pd, TEST_LZ_FILE_ID, 0, 0)) {
+		printf("failed! transfer not started\n");
+		return false;
+	}
+
+	while (TO_FILE(cp_pd)->state == OSDP_FILE_INPROG) {
+		/* half way through, the PD loses its dictionary once */
+		lose_dict = pd_lz && !rejected &&
+			    TO_FILE(cp_pd)->offset > TEST_LZ_FILE_SIZE / 2;
+		type = test_lz_xfer(cp_pd, pd_pd, pd_lz, lose_dict);
+		if (type < 0 || num_chunks++ > TEST_LZ_FILE_SIZE) {
+			printf("failed! chunk:%d\n", num_chunks);
+			return false;
+		}
+		if (num_chunks == 1 && type != TEST_LZ_FILE_ID) {
+			/* CP doesn't know what the PD can take yet */
+			printf("failed! first chunk compressed\n");
+			return false;
+		}
+		if (lose_dict) {
+			/* the PD rejects it; CP must send it again in plain */
+			rejected = true;
+			if (type != OSDP_FILE_TYPE_LZ ||
+			    test_lz_xfer(cp_pd, pd_pd, true, false) !=
+				    TEST_LZ_FILE_ID) {
+				printf("failed! no plain retry\n");
+				return false;
+			}
+			num_chunks++;
+		}
+		if (type == OSDP_FILE_TYPE_LZ) {
+			num_lz++;
+		}
+	}
+
+	if (TO_FILE(cp_pd)->state != OSDP_FILE_DONE ||
+	    TO_FILE(pd_pd)->state != OSDP_FILE_DONE ||
+	    memcmp(lz_send_file, lz_rec_file, TEST_LZ_FILE_SIZE) != 0) {
+		printf("failed! file mismatch\n");
+		return false;
+	}
+	if (pd_lz ? (num_lz == 0 || !rejected) : num_lz != 0) {
+		printf("failed! compressed chunks:%d\n", num_lz);
+		return false;
+	}
+	printf("success! (%d chunks)\n", num_chunks);
+	return true;
+}
+
+static bool test_file_lz_file_id(osdp_t *cp_ctx, osdp_t *pd_ctx)
+{
+	int len = 0;
+	struct osdp_pd *pd_pd = osdp_to_pd(pd_ctx, 0);
+	uint8_t buf[sizeof(struct osdp_cmd_file_xfer) + 64];
+
+	printf(SUB_1 "Testing file ID %d -- ", OSDP_FILE_TYPE_LZ);
+
+	/* it's only reserved on a CP that compresses */
+	if (osdp_file_tx_command(osdp_to_pd(cp_ctx, 0),
+				 OSDP_FILE_TYPE_LZ, 0, 0) == 0) {
+		printf("failed! CP sent file ID %d\n", OSDP_FILE_TYPE_LZ);
+		return false;
+	}
+
+	/* but another CP may send it */
+	test_lz_fill_file();
+	U8_TO_BYTES_LE(OSDP_FILE_TYPE_LZ, buf, len);
+	U32_TO_BYTES_LE(64, buf, len);
+	U32_TO_BYTES_LE(0, buf, len);
+	U16_TO_BYTES_LE(64, buf, len);
+	memcpy(buf + len, lz_send_file, 64);
+	len += 64;
+	if (osdp_file_cmd_tx_decode(pd_pd, buf, len) ||
+	    osdp_file_cmd_stat_build(pd_pd, buf, sizeof(buf)) < 0 ||
+	    TO_FILE(pd_pd)->state != OSDP_FILE_DONE ||
+	    memcmp(lz_send_file, lz_rec_file, 64) != 0) {
+		printf("failed! PD didn't take it\n");
+		return false;
+	}
+	printf("success!\n");
+	return true;
+}
+
+#endif /* CONFIG_OSDP_FILE_COMPRESSION */
+
+void run_file_lz_tests(struct test *t)
+{
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	osdp_t *cp_ctx = NULL, *pd_ctx = NULL;
+	osdp_pd_info_t info = {
+		.address = 101,
+		.baud_rate = 9600,
+		.channel.send = chunk_mock_send,
+		.channel.recv = chunk_mock_receive,
+	};
+
+	printf("\nBegin compressed file transfer tests\n");
+
+	osdp_logger_init("osdp", t->loglevel, NULL);
+	cp_ctx = osdp_cp_setup(1, &info);
+	pd_ctx = osdp_pd_setup(&info);
+	if (cp_ctx == NULL || pd_ctx == NULL) {
+		printf(SUB_1 "init failed!\n");
+		goto out;
+	}
+	osdp_file_register_ops(cp_ctx, 0, &lz_sender_ops);
+	osdp_file_register_ops(pd_ctx, 0, &lz_receiver_ops);
+
+	TEST_REPORT(t, test_file_lz_transfer(cp_ctx, pd_ctx, true));
+	TEST_REPORT(t, test_file_lz_transfer(cp_ctx, pd_ctx, false));
+	TEST_REPORT(t, test_file_lz_file_id(cp_ctx, pd_ctx));
+out:
+	if (cp_ctx)
+		osdp_cp_teardown(cp_ctx);
+	if (pd_ctx)
+		osdp_pd_teardown(pd_ctx);
+#else
+	ARG_UNUSED(t);
+#endif
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2024 Siddharth Chandrasekaran <sidcha.dev@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "test.h"
+#include "osdp_lz.h"
+
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+
+#define TEST_LZ_DATA_SIZE 4096
+
+static uint8_t lz_data[TEST_LZ_DATA_SIZE];
+static uint8_t lz_block[TEST_LZ_DATA_SIZE + 64];
+static uint8_t lz_out[TEST_LZ_DATA_SIZE];
+
+static void test_lz_fill(uint8_t *buf, int len)
+{
+	int i;
+	const char *words[] = { "osdp ", "file ", "transfer ", "chunk ",
+				"offset ", "\x7f\x45\x4c\x46", "\x90\x90\x90" };
+	const int num_words = sizeof(words) / sizeof(words[0]);
+
+	/* text and binary like data; compresses, but not to nothing */
+	for (i = 0; i < len; i++) {
+		if (rand() % 8 == 0) {
+			buf[i] = rand();
+		} else {
+			const char *w = words[rand() % num_words];
+			while (*w && i < len) {
+				buf[i++] = *w++;
+			}
+			i--;
+		}
+	}
+}
+
+static int test_lz_round_trip(void *arg)
+{
+	int used, len;
+
+	ARG_UNUSED(arg);
+	printf(SUB_1 "Testing osdp_lz round trip -- ");
+	used = TEST_LZ_DATA_SIZE;
+	len = osdp_lz_compress(lz_data, 0, &used, lz_block, sizeof(lz_block));
+	if (len <= 0 || used != TEST_LZ_DATA_SIZE || len >= used) {
+		printf("failed! len:%d used:%d\n", len, used);
+		return -1;
+	}
+	if (osdp_lz_decompress(lz_block, len, lz_out, 0, sizeof(lz_out)) != used ||
+	    memcmp(lz_out, lz_data, used)) {
+		printf("failed! data mismatch\n");
+		return -1;
+	}
+	printf("success!\n");
+	return 0;
+}
+
+static int test_lz_budget(void *arg)
+{
+	int used, len, budget;
+
+	ARG_UNUSED(arg);
+	printf(SUB_1 "Testing osdp_lz output budget -- ");
+	for (budget = 0; budget <= 256; budget += 16) {
+		used = TEST_LZ_DATA_SIZE;
+		len = osdp_lz_compress(lz_data, 0, &used, lz_block, budget);
+		if (len < 0 || len > budget || used > TEST_LZ_DATA_SIZE) {
+			printf("failed! budget:%d len:%d used:%d\n",
+			       budget, len, used);
+			return -1;
+		}
+		if (osdp_lz_decompress(lz_block, len, lz_out, 0,
+				       sizeof(lz_out)) != used ||
+		    memcmp(lz_out, lz_data, used)) {
+			printf("failed! budget:%d data mismatch\n", budget);
+			return -1;
+		}
+	}
+	printf("success!\n");
+	return 0;
+}
+
+static int test_lz_dictionary(void *arg)
+{
+	int used, plain_used, len, dict_len = TEST_LZ_DATA_SIZE / 2;
+
+	ARG_UNUSED(arg);
+	printf(SUB_1 "Testing osdp_lz dictionary -- ");
+
+	/* second half repeats the first; the dictionary must help there */
+	memcpy(lz_out, lz_data, dict_len);
+	memcpy(lz_out + dict_len, lz_data, dict_len);
+	plain_used = dict_len;
+	osdp_lz_compress(lz_out + dict_len, 0, &plain_used, lz_block, 64);
+	used = dict_len;
+	len = osdp_lz_compress(lz_out, dict_len, &used, lz_block, 64);
+	if (len <= 0 || used <= plain_used) {
+		printf("failed! len:%d used:%d/%d\n", len, used, plain_used);
+		return -1;
+	}
+
+	memset(lz_out + dict_len, 0, dict_len);
+	if (osdp_lz_decompress(lz_block, len, lz_out, dict_len,
+			       dict_len) != used ||
+	    memcmp(lz_out + dict_len, lz_data, used)) {
+		printf("failed! data mismatch\n");
+		return -1;
+	}
+
+	/* a decoder without that history must refuse the block */
+	if (osdp_lz_decompress(lz_block, len, lz_out + dict_len, 0,
+			       dict_len) != -1) {
+		printf("failed! decoded without dictionary\n");
+		return -1;
+	}
+	printf("success!\n");
+	return 0;
+}
+
+static int test_lz_malformed(void *arg)
+{
+	int i, used, len;
+	uint8_t bad_offset[] = { 0x10, 'a', 0x05, 0x00 };
+	uint8_t bad_length[] = { 0xf0, 0xff };
+
+	ARG_UNUSED(arg);
+	printf(SUB_1 "Testing osdp_lz malformed blocks -- ");
+	if (osdp_lz_decompress(bad_offset, sizeof(bad_offset), lz_out, 0,
+			       sizeof(lz_out)) != -1 ||
+	    osdp_lz_decompress(bad_length, sizeof(bad_length), lz_out, 0,
+			       sizeof(lz_out)) != -1) {
+		printf("failed! accepted bad block\n");
+		return -1;
+	}
+
+	used = TEST_LZ_DATA_SIZE;
+	len = osdp_lz_compress(lz_data, 0, &used, lz_block, sizeof(lz_block));
+	if (osdp_lz_decompress(lz_block, len, lz_out, 0, used - 1) != -1) {
+		printf("failed! overran output\n");
+		return -1;
+	}
+
+	/* truncated or corrupt blocks must never write past the output */
+	for (i = 1; i < len; i += 7) {
+		osdp_lz_decompress(lz_block, len - i, lz_out, 0, sizeof(lz_out));
+		lz_block[i] ^= rand();
+		osdp_lz_decompress(lz_block, len, lz_out, 0, sizeof(lz_out));
+	}
+	printf("success!\n");
+	return 0;
+}
+
+#endif /* CONFIG_OSDP_FILE_COMPRESSION */
+
+void run_lz_tests(struct test *t)
+{
+#ifdef CONFIG_OSDP_FILE_COMPRESSION
+	printf("\nBegin osdp_lz tests\n");
+
+	test_lz_fill(lz_data, TEST_LZ_DATA_SIZE);
+
+	DO_TEST(t, test_lz_round_trip);
+	DO_TEST(t, test_lz_budget);
+	DO_TEST(t, test_lz_dictionary);
+	DO_TEST(t, test_lz_malformed);
+#else
+	ARG_UNUSED(t);
+#endif
+}
@@ -0,0 +1,702 @@
+/*
+ * Copyright (c) 2024 Siddharth Chandrasekaran <sidcha.dev@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "test.h"
+#include "osdp_file.h"
+
+extern int (*test_pd_decode_command)(struct osdp_pd *pd, uint8_t *buf,
+				     int len);
+extern int (*test_pd_send_reply)(struct osdp_pd *pd);
+extern int (*test_pd_build_reply)(struct osdp_pd *pd, uint8_t *buf,
+				  int max_len);
+
+static uint8_t test_pd_tx_buf[256];
+static int test_pd_tx_len;
+static int test_pd_tx_count;
+
+static int test_pd_mock_send(void *data, uint8_t *buf, int len)
+{
+	ARG_UNUSED(data);
+	test_pd_tx_count++;
+	if (len <= (int)sizeof(test_pd_tx_buf)) {
+		memcpy(test_pd_tx_buf, buf, len);
+		test_pd_tx_len = len;
+	}
+	return len;
+}
+
+static int test_pd_mock_receive(void *data, uint8_t *buf, int len)
+{
+	ARG_UNUSED(data);
+	ARG_UNUSED(buf);
+	ARG_UNUSED(len);
+	return 0;
+}
+
+static int test_pd_command(struct osdp_pd *pd, uint8_t *buf, int len,
+			   int reply_id)
+{
+	test_pd_decode_command(pd, buf, len);
+	if (pd->reply_id != reply_id) {
+		printf("failed! CMD(%02x) got reply %02x, expected %02x\n",
+		       buf[0], pd->reply_id, reply_id);
+		return -1;
+	}
+	if (test_pd_send_reply(pd)) {
+		printf("failed! CMD(%02x) reply not sent\n", buf[0]);
+		return -1;
+	}
+	return 0;
+}
+
+static int test_pd_scrypt_without_chlng(struct osdp *ctx)
+{
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	uint8_t chlng[1 + 8] = { CMD_CHLNG };
+	uint8_t scrypt[1 + 16] = { CMD_SCRYPT };
+
+	printf(SUB_1 "Testing CMD_SCRYPT without CMD_CHLNG -- ");
+
+	/* no handshake yet; there are no session keys to check against */
+	if (test_pd_command(pd, scrypt, sizeof(scrypt), REPLY_NAK)) {
+		return -1;
+	}
+	if (pd->ephemeral_data[0] != OSDP_PD_NAK_SC_COND) {
+		printf("failed! NAK reason %d\n", pd->ephemeral_data[0]);
+		return -1;
+	}
+
+	/* a CHLNG allows exactly one SCRYPT */
+	if (test_pd_command(pd, chlng, sizeof(chlng), REPLY_CCRYPT) ||
+	    test_pd_command(pd, scrypt, sizeof(scrypt), REPLY_RMAC_I) ||
+	    test_pd_command(pd, scrypt, sizeof(scrypt), REPLY_NAK)) {
+		return -1;
+	}
+	if (sc_is_active(pd)) {
+		printf("failed! SC active with a bogus cryptogram\n");
+		return -1;
+	}
+	printf("success!\n");
+	return 0;
+}
+
+static int deferred_calls;
+
+static int test_pd_deferred_cmd_callback(void *arg, struct osdp_cmd *cmd)
+{
+	ARG_UNUSED(arg);
+	ARG_UNUSED(cmd);
+	deferred_calls++;
+	return OSDP_PD_CMD_DEFERRED;
+}
+
+static int test_pd_deferred_cmd(struct osdp *ctx)
+{
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	struct osdp_event *event = (struct osdp_event *)pd->ephemeral_data;
+	uint8_t lstat[1] = { CMD_LSTAT };
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_STATUS,
+		.status = {
+			.type = OSDP_STATUS_REPORT_LOCAL,
+			.nr_entries = 2,
+			.mask = 0x02,
+		},
+	};
+
+	printf(SUB_1 "Testing deferred commands -- ");
+
+	deferred_calls = 0;
+	osdp_pd_set_command_callback(ctx, test_pd_deferred_cmd_callback, NULL);
+
+	/* app defers; PD stays BUSY however often the CP retries */
+	pd->seq_number = 1;
+	if (test_pd_command(pd, lstat, sizeof(lstat), REPLY_BUSY) ||
+	    test_pd_command(pd, lstat, sizeof(lstat), REPLY_BUSY)) {
+		return -1;
+	}
+	if (deferred_calls != 1) {
+		printf("failed! callback made %d times\n", deferred_calls);
+		return -1;
+	}
+
+	/* the CP's next retry gets the reply the app completed it with */
+	if (osdp_pd_complete_command(ctx, &cmd, 0) ||
+	    test_pd_command(pd, lstat, sizeof(lstat), REPLY_LSTATR)) {
+		return -1;
+	}
+	if (deferred_calls != 1 || event->type != OSDP_EVENT_STATUS ||
+	    event->status.mask != cmd.status.mask) {
+		printf("failed! wrong LSTATR\n");
+		return -1;
+	}
+	if (osdp_pd_complete_command(ctx, &cmd, 0) == 0) {
+		printf("failed! completed twice\n");
+		return -1;
+	}
+
+	/* a CP that moves on abandons the deferred command */
+	if (test_pd_command(pd, lstat, sizeof(lstat), REPLY_BUSY)) {
+		return -1;
+	}
+	pd->seq_number = 2;
+	if (test_pd_command(pd, lstat, sizeof(lstat), REPLY_BUSY) ||
+	    deferred_calls != 3) {
+		printf("failed! deferred command not abandoned\n");
+		return -1;
+	}
+
+	osdp_pd_set_command_callback(ctx, NULL, NULL);
+	printf("success!\n");
+	return 0;
+}
+
+/* osdp_phy_send_ack() must send what the generic reply path would have */
+static int test_pd_ack_frame(struct osdp_pd *pd, int seq)
+{
+	uint8_t buf[128], fast[128];
+	int i, len, fast_len;
+
+	pd->seq_number = seq;
+	pd->reply_id = REPLY_ACK;
+	for (i = 0; i < 2; i++) {
+		/* first one builds the cache entry, second one uses it */
+		if (osdp_phy_send_ack(pd)) {
+			printf("failed! fast ACK send\n");
+			return -1;
+		}
+		fast_len = test_pd_tx_len;
+		memcpy(fast, test_pd_tx_buf, fast_len);
+
+		/* the way pd_send_reply() builds any other reply */
+		len = osdp_phy_packet_init(pd, buf, sizeof(buf));
+		if (len > 0) {
+			len += test_pd_build_reply(pd, buf, sizeof(buf));
+		}
+		if (len <= 0 || osdp_phy_send_packet(pd, buf, len, sizeof(buf))) {
+			printf("failed! ACK send\n");
+			return -1;
+		}
+		if (fast_len != test_pd_tx_len ||
+		    memcmp(fast, test_pd_tx_buf, fast_len) != 0) {
+			printf("failed! SC: %d SEQ: %d ACK frames differ\n",
+			       sc_is_active(pd), seq);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int test_pd_ack_cache(struct osdp *ctx)
+{
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	uint8_t chlng[1 + 8] = { CMD_CHLNG };
+	int seq, mark, rc = -1;
+
+	printf(SUB_1 "Testing cached ACK frames -- ");
+
+	/* a CHLNG sets up the session keys the SC ACK is MAC-ed with */
+	if (test_pd_command(pd, chlng, sizeof(chlng), REPLY_CCRYPT)) {
+		return -1;
+	}
+
+	for (mark = 0; mark < 2; mark++) {
+		if (mark) {
+			SET_FLAG(pd, PD_FLAG_PKT_HAS_MARK);
+		} else {
+			CLEAR_FLAG(pd, PD_FLAG_PKT_HAS_MARK);
+		}
+		for (seq = 0; seq < 4; seq++) {
+			if (test_pd_ack_frame(pd, seq)) {
+				goto out;
+			}
+		}
+		sc_activate(pd);
+		for (seq = 0; seq < 4; seq++) {
+			if (test_pd_ack_frame(pd, seq)) {
+				goto out;
+			}
+		}
+		/* keep the session keys for the next round */
+		CLEAR_FLAG(pd, PD_FLAG_SC_ACTIVE);
+	}
+
+	/* a new address must not be answered from stale entries */
+	pd->address += 1;
+	if (test_pd_ack_frame(pd, 1)) {
+		goto out;
+	}
+	rc = 0;
+	printf("success!\n");
+out:
+	pd->address = 101;
+	pd->seq_number = 0;
+	CLEAR_FLAG(pd, PD_FLAG_PKT_HAS_MARK);
+	sc_deactivate(pd);
+	return rc;
+}
+
+/* A plaintext command frame (with mark byte) for the PD under test */
+static int test_pd_cmd_frame(uint8_t *buf, int seq, uint8_t cmd_id)
+{
+	int len = 0;
+	uint16_t crc;
+
+	buf[len++] = 0xff;
+	buf[len++] = 0x53;
+	buf[len++] = 101;
+	buf[len++] = 0x08;
+	buf[len++] = 0x00;
+	buf[len++] = seq | 0x04; /* CRC */
+	buf[len++] = cmd_id;
+	crc = osdp_compute_crc16(buf + 1, len - 1);
+	buf[len++] = BYTE_0(crc);
+	buf[len++] = BYTE_1(crc);
+	return len;
+}
+
+static int test_pd_feed(struct osdp *ctx)
+{
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	uint8_t buf[32];
+	int len, rc = -1;
+
+	printf(SUB_1 "Testing osdp_pd_feed -- ");
+
+	osdp_pd_flush_events(ctx);
+	pd->channel.recv = NULL;
+	pd->seq_number = 0;
+	test_pd_tx_count = 0;
+
+	/* a partial frame is held until the rest of it arrives */
+	len = test_pd_cmd_frame(buf, 1, CMD_POLL);
+	if (osdp_pd_feed(ctx, buf, 4) != 4 || test_pd_tx_count != 0) {
+		printf("failed! replied to a partial frame\n");
+		goto out;
+	}
+	if (osdp_pd_feed(ctx, buf + 4, len - 4) != len - 4 ||
+	    test_pd_tx_count != 1 || pd->reply_id != REPLY_ACK) {
+		printf("failed! no reply to the full frame\n");
+		goto out;
+	}
+
+	/* every command in a single feed is replied to before it returns */
+	len = test_pd_cmd_frame(buf, 2, CMD_POLL);
+	len += test_pd_cmd_frame(buf + len, 3, CMD_POLL);
+	if (osdp_pd_feed(ctx, buf, len) != len || test_pd_tx_count != 3) {
+		printf("failed! %d replies to 2 frames\n", test_pd_tx_count - 1);
+		goto out;
+	}
+	if (osdp_pd_feed(ctx, NULL, 1) != -1) {
+		printf("failed! NULL buffer accepted\n");
+		goto out;
+	}
+	rc = 0;
+	printf("success!\n");
+out:
+	pd->channel.recv = test_pd_mock_receive;
+	return rc;
+}
+
+static void test_pd_make_event(struct osdp_event *event, int type, int tag)
+{
+	memset(event, 0, sizeof(struct osdp_event));
+	event->type = type;
+	switch (type) {
+	case OSDP_EVENT_CARDREAD:
+		event->cardread.format = OSDP_CARD_FMT_RAW_WIEGAND;
+		event->cardread.length = 8;
+		event->cardread.data[0] = tag;
+		break;
+	case OSDP_EVENT_KEYPRESS:
+		event->keypress.length = 1;
+		event->keypress.data[0] = tag;
+		break;
+	default:
+		event->status.type = OSDP_STATUS_REPORT_LOCAL;
+		event->status.nr_entries = 8;
+		event->status.mask = tag;
+		break;
+	}
+}
+
+static int test_pd_notify(struct osdp *ctx, int type, int tag)
+{
+	struct osdp_event event;
+
+	test_pd_make_event(&event, type, tag);
+	return osdp_pd_notify_event(ctx, &event);
+}
+
+/* POLL the PD and check that it replied with the event tagged `tag` */
+static int test_pd_poll(struct osdp_pd *pd, int reply_id, int tag)
+{
+	struct osdp_event *event = (struct osdp_event *)pd->ephemeral_data;
+	uint8_t poll[1] = { CMD_POLL };
+	int got;
+
+	if (test_pd_command(pd, poll, sizeof(poll), reply_id)) {
+		return -1;
+	}
+	if (reply_id == REPLY_ACK) {
+		return 0;
+	}
+	if (event->type == OSDP_EVENT_STATUS) {
+		got = (int)event->status.mask;
+	} else if (event->type == OSDP_EVENT_KEYPRESS) {
+		got = event->keypress.data[0];
+	} else {
+		got = event->cardread.data[0];
+	}
+	if (got != tag) {
+		printf("failed! POLL got event %d, expected %d\n", got, tag);
+		return -1;
+	}
+	return 0;
+}
+
+static int test_pd_event_merge(struct osdp *ctx)
+{
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	struct osdp_event event;
+
+	printf(SUB_1 "Testing status event merging -- ");
+
+	osdp_pd_flush_events(ctx);
+
+	/* a newer local status replaces the queued one; input status stays */
+	test_pd_make_event(&event, OSDP_EVENT_STATUS, 0x02);
+	event.status.type = OSDP_STATUS_REPORT_INPUT;
+	if (test_pd_notify(ctx, OSDP_EVENT_STATUS, 0x01) ||
+	    osdp_pd_notify_event(ctx, &event) ||
+	    test_pd_notify(ctx, OSDP_EVENT_STATUS, 0x03)) {
+		printf("failed! notify\n");
+		return -1;
+	}
+	if (test_pd_poll(pd, REPLY_LSTATR, 0x03) ||
+	    test_pd_poll(pd, REPLY_ISTATR, 0x02) ||
+	    test_pd_poll(pd, REPLY_ACK, 0)) {
+		return -1;
+	}
+
+	printf("success!\n");
+	return 0;
+}
+
+static int test_pd_event_order(struct osdp *ctx)
+{
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+
+	printf(SUB_1 "Testing event order -- ");
+
+	osdp_pd_flush_events(ctx);
+
+	/* card reads and keypresses go out in order, ahead of the status */
+	if (test_pd_notify(ctx, OSDP_EVENT_STATUS, 1) ||
+	    test_pd_notify(ctx, OSDP_EVENT_KEYPRESS, 2) ||
+	    test_pd_notify(ctx, OSDP_EVENT_CARDREAD, 3)) {
+		printf("failed! notify\n");
+		return -1;
+	}
+	if (test_pd_poll(pd, REPLY_KEYPAD, 2) ||
+	    test_pd_poll(pd, REPLY_RAW, 3) ||
+	    test_pd_poll(pd, REPLY_LSTATR, 1) ||
+	    test_pd_poll(pd, REPLY_ACK, 0)) {
+		return -1;
+	}
+
+	printf("success!\n");
+	return 0;
+}
+
+static int test_pd_event_overflow(struct osdp *ctx)
+{
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	int i, max;
+
+	printf(SUB_1 "Testing event queue overflow -- ");
+
+	osdp_pd_flush_events(ctx);
+	if (pd->event_policy != OSDP_PD_EVENT_OVERFLOW_DROP_STATUS ||
+	    osdp_pd_set_event_overflow_policy(ctx, 42) == 0) {
+		printf("failed! default/invalid policy\n");
+		return -1;
+	}
+
+	/* REJECT: a full queue refuses the new event and is left as is */
+	osdp_pd_set_event_overflow_policy(ctx, OSDP_PD_EVENT_OVERFLOW_REJECT);
+	for (max = 0; max < 256; max++) {
+		if (test_pd_notify(ctx, OSDP_EVENT_KEYPRESS, max)) {
+			break;
+		}
+	}
+	if (max < 2 || max == 256) {
+		printf("failed! queue holds %d events\n", max);
+		return -1;
+	}
+	if (test_pd_poll(pd, REPLY_KEYPAD, 0) ||
+	    osdp_pd_flush_events(ctx) != max - 1) {
+		return -1;
+	}
+
+	/* DROP_STATUS: the status goes first; then the new event is refused */
+	osdp_pd_set_event_overflow_policy(ctx,
+					  OSDP_PD_EVENT_OVERFLOW_DROP_STATUS);
+	test_pd_notify(ctx, OSDP_EVENT_STATUS, 0);
+	for (i = 1; i < max; i++) {
+		test_pd_notify(ctx, OSDP_EVENT_KEYPRESS, i);
+	}
+	if (test_pd_notify(ctx, OSDP_EVENT_KEYPRESS, max) ||
+	    test_pd_notify(ctx, OSDP_EVENT_KEYPRESS, max + 1) == 0) {
+		printf("failed! DROP_STATUS notify\n");
+		return -1;
+	}
+	for (i = 1; i <= max; i++) {
+		if (test_pd_poll(pd, REPLY_KEYPAD, i)) {
+			return -1;
+		}
+	}
+	if (test_pd_poll(pd, REPLY_ACK, 0)) {
+		return -1;
+	}
+
+	/* DROP_OLDEST: the head goes, whatever it is */
+	osdp_pd_set_event_overflow_policy(ctx,
+					  OSDP_PD_EVENT_OVERFLOW_DROP_OLDEST);
+	for (i = 0; i < max; i++) {
+		test_pd_notify(ctx, OSDP_EVENT_KEYPRESS, i);
+	}
+	if (test_pd_notify(ctx, OSDP_EVENT_KEYPRESS, max) ||
+	    test_pd_poll(pd, REPLY_KEYPAD, 1) ||
+	    osdp_pd_flush_events(ctx) != max - 1) {
+		printf("failed! DROP_OLDEST\n");
+		return -1;
+	}
+
+	osdp_pd_set_event_overflow_policy(ctx,
+					  OSDP_PD_EVENT_OVERFLOW_DROP_STATUS);
+	printf("success!\n");
+	return 0;
+}
+
+#ifdef CONFIG_OSDP_FILE_WRITE_BEHIND
+
+#define TEST_WB_FILE_SIZE (2 * OSDP_FILE_WB_PAGE_SIZE)
+#define TEST_WB_CHUNK_LEN (100)
+
+static uint8_t wb_file[TEST_WB_FILE_SIZE];
+static int wb_fail_writes;
+
+static int test_wb_open(void *arg, int file_id, int *size)
+{
+	ARG_UNUSED(arg);
+	ARG_UNUSED(file_id);
+	ARG_UNUSED(size);
+	return 0;
+}
+
+static int test_wb_write(void *arg, const void *buf, int size, int offset)
+{
+	ARG_UNUSED(arg);
+	if (wb_fail_writes > 0) {
+		wb_fail_writes--;
+		return -1;
+	}
+	memcpy(wb_file + offset, buf, size);
+	return size;
+}
+
+static int test_wb_close(void *arg)
+{
+	ARG_UNUSED(arg);
+	return 0;
+}
+
+/* Send the chunk at offset to the PD; returns the FTSTAT status */
+static int test_wb_chunk(struct osdp_pd *pd, int offset)
+{
+	int i, len = 0, length = TEST_WB_CHUNK_LEN;
+	uint8_t buf[sizeof(struct osdp_cmd_file_xfer) + TEST_WB_CHUNK_LEN];
+
+	if (offset + length > TEST_WB_FILE_SIZE) {
+		length = TEST_WB_FILE_SIZE - offset;
+	}
+	U8_TO_BYTES_LE(1, buf, len);
+	U32_TO_BYTES_LE(TEST_WB_FILE_SIZE, buf, len);
+	U32_TO_BYTES_LE(offset, buf, len);
+	U16_TO_BYTES_LE(length, buf, len);
+	for (i = 0; i < length; i++) {
+		buf[len++] = (uint8_t)(offset + i);
+	}
+	if (osdp_file_cmd_tx_decode(pd, buf, len) ||
+	    osdp_file_cmd_stat_build(pd, buf, sizeof(buf)) < 0) {
+		return -1;
+	}
+	/* layout: struct osdp_cmd_file_stat */
+	return (int16_t)(buf[3] | (buf[4] << 8));
+}
+
+static int test_pd_file_wb_error(struct osdp *ctx)
+{
+	int i, offset, status;
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	struct osdp_file_ops ops = {
+		.open = test_wb_open,
+		.write = test_wb_write,
+		.close = test_wb_close,
+	};
+
+	printf(SUB_1 "Testing file write-behind errors -- ");
+
+	wb_fail_writes = 0;
+	if (osdp_file_register_ops(ctx, 0, &ops)) {
+		printf("failed! file ops not registered\n");
+		return -1;
+	}
+
+	for (offset = 0; offset < TEST_WB_FILE_SIZE;
+	     offset += TEST_WB_CHUNK_LEN) {
+		status = test_wb_chunk(pd, offset);
+		if (status < 0) {
+			printf("failed! offset:%d status:%d\n", offset, status);
+			return -1;
+		}
+		if (TO_FILE(pd)->wb.error) {
+			printf("failed! write error not cleared\n");
+			return -1;
+		}
+		/* fail the first page write; the next chunk retries it */
+		if (offset + TEST_WB_CHUNK_LEN > OSDP_FILE_WB_PAGE_SIZE &&
+		    offset < OSDP_FILE_WB_PAGE_SIZE) {
+			wb_fail_writes = 1;
+			osdp_file_rx_flush(pd);
+			if (!TO_FILE(pd)->wb.error) {
+				printf("failed! write error not seen\n");
+				return -1;
+			}
+			continue;
+		}
+		osdp_file_rx_flush(pd);
+	}
+
+	if (TO_FILE(pd)->state != OSDP_FILE_DONE) {
+		printf("failed! transfer not complete\n");
+		return -1;
+	}
+	for (i = 0; i < TEST_WB_FILE_SIZE; i++) {
+		if (wb_file[i] != (uint8_t)i) {
+			printf("failed! data mismatch at %d\n", i);
+			return -1;
+		}
+	}
+	printf("success!\n");
+	return 0;
+}
+
+static int test_pd_file_wb_abort(struct osdp *ctx)
+{
+	int i, offset, len = 3 * TEST_WB_CHUNK_LEN;
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+	uint8_t abort[1] = { CMD_ABORT };
+	struct osdp_file_ops ops = {
+		.open = test_wb_open,
+		.write = test_wb_write,
+		.close = test_wb_close,
+	};
+
+	printf(SUB_1 "Testing file write-behind abort -- ");
+
+	wb_fail_writes = 0;
+	memset(wb_file, 0, sizeof(wb_file));
+	if (osdp_file_register_ops(ctx, 0, &ops)) {
+		printf("failed! file ops not registered\n");
+		return -1;
+	}
+
+	/* ACK'ed chunks that are still short of a page */
+	for (offset = 0; offset < len; offset += TEST_WB_CHUNK_LEN) {
+		if (test_wb_chunk(pd, offset) < 0) {
+			printf("failed! offset:%d\n", offset);
+			return -1;
+		}
+		osdp_file_rx_flush(pd);
+	}
+	if ((int)TO_FILE(pd)->wb.len != len) {
+		printf("failed! %u bytes staged\n", TO_FILE(pd)->wb.len);
+		return -1;
+	}
+
+	if (test_pd_command(pd, abort, sizeof(abort), REPLY_ACK)) {
+		return -1;
+	}
+	if (TO_FILE(pd)->state != OSDP_FILE_IDLE) {
+		printf("failed! transfer not aborted\n");
+		return -1;
+	}
+	for (i = 0; i < len; i++) {
+		if (wb_file[i] != (uint8_t)i) {
+			printf("failed! staged data lost at %d\n", i);
+			return -1;
+		}
+	}
+	printf("success!\n");
+	return 0;
+}
+
+#endif /* CONFIG_OSDP_FILE_WRITE_BEHIND */
+
+static int test_pd_setup(struct test *t)
+{
+	uint8_t scbk[16] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+	};
+	osdp_pd_info_t info = {
+		.address = 101,
+		.baud_rate = 9600,
+		.flags = 0,
+		.channel.data = NULL,
+		.channel.send = test_pd_mock_send,
+		.channel.recv = test_pd_mock_receive,
+		.channel.flush = NULL,
+		.scbk = scbk,
+	};
+
+	osdp_logger_init("osdp::pd", t->loglevel, NULL);
+	t->mock_data = osdp_pd_setup(&info);
+	if (t->mock_data == NULL) {
+		printf(SUB_1 "init failed!\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void test_pd_teardown(struct test *t)
+{
+	osdp_pd_teardown(t->mock_data);
+}
+
+void run_pd_tests(struct test *t)
+{
+	printf("\nBegin PD tests\n");
+
+	if (test_pd_setup(t))
+		return;
+
+	DO_TEST(t, test_pd_scrypt_without_chlng);
+	DO_TEST(t, test_pd_deferred_cmd);
+	DO_TEST(t, test_pd_event_merge);
+	DO_TEST(t, test_pd_event_order);
+	DO_TEST(t, test_pd_event_overflow);
+	DO_TEST(t, test_pd_ack_cache);
+	DO_TEST(t, test_pd_feed);
+#ifdef CONFIG_OSDP_FILE_WRITE_BEHIND
+	DO_TEST(t, test_pd_file_wb_error);
+	DO_TEST(t, test_pd_file_wb_abort);
+#endif
+
+	test_pd_teardown(t);
+}
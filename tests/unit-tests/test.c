@@ -195,8 +195,16 @@ int test_mock_pd_receive(void *data, uint8_t *buf, int len)
 
 int test_setup_devices(struct test *t, osdp_t **cp, osdp_t **pd)
 {
+	uint8_t b;
+
 	osdp_logger_init("osdp", t->loglevel, NULL);
 
+	/* drop whatever the devices of the last test left on the line */
+	while (CIRCBUF_POP(cp_to_pd_buf, &b) == 0)
+		;
+	while (CIRCBUF_POP(pd_to_cp_buf, &b) == 0)
+		;
+
 	uint8_t scbk[16] = {
 		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
 		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
@@ -298,10 +306,24 @@ int main(int argc, char *argv[])
 
 	run_cp_fsm_tests(&t);
 
+	run_pd_tests(&t);
+
 	run_file_tx_tests(&t, false);
 
+	run_file_tx_chunk_tests(&t);
+
+	run_file_tx_resume_tests(&t);
+
+	run_file_rollout_tests(&t);
+
+	run_file_ra_tests(&t);
+
 	run_command_tests(&t);
 
+	run_lz_tests(&t);
+
+	run_file_lz_tests(&t);
+
 	rc = test_end(&t);
 
 	workqueue_destroy(&test_wq);
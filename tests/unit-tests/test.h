@@ -67,6 +67,13 @@ void run_cp_fsm_tests(struct test *t);
 void run_cp_phy_fsm_tests(struct test *t);
 void run_cp_phy_tests(struct test *t);
 void run_file_tx_tests(struct test *t, bool line_noise);
+void run_file_tx_chunk_tests(struct test *t);
+void run_file_tx_resume_tests(struct test *t);
+void run_file_rollout_tests(struct test *t);
+void run_file_ra_tests(struct test *t);
 void run_command_tests(struct test *t);
+void run_lz_tests(struct test *t);
+void run_file_lz_tests(struct test *t);
+void run_pd_tests(struct test *t);
 
 #endif